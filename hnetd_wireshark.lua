@@ -72,6 +72,8 @@ local tlvs = {
                                               {4, f_interval_ms}},
    },
    [10]={name='trust-verdict'},
+   [11]={name='req-net-state-range'},
+   [12]={name='net-state-range'},
 
    -- hncp content
    [32]={name='version'},
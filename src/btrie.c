@@ -103,21 +103,157 @@ static struct btrie *btrie_node_lookup(struct btrie *n, const pkey_t *key, plen_
 	return n->parent;
 }
 
+/* Nodes are allocated from slabs of BTRIE_SLAB_NODES nodes, shared by all tries,
+ * such that nodes created together are packed together.
+ * Slabs with free nodes are kept in btrie_slabs, most recently freed first.
+ * An empty slab is released, unless it is the only one with free nodes. */
+#define BTRIE_SLAB_NODES 32
+#define BTRIE_CACHE_LINE 64
+#define BTRIE_NODE_SIZE ((sizeof(struct btrie) + BTRIE_CACHE_LINE - 1) & ~(BTRIE_CACHE_LINE - 1))
+#define BTRIE_AVAIL_SIZE ((BTRIE_AVAIL_PLEN + 1) * sizeof(uint32_t))
+
+struct btrie_slab {
+	struct list_head le;  //Linked in btrie_slabs when it has free nodes
+	struct btrie *free;   //Free nodes, linked with their parent pointer
+	unsigned int used;    //Number of allocated nodes
+};
+
+/* Cold part of a node, stored after all the nodes of the slab. */
+struct btrie_cold {
+	uint32_t avail[BTRIE_AVAIL_PLEN + 1];
+	struct btrie_slab *slab;
+} __attribute__((aligned(BTRIE_CACHE_LINE)));
+
+static LIST_HEAD(btrie_slabs);
+
+static struct btrie_slab *btrie_slab_new(void)
+{
+	struct btrie_slab *slab;
+	struct btrie_cold *cold;
+	struct btrie *node;
+	uintptr_t nodes;
+	int i;
+	if(!(slab = malloc(sizeof(*slab) + BTRIE_CACHE_LINE - 1 +
+			BTRIE_SLAB_NODES * (BTRIE_NODE_SIZE + sizeof(struct btrie_cold)))))
+		return NULL;
+
+	nodes = ((uintptr_t)(slab + 1) + BTRIE_CACHE_LINE - 1) & ~(uintptr_t)(BTRIE_CACHE_LINE - 1);
+	cold = (struct btrie_cold *)(nodes + BTRIE_SLAB_NODES * BTRIE_NODE_SIZE);
+	slab->free = NULL;
+	slab->used = 0;
+	for(i = BTRIE_SLAB_NODES - 1; i >= 0; i--) {
+		node = (struct btrie *)(nodes + i * BTRIE_NODE_SIZE);
+		cold[i].slab = slab;
+		node->avail = cold[i].avail;
+		node->parent = slab->free;
+		slab->free = node;
+	}
+	list_add(&slab->le, &btrie_slabs);
+	return slab;
+}
+
+static struct btrie *btrie_node_alloc(void)
+{
+	struct btrie_slab *slab;
+	struct btrie *node;
+	if(list_empty(&btrie_slabs) && !btrie_slab_new())
+		return NULL;
+
+	slab = list_first_entry(&btrie_slabs, struct btrie_slab, le);
+	node = slab->free;
+	slab->free = node->parent;
+	slab->used++;
+	if(!slab->free)
+		list_del(&slab->le);
+	return node;
+}
+
+static void btrie_node_free(struct btrie *node)
+{
+	struct btrie_slab *slab = container_of(node->avail, struct btrie_cold, avail)->slab;
+	if(!slab->free) {
+		list_add(&slab->le, &btrie_slabs);
+	} else if(slab->le.prev != &btrie_slabs) {
+		list_move(&slab->le, &btrie_slabs);
+	}
+	node->parent = slab->free;
+	slab->free = node;
+	if(!--slab->used && slab->le.next != &btrie_slabs) {
+		list_del(&slab->le);
+		free(slab);
+	}
+}
+
 static inline struct btrie *btrie_new_node(struct btrie *parent, struct btrie **child)
 {
 	struct btrie *node;
-	if(!(node = malloc(sizeof(struct btrie))))
+	if(!(node = btrie_node_alloc()))
 		return NULL;
 	INIT_LIST_HEAD(&node->elements.l);
 	node->elements.node = NULL;
 	node->parent = parent;
 	node->child[0] = NULL;
 	node->child[1] = NULL;
+	memset(node->avail, 0, BTRIE_AVAIL_SIZE);
 	*child = node;
 	return node;
 }
 
-static void btrie_delete_maybe(struct btrie *n)
+static inline void btrie_avail_inc(uint32_t *avail, int from, int to)
+{
+	if(to > BTRIE_AVAIL_PLEN)
+		to = BTRIE_AVAIL_PLEN;
+	for(; from <= to; from++)
+		avail[from]++;
+}
+
+/* Computes available prefixes counts of a node from its children.
+ * A node containing an element has none. Otherwise, each side without child is
+ * available, as well as the siblings of the path to each child.
+ * A node without element nor child (only root) is available itself. */
+static void btrie_avail_compute(struct btrie *n, uint32_t *avail)
+{
+	struct btrie *c;
+	int i, l;
+	memset(avail, 0, BTRIE_AVAIL_SIZE);
+	if(!list_empty(&n->elements.l))
+		return;
+
+	if(!n->child[0] && !n->child[1]) {
+		btrie_avail_inc(avail, n->plen, n->plen);
+		return;
+	}
+
+	for(i = 0; i < 2; i++) {
+		if(!(c = n->child[i])) {
+			btrie_avail_inc(avail, n->plen + 1, n->plen + 1);
+			continue;
+		}
+		btrie_avail_inc(avail, n->plen + 2, c->plen);
+		for(l = n->plen + 1; l <= BTRIE_AVAIL_PLEN; l++)
+			avail[l] += c->avail[l];
+	}
+}
+
+/* Updates available prefixes counts of a node and all its parents.
+ * Roots do not store them, they are computed when needed. */
+static void btrie_avail_update(struct btrie *n)
+{
+	for(; n && n->avail; n = n->parent)
+		btrie_avail_compute(n, n->avail);
+}
+
+/* Returns the available prefixes counts of a node, using buf for roots. */
+static inline const uint32_t *btrie_avail_get(struct btrie *n, uint32_t *buf)
+{
+	if(n->avail)
+		return n->avail;
+	btrie_avail_compute(n, buf);
+	return buf;
+}
+
+/* Returns the deepest remaining node which subtree was modified. */
+static struct btrie *btrie_delete_maybe(struct btrie *n)
 {
 	struct btrie *o, **c, *p;
 	while(list_empty(&n->elements.l) && n->parent && (!n->child[0] || !n->child[1])) {
@@ -126,7 +262,7 @@ static void btrie_delete_maybe(struct btrie *n)
 			o = n->child[1];
 
 		if(o && !(n->plen & remain_mask))
-			return;
+			return n;
 
 		c = &n->parent->child[0];
 		if(*c != n)
@@ -134,14 +270,15 @@ static void btrie_delete_maybe(struct btrie *n)
 
 		*c = o;
 		p = n->parent;
-		free(n);
+		btrie_node_free(n);
 
 		if(o) {
 			o->parent = p;
-			return;
+			return p;
 		}
 		n = p;
 	}
+	return n;
 }
 
 static struct btrie *btrie_add_leaf(struct btrie *parent, struct btrie **child,
@@ -172,20 +309,21 @@ static struct btrie *btrie_add_leaf(struct btrie *parent, struct btrie **child,
 
 static plen_t btrie_longest_match_node(struct btrie *current, const pkey_t *key, plen_t plen, plen_t min_match)
 {
-	plen_t match_len = min_match;
+	int match_len;
 	plen_t max_match = current->plen;
 	if(plen < max_match)
 		max_match = plen;
 
+	/* The whole block is compared at once, the number of matching bits
+	 * being given by the leading zeros of the difference. */
 	plen_t index = index(min_match - 1);
-	pkey_t no_mask = ~mask(remain(min_match - 1));
-	pkey_t no_maxmask = ~mask(remain(max_match - 1));
 	pkey_t diff = ntohk(key[index]) ^ current->key;
-	while(no_mask != no_maxmask &&
-			(no_mask >>= 1) &&
-			!(diff & (~no_mask))) {
-		++match_len;
-	}
+	match_len = (index << index_shift) +
+			(diff?(__builtin_clzll((unsigned long long)diff) - (64 - BTRIE_KEY)):BTRIE_KEY);
+	if(match_len > max_match)
+		match_len = max_match;
+	if(match_len < min_match)
+		match_len = min_match;
 	return match_len;
 }
 
@@ -257,6 +395,7 @@ int btrie_add(struct btrie *root, struct btrie_element *e, const pkey_t *key, pl
 	if(n) {
 		e->node = n;
 		list_add_tail(&e->l, &n->elements.l);
+		btrie_avail_update(n);
 		return 0;
 	}
 	return -1;
@@ -266,7 +405,7 @@ void btrie_remove(struct btrie_element *e)
 {
 	list_del(&e->l);
 	if(list_empty(&e->node->elements.l))
-		btrie_delete_maybe(e->node);
+		btrie_avail_update(btrie_delete_maybe(e->node));
 }
 
 void btrie_get_key(struct btrie_element *e, btrie_key_t *key)
@@ -695,62 +834,209 @@ struct btrie *btrie_next_available_loop(struct btrie *prev,
 	return p2;
 }
 
+/* Looks for the first node contained in the given key.
+ * Returns -1 if the key is contained in a stored key (nothing is available). */
+static int btrie_avail_top(struct btrie *root, const btrie_key_t *key, btrie_plen_t len, struct btrie **top)
+{
+	struct btrie *n;
+	for(n = btrie_node_lookup(root, key, len); n; n = n->parent)
+		if(!list_empty(&n->elements.l))
+			return -1;
+
+	*top = btrie_first_down_node(root, key, len);
+	return 0;
+}
+
+/* Number of available prefixes of length l within the key, given its first node. */
+static inline uint32_t btrie_avail_at(struct btrie *top, const uint32_t *avail, int len, int l)
+{
+	if(!top)
+		return l == len;
+	return avail[l] + (l > len && l <= top->plen);
+}
+
 uint64_t btrie_available_space(struct btrie *root, const btrie_key_t *key, btrie_plen_t len, btrie_plen_t target_len)
 {
+	struct btrie *top;
+	uint32_t buf[BTRIE_AVAIL_PLEN + 1];
+	const uint32_t *avail;
 	uint64_t count = 0;
-	plen_t next_len, max;
-	struct btrie *node = btrie_longest_match_available(root, key, len, len, &next_len);
-	if(!node)
+	int l, max = target_len;
+	if(btrie_avail_top(root, key, len, &top))
 		return 0;
 
-	if(next_len < len)
-		return BTRIE_AVAILABLE_ALL;
+	avail = top?btrie_avail_get(top, buf):NULL;
 
-	if(target_len - len > 63)
-		target_len = len + 63;
+	if(max - len > 63)
+		max = len + 63;
+	if(max > BTRIE_AVAIL_PLEN)
+		max = BTRIE_AVAIL_PLEN;
 
-node:
-	if(next_len < node->plen) {
-		max = (node->plen > target_len)?len + 63:node->plen;
-		plen_t left = next_len - len + 1;
-		plen_t right = 64 - (max - len + 1);
-		count += (((0xffffffffffffffffu << (left)) >> (left + right)) << (right));
-	}
+	for(l = len; l <= max; l++)
+		count += ((uint64_t) btrie_avail_at(top, avail, len, l)) << (63 - (l - len));
 
-	if(!list_empty(&node->elements.l) || node->plen >= target_len)
-		goto up;
+	return count;
+}
 
-	//Only root can have no child. But root plen is 0, so no bound problem.
+void btrie_available_count(struct btrie *root, const btrie_key_t *key, btrie_plen_t len,
+		uint32_t *count, btrie_plen_t max_len)
+{
+	struct btrie *top;
+	uint32_t buf[BTRIE_AVAIL_PLEN + 1];
+	const uint32_t *avail;
+	int l;
+	for(l = 0; l <= max_len; l++)
+		count[l] = 0;
+
+	if(btrie_avail_top(root, key, len, &top))
+		return;
 
-//left:
-	if(node->child[0]) {
-		next_len = node->plen + 1;
-		node = node->child[0];
-		goto node;
-	} else {
-		count += BTRIE_AVAILABLE_ALL >> (node->plen + 1 - len);
+	avail = top?btrie_avail_get(top, buf):NULL;
+	for(l = len; l <= max_len; l++)
+		count[l] = btrie_avail_at(top, avail, len, l);
+}
+
+/* Candidate keys of length target within available prefixes of length l (saturating). */
+static uint64_t btrie_avail_weight(uint64_t count, int l,
+		int min_len, int max_len, int target_len)
+{
+	if(!count || l < min_len || l > max_len || l > target_len)
+		return 0;
+	if(target_len - l >= 64 || count > (UINT64_MAX >> (target_len - l)))
+		return UINT64_MAX;
+	return count << (target_len - l);
+}
+
+static inline uint64_t btrie_avail_add(uint64_t a, uint64_t b)
+{
+	return (a + b < a)?UINT64_MAX:(a + b);
+}
+
+struct btrie_avail_nth {
+	btrie_key_t *key;
+	btrie_plen_t *len;
+	int min_len, max_len, target_len;
+	uint64_t *n;
+};
+
+/* Checks whether the available prefix of length l, which differs from block at its last bit, contains
+ * the nth key. */
+static int btrie_avail_nth_check(struct btrie_avail_nth *a, pkey_t block, int l)
+{
+	uint64_t w = btrie_avail_weight(1, l, a->min_len, a->max_len, a->target_len);
+	if(!w)
+		return 0;
+
+	if(*a->n >= w) {
+		*a->n -= w;
+		return 0;
 	}
 
-right:
-	if(node->child[1]) {
-		next_len = node->plen + 1;
-		node = node->child[1];
-		goto node;
-	} else {
-		count += BTRIE_AVAILABLE_ALL >> (node->plen + 1 - len);
+	if(l) {
+		block ^= first_bit_mask >> remain(l - 1);
+		a->key[index(l - 1)] = htonk(block & mask(remain(l - 1)));
 	}
+	*a->len = l;
+	return 1;
+}
 
-up:
-	if(!node->parent || node->parent->plen < len)
-		return count;
+/* Candidate keys among the siblings of the path from length from (excluded) to the node,
+ * which are before (bit = 1) or after (bit = 0) the node. */
+static uint64_t btrie_avail_edge_weight(struct btrie_avail_nth *a, struct btrie *n, int from, int bit)
+{
+	uint64_t w = 0;
+	int l;
+	for(l = from + 1; l <= n->plen && l <= BTRIE_AVAIL_PLEN; l++)
+		if(!nthbit(n->key, remain(l - 1)) == !bit)
+			w = btrie_avail_add(w, btrie_avail_weight(1, l, a->min_len, a->max_len, a->target_len));
+	return w;
+}
 
-	if(node == node->parent->child[0]) {
-		node = node->parent;
-		goto right;
-	} else {
-		node = node->parent;
-		goto up;
+static uint64_t btrie_avail_node_weight(struct btrie_avail_nth *a, struct btrie *n)
+{
+	uint32_t buf[BTRIE_AVAIL_PLEN + 1];
+	const uint32_t *avail = btrie_avail_get(n, buf);
+	uint64_t w = 0;
+	int l;
+	for(l = a->min_len; l <= a->max_len && l <= BTRIE_AVAIL_PLEN; l++)
+		w = btrie_avail_add(w, btrie_avail_weight(avail[l], l, a->min_len, a->max_len, a->target_len));
+	return w;
+}
+
+int btrie_available_nth(struct btrie *root, btrie_key_t *iter_key, btrie_plen_t *iter_len,
+		const btrie_key_t *contain_key, btrie_plen_t contain_len,
+		btrie_plen_t min_len, btrie_plen_t max_len, btrie_plen_t target_len, uint64_t *n)
+{
+	struct btrie_avail_nth a = {
+			.key = iter_key, .len = iter_len, .n = n,
+			.min_len = min_len, .max_len = max_len, .target_len = target_len };
+	struct btrie *node, *c;
+	int from, l;
+	uint64_t w;
+	int i;
+
+	if(btrie_avail_top(root, contain_key, contain_len, &node))
+		return -1;
+
+	if(contain_len)
+		memcpy(iter_key, contain_key, ((contain_len - 1) >> 3) + 1);
+
+	if(!node) {
+		//The whole key is available (do not flip the last bit)
+		pkey_t block = contain_len?ntohk(contain_key[index(contain_len - 1)]):0;
+		if(contain_len)
+			block ^= first_bit_mask >> remain(contain_len - 1);
+		return btrie_avail_nth_check(&a, block, contain_len) - 1;
 	}
 
-	return 0; //Avoid warning
+	from = contain_len;
+	for(;;) {
+		//Siblings before the node
+		for(l = from + 1; l <= node->plen; l++)
+			if(nthbit(node->key, remain(l - 1)) &&
+					btrie_avail_nth_check(&a, node->key, l))
+				return 0;
+
+		w = btrie_avail_node_weight(&a, node);
+		if(*n < w) {
+			if(node->plen)
+				iter_key[index(node->plen - 1)] = htonk(node->key);
+
+			if(!node->child[0] && !node->child[1])
+				return btrie_avail_nth_check(&a, node->key ^
+						(node->plen?(first_bit_mask >> remain(node->plen - 1)):0), node->plen) - 1;
+
+			for(i = 0; i < 2; i++) {
+				if(!(c = node->child[i])) {
+					pkey_t block = remain(node->plen)?node->key:0;
+					block &= ~(first_bit_mask >> remain(node->plen));
+					if(!i)
+						block |= first_bit_mask >> remain(node->plen);
+					if(btrie_avail_nth_check(&a, block, node->plen + 1))
+						return 0;
+					continue;
+				}
+				w = btrie_avail_add(btrie_avail_node_weight(&a, c),
+						btrie_avail_add(btrie_avail_edge_weight(&a, c, node->plen + 1, 1),
+								btrie_avail_edge_weight(&a, c, node->plen + 1, 0)));
+				if(*n < w)
+					break;
+				*n -= w;
+			}
+			if(i == 2)
+				return -1; //Should not happen
+			from = node->plen + 1;
+			node = c;
+			continue;
+		}
+		*n -= w;
+
+		//Siblings after the node
+		for(l = node->plen; l > from; l--)
+			if(!nthbit(node->key, remain(l - 1)) &&
+					btrie_avail_nth_check(&a, node->key, l))
+				return 0;
+
+		return -1;
+	}
 }
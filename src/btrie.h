@@ -54,6 +54,12 @@
  * each key array element is considered as an integer of BTRIE_KEY bits in home byte order. */
 #define BTRIE_KEY_NETWORK_BYTE_ORDER
 
+/* Each node keeps, for every key length up to this value, the number of
+ * available prefixes (see below) contained in its subtree. Available
+ * prefixes which are longer are ignored by the counting and picking
+ * functions. */
+#define BTRIE_AVAIL_PLEN 128
+
 /* Private */
 #define TYPE_GLUE(a,b,c) a##b##c
 #define TYPE_INT(x) TYPE_GLUE(uint, x, _t)
@@ -222,13 +228,34 @@ uint64_t btrie_available_space(struct btrie *root, const btrie_key_t *key, btrie
 #define btrie_available_prefixes_count(root, key, len, target_len) \
 			(btrie_available_space(root, key, len, target_len) >> (63 - (target_len - len)))
 
+/* Sets count[l], for l in [0, max_len], to the number of available prefixes of length l
+ * contained in the given key (i.e. the number of prefixes btrie_for_each_available
+ * would iterate over). max_len must not be greater than BTRIE_AVAIL_PLEN.
+ * Runs in O(len + max_len). */
+void btrie_available_count(struct btrie *root, const btrie_key_t *key, btrie_plen_t len,
+		uint32_t *count, btrie_plen_t max_len);
+
+/* Finds the available prefix (contained in the given key and of length in [min_len, max_len])
+ * containing the nth (starting from 0) key of length target_len, available prefixes being
+ * considered in the btrie_for_each_available order.
+ * Returns 0 and sets iter_key, iter_len and n to the found available prefix and the index of the
+ * key within it, or returns -1 and decrements n by the total number of candidate keys.
+ * Runs in O(tree depth * BTRIE_AVAIL_PLEN). */
+int btrie_available_nth(struct btrie *root, btrie_key_t *iter_key, btrie_plen_t *iter_len,
+		const btrie_key_t *contain_key, btrie_plen_t contain_len,
+		btrie_plen_t min_len, btrie_plen_t max_len, btrie_plen_t target_len, uint64_t *n);
+
 /***************Private**************/
+/* Nodes fit in a single cache line. They are allocated from slabs at cache line
+ * aligned addresses, and the available prefixes counts, which lookups do not
+ * use, are stored apart in the same slab. */
 struct btrie {
 	struct btrie_element elements; //Must be first for cast
 	struct btrie *parent;
 	struct btrie *child[2];
 	btrie_plen_t plen;
 	btrie_key_t key;
+	uint32_t *avail; //Available prefixes in subtree, by length (NULL for roots)
 };
 /************************************/
 
@@ -28,6 +28,73 @@ compare_nodes(const void *a, const void *b, void *ptr __unused)
   return dncp_node_cmp(n1, n2);
 }
 
+/* FNV-1a; the node and neighbor table keys are short and mostly random. */
+static uint32_t _hash_data(const void *p, int len)
+{
+  const unsigned char *c = p;
+  uint32_t h = 2166136261U;
+
+  while (len-- > 0)
+    {
+      h ^= *c++;
+      h *= 16777619U;
+    }
+  return h;
+}
+
+static bool _node_hash_grow(dncp o)
+{
+  int size = o->node_hash_size ? o->node_hash_size * 2 : 64;
+  dncp_node *h = calloc(size, sizeof(*h));
+  int i, j;
+
+  if (!h)
+    return false;
+  for (i = 0 ; i < o->node_hash_size ; i++)
+    if (o->node_hash[i])
+      {
+        for (j = o->node_hash[i]->node_id_hash & (size - 1) ; h[j] ;
+             j = (j + 1) & (size - 1));
+        h[j] = o->node_hash[i];
+      }
+  free(o->node_hash);
+  o->node_hash = h;
+  o->node_hash_size = size;
+  return true;
+}
+
+static void _node_hash_insert(dncp o, dncp_node n)
+{
+  int mask = o->node_hash_size - 1;
+  int i;
+
+  for (i = n->node_id_hash & mask ; o->node_hash[i] ; i = (i + 1) & mask);
+  o->node_hash[i] = n;
+  o->node_hash_count++;
+}
+
+static void _node_hash_remove(dncp o, dncp_node n)
+{
+  int mask = o->node_hash_size - 1;
+  int i, j, k;
+
+  for (i = n->node_id_hash & mask ; o->node_hash[i] != n ; i = (i + 1) & mask)
+    if (!o->node_hash[i])
+      return;
+  o->node_hash_count--;
+  /* Backward shift deletion; move later entries of the probe sequence
+   * to the hole, unless their home slot is (cyclically) after it. */
+  for (j = (i + 1) & mask ; o->node_hash[j] ; j = (j + 1) & mask)
+    {
+      k = o->node_hash[j]->node_id_hash & mask;
+      if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+        continue;
+      o->node_hash[i] = o->node_hash[j];
+      i = j;
+    }
+  o->node_hash[i] = NULL;
+}
+
 void dncp_schedule(dncp o)
 {
   if (o->immediate_scheduled)
@@ -36,10 +103,173 @@ void dncp_schedule(dncp o)
   o->immediate_scheduled = true;
 }
 
+static void _node_network_hash_dirty(dncp_node n)
+{
+  dncp o = n->dncp;
+
+  if (list_empty(&n->in_network_hash_dirty))
+    list_add_tail(&n->in_network_hash_dirty, &o->network_hash_dirty_nodes);
+  o->network_hash_dirty = true;
+}
+
+static void _node_neighbors_changed(dncp_node n)
+{
+  dncp o = n->dncp;
+  dncp_neighbor ne;
+
+  dncp_for_each_neighbor(o, ne)
+    if (!memcmp(dncp_tlv_get_node_id(o, dncp_neighbor_get_t(o, ne)),
+                &n->node_id, DNCP_NI_LEN(o)))
+      ne->keepalive_interval_valid = false;
+}
+
+/* The node's neighbor TLVs may change; so may the adjacency of the
+ * node, and of anyone it refers to. */
+static void _node_adjacency_changed(dncp_node n)
+{
+  dncp o = n->dncp;
+  struct tlv_attr *a;
+  dncp_t_neighbor ne;
+  dncp_node n2;
+
+  n->adj_dirty = true;
+  dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_NEIGHBOR, false)
+    if ((ne = dncp_tlv_neighbor(o, a))
+        && (n2 = dncp_find_node_by_node_id(o, dncp_tlv_get_node_id(o, ne),
+                                           false)))
+      n2->adj_dirty = true;
+}
+
+dncp_rbuf dncp_rbuf_alloc(dncp o, int len)
+{
+  int c = 0;
+  dncp_rbuf rb;
+
+  while ((DNCP_RBUF_MIN_SIZE << c) < len)
+    if (++c == DNCP_RBUF_CLASSES)
+      return NULL;
+  if ((rb = o->rbuf_free[c]))
+    {
+      o->rbuf_free[c] = rb->next;
+      o->rbuf_free_count[c]--;
+    }
+  else if (!(rb = malloc(sizeof(*rb) + (DNCP_RBUF_MIN_SIZE << c))))
+    return NULL;
+  rb->refcount = 1;
+  rb->size_class = c;
+  return rb;
+}
+
+dncp_rbuf dncp_rbuf_copy(dncp o, struct tlv_attr *msg)
+{
+  int len = tlv_pad_len(msg);
+  dncp_rbuf rb = dncp_rbuf_alloc(o, len);
+
+  if (rb)
+    memcpy(rb->buf, msg, len);
+  return rb;
+}
+
+void dncp_rbuf_unref(dncp o, dncp_rbuf rb)
+{
+  int c = rb->size_class;
+
+  if (--rb->refcount)
+    return;
+  if (o->rbuf_free_count[c] == DNCP_RBUF_FREE_MAX)
+    {
+      free(rb);
+      return;
+    }
+  rb->next = o->rbuf_free[c];
+  o->rbuf_free[c] = rb;
+  o->rbuf_free_count[c]++;
+}
+
+static void _node_data_free(dncp o, struct tlv_attr *a, dncp_rbuf rb)
+{
+  if (rb)
+    dncp_rbuf_unref(o, rb);
+  else
+    free(a);
+}
+
+static void _node_delta_free(dncp_node n)
+{
+  free(n->node_delta);
+  n->node_delta = NULL;
+  n->node_delta_len = 0;
+  n->node_delta_removed_len = 0;
+}
+
+typedef struct {
+  /* Removed TLVs are copied at the start of buf, added ones after
+   * removed_size bytes (if buf is set; otherwise, just counted). */
+  unsigned char *buf;
+  int removed_size;
+  int removed_len, added_len;
+} dncp_node_delta_diff_s, *dncp_node_delta_diff;
+
+static bool _node_delta_diff_cb(void *context, struct tlv_attr *a, bool add)
+{
+  dncp_node_delta_diff d = context;
+  int len = tlv_pad_len(a);
+
+  if (add)
+    {
+      if (d->buf)
+        memcpy(d->buf + d->removed_size + d->added_len, a, len);
+      d->added_len += len;
+    }
+  else
+    {
+      if (d->buf)
+        memcpy(d->buf + d->removed_len, a, len);
+      d->removed_len += len;
+    }
+  return true;
+}
+
+/* Remember how node data changed from a_old (of update number
+ * base) to a_new, so that peers having a_old can be sent just the
+ * difference. */
+static void _node_delta_update(dncp_node n, uint32_t base,
+                               struct tlv_attr *a_old,
+                               struct tlv_attr *a_new)
+{
+  dncp_node_delta_diff_s d;
+
+  _node_delta_free(n);
+  if (!a_old || !a_new || !n->dncp->ext->conf.per_ep.node_data_delta)
+    return;
+  /* First count, and then copy. */
+  memset(&d, 0, sizeof(d));
+  dncp_tlv_diff(a_old, a_new, _node_delta_diff_cb, &d);
+  /* No sense in a delta that is not smaller than the data. */
+  if (d.removed_len + d.added_len >= (int)tlv_len(a_new))
+    return;
+  if (!(d.buf = malloc(d.removed_len + d.added_len)))
+    return;
+  n->node_delta = d.buf;
+  n->node_delta_removed_len = d.removed_len;
+  n->node_delta_len = d.removed_len + d.added_len;
+  n->node_delta_base = base;
+  d.removed_size = d.removed_len;
+  d.removed_len = d.added_len = 0;
+  dncp_tlv_diff(a_old, a_new, _node_delta_diff_cb, &d);
+}
+
 void dncp_node_set(dncp_node n, uint32_t update_number,
                    hnetd_time_t t, struct tlv_attr *a)
+{
+  dncp_node_set_rbuf(n, update_number, t, a, NULL);
+}
+
+void dncp_node_set_rbuf(dncp_node n, uint32_t update_number,
+                        hnetd_time_t t, struct tlv_attr *a, dncp_rbuf rb)
 {
   struct tlv_attr *a_valid = a;
+  uint32_t old_update_number = n->update_number;
 
   L_DEBUG("dncp_node_set %s update #%d %p (@%lld (-%lld))",
           DNCP_NODE_REPR(n), (int) update_number, a,
@@ -51,10 +281,17 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
     {
       L_DEBUG(" .. spurious (no change, we ignore time delta)");
       if (a && a != n->tlv_container)
-        free(a);
+        _node_data_free(n->dncp, a, rb);
       return;
     }
 
+  /* Any change in update number or data invalidates the reply. */
+  if (n->node_state_cache)
+    {
+      free(n->node_state_cache);
+      n->node_state_cache = NULL;
+    }
+
   /* If new data is set, consider if similar, and if not,
    * handle version check  */
   if (a)
@@ -63,8 +300,9 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
         {
           if (n->tlv_container != a)
             {
-              free(a);
+              _node_data_free(n->dncp, a, rb);
               a = n->tlv_container;
+              rb = n->tlv_container_rbuf;
             }
           a_valid = n->tlv_container_valid;
         }
@@ -90,18 +328,27 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
       if (n->last_reachable_prune == n->dncp->last_prune)
         dncp_notify_subscribers_tlvs_changed(n, n->tlv_container_valid,
                                              a_valid);
+      /* Cached keepalive intervals are based on the raw TLVs of even
+       * unreachable nodes, so they are invalidated regardless. */
+      _node_neighbors_changed(n);
+      _node_adjacency_changed(n);
+      _node_delta_update(n, old_update_number, n->tlv_container, a);
       if (n->tlv_container)
-        free(n->tlv_container);
+        _node_data_free(n->dncp, n->tlv_container, n->tlv_container_rbuf);
 
       n->tlv_container = a;
+      n->tlv_container_rbuf = rb;
       n->tlv_container_valid = a_valid;
       n->tlv_index_dirty = true;
+      _node_adjacency_changed(n);
       n->node_data_hash_dirty = true;
       n->dncp->graph_dirty = true;
+      if (list_empty(&n->in_graph_dirty))
+        list_add_tail(&n->in_graph_dirty, &n->dncp->graph_dirty_nodes);
     }
 
   /* _anything_ we do here dirties network hash. */
-  n->dncp->network_hash_dirty = true;
+  _node_network_hash_dirty(n);
 
   dncp_schedule(n->dncp);
 }
@@ -120,18 +367,44 @@ static void update_node(__unused struct vlist_tree *t,
   if (n_old)
     {
       dncp_node_set(n_old, 0, 0, NULL);
+      list_del(&n_old->in_network_hash_dirty);
+      list_del(&n_old->in_graph_dirty);
+      /* Only unreachable nodes are normally removed; if a part of the
+       * reachability tree goes away, full prune rebuilds it. */
+      if (n_old->prune_parent || !list_empty(&n_old->prune_children))
+        {
+          dncp_node c, c2;
+
+          list_for_each_entry_safe(c, c2, &n_old->prune_children,
+                                   in_prune_children)
+            {
+              list_del_init(&c->in_prune_children);
+              c->prune_parent = NULL;
+            }
+          list_del(&n_old->in_prune_children);
+          o->graph_full_dirty = true;
+        }
+      _node_hash_remove(o, n_old);
       if (n_old->tlv_index)
         free(n_old->tlv_index);
+      if (n_old->adj)
+        free(n_old->adj);
+      if (n_old->node_state_cache)
+        free(n_old->node_state_cache);
+      if (n_old->node_delta)
+        free(n_old->node_delta);
       free(n_old);
     }
   if (n_new)
     {
+      _node_hash_insert(o, n_new);
       n_new->node_data_hash_dirty = true;
       n_new->tlv_index_dirty = true;
       /* By default unreachable */
       n_new->last_reachable_prune = o->last_prune - 1;
     }
   o->network_hash_dirty = true;
+  o->network_hash_layout_dirty = true;
   o->graph_dirty = true;
   dncp_schedule(o);
 }
@@ -145,6 +418,202 @@ compare_tlvs(const void *a, const void *b, void *ptr __unused)
   return tlv_attr_cmp(&t1->tlv, &t2->tlv);
 }
 
+static dncp_neighbor *_neighbor_id_bucket(dncp o, dncp_neighbor n)
+{
+  uint32_t h = _hash_data(tlv_data(&n->tlv->tlv),
+                                   tlv_len(&n->tlv->tlv));
+  return &o->neighbor_hash[h & (o->neighbor_hash_size - 1)];
+}
+
+static dncp_neighbor *_neighbor_sa6_bucket(dncp o, struct sockaddr_in6 *sa6)
+{
+  uint32_t h = _hash_data(sa6, sizeof(*sa6));
+  return &o->neighbor_sa6_hash[h & (o->neighbor_hash_size - 1)];
+}
+
+static void _neighbor_hash_insert(dncp o, dncp_neighbor n)
+{
+  dncp_neighbor *b = _neighbor_id_bucket(o, n);
+
+  n->next_by_id = *b;
+  *b = n;
+  if (n->in_sa6_hash)
+    {
+      b = _neighbor_sa6_bucket(o, &n->last_sa6);
+      n->next_by_sa6 = *b;
+      *b = n;
+    }
+}
+
+static void _neighbor_sa6_hash_remove(dncp o, dncp_neighbor n)
+{
+  dncp_neighbor *b;
+
+  if (!n->in_sa6_hash)
+    return;
+  for (b = _neighbor_sa6_bucket(o, &n->last_sa6) ; *b != n ;
+       b = &(*b)->next_by_sa6);
+  *b = n->next_by_sa6;
+  n->in_sa6_hash = false;
+}
+
+static bool _neighbor_hash_grow(dncp o)
+{
+  int size = o->neighbor_hash_size ? o->neighbor_hash_size * 2 : 16;
+  dncp_neighbor *h1 = calloc(size, sizeof(*h1));
+  dncp_neighbor *h2 = calloc(size, sizeof(*h2));
+  dncp_neighbor n;
+
+  if (!h1 || !h2)
+    {
+      free(h1);
+      free(h2);
+      return false;
+    }
+  free(o->neighbor_hash);
+  free(o->neighbor_sa6_hash);
+  o->neighbor_hash = h1;
+  o->neighbor_sa6_hash = h2;
+  o->neighbor_hash_size = size;
+  dncp_for_each_neighbor(o, n)
+    _neighbor_hash_insert(o, n);
+  return true;
+}
+
+static void _neighbor_add(dncp o, dncp_tlv t)
+{
+  dncp_neighbor n = dncp_tlv_get_extra(t);
+
+  /* If growing fails, the chains just get longer. */
+  if (o->num_neighbors >= o->neighbor_hash_size)
+    _neighbor_hash_grow(o);
+  n->tlv = t;
+  n->in_sa6_hash = false;
+  list_add(&n->lh, &o->neighbors);
+  o->num_neighbors++;
+  _neighbor_hash_insert(o, n);
+}
+
+static void _neighbor_remove(dncp o, dncp_tlv t)
+{
+  dncp_neighbor n = dncp_tlv_get_extra(t), *b;
+
+  for (b = _neighbor_id_bucket(o, n) ; *b != n ; b = &(*b)->next_by_id);
+  *b = n->next_by_id;
+  _neighbor_sa6_hash_remove(o, n);
+  list_del(&n->lh);
+  o->num_neighbors--;
+}
+
+dncp_neighbor dncp_find_neighbor(dncp o, dncp_node_id ni,
+                                 ep_id_t neighbor_ep_id, ep_id_t ep_id)
+{
+  int nilen = DNCP_NI_LEN(o);
+  int len = nilen + sizeof(dncp_t_neighbor_s);
+  unsigned char buf[len];
+  dncp_t_neighbor ne = (void *)buf + nilen;
+  dncp_neighbor n;
+
+  if (!o->num_neighbors)
+    return NULL;
+  memcpy(buf, ni, nilen);
+  ne->neighbor_ep_id = neighbor_ep_id;
+  ne->ep_id = ep_id;
+  n = o->neighbor_hash[_hash_data(buf, len)
+                       & (o->neighbor_hash_size - 1)];
+  for ( ; n ; n = n->next_by_id)
+    if ((int)tlv_len(&n->tlv->tlv) == len
+        && !memcmp(tlv_data(&n->tlv->tlv), buf, len))
+      return n;
+  return NULL;
+}
+
+dncp_neighbor dncp_find_neighbor_by_sa6(dncp o, struct sockaddr_in6 *sa6)
+{
+  dncp_neighbor n;
+
+  if (!o->num_neighbors)
+    return NULL;
+  for (n = *_neighbor_sa6_bucket(o, sa6) ; n ; n = n->next_by_sa6)
+    if (!memcmp(&n->last_sa6, sa6, sizeof(*sa6)))
+      return n;
+  return NULL;
+}
+
+void dncp_neighbor_set_sa6(dncp o, dncp_neighbor n, struct sockaddr_in6 *sa6)
+{
+  dncp_neighbor *b;
+
+  if (n->in_sa6_hash && !memcmp(&n->last_sa6, sa6, sizeof(*sa6)))
+    return;
+  _neighbor_sa6_hash_remove(o, n);
+  n->last_sa6 = *sa6;
+  b = _neighbor_sa6_bucket(o, sa6);
+  n->next_by_sa6 = *b;
+  *b = n;
+  n->in_sa6_hash = true;
+}
+
+/* Replace del bytes at offset ofs of the local TLV container with
+ * ins_len bytes from ins. On failure, the container is dropped, and
+ * rebuilt from scratch on the next flush. */
+static bool _tlvs_splice(dncp o, int ofs, int del,
+                         const void *ins, int ins_len)
+{
+  struct tlv_attr *c = o->tlvs_container;
+  int len = c ? tlv_len(c) : 0;
+  int nlen = len - del + ins_len;
+  void *p;
+
+  if ((int)TLV_SIZE + nlen > o->tlvs_container_size)
+    {
+      int size = o->tlvs_container_size ? o->tlvs_container_size : 256;
+
+      while (size < (int)TLV_SIZE + nlen)
+        size *= 2;
+      if (!(c = realloc(c, size)))
+        {
+          L_ERR("_tlvs_splice: realloc failed");
+          free(o->tlvs_container);
+          o->tlvs_container = NULL;
+          o->tlvs_container_size = 0;
+          return false;
+        }
+      o->tlvs_container = c;
+      o->tlvs_container_size = size;
+    }
+  p = tlv_data(c) + ofs;
+  memmove(p + ins_len, p + del, len - ofs - del);
+  if (ins_len)
+    memcpy(p, ins, ins_len);
+  tlv_init(c, 0, TLV_SIZE + nlen);
+  return true;
+}
+
+/* Offset of the first TLV >= a within the local TLV container. */
+static int _tlvs_offset(dncp o, const struct tlv_attr *a)
+{
+  struct tlv_attr *c = o->tlvs_container, *a2;
+
+  tlv_for_each_attr(a2, c)
+    if (tlv_attr_cmp(a2, a) >= 0)
+      return (void *)a2 - tlv_data(c);
+  return tlv_len(c);
+}
+
+static bool _tlvs_rebuild(dncp o)
+{
+  dncp_tlv t;
+
+  if (!_tlvs_splice(o, 0, 0, NULL, 0))
+    return false;
+  vlist_for_each_element(&o->tlvs, t, in_tlvs)
+    if (!_tlvs_splice(o, tlv_len(o->tlvs_container),
+                      0, &t->tlv, tlv_pad_len(&t->tlv)))
+      return false;
+  return true;
+}
+
 static void update_tlv(struct vlist_tree *t,
                        struct vlist_node *node_new,
                        struct vlist_node *node_old)
@@ -153,13 +622,32 @@ static void update_tlv(struct vlist_tree *t,
   dncp_tlv t_old = container_of(node_old, dncp_tlv_s, in_tlvs);
   __unused dncp_tlv t_new = container_of(node_new, dncp_tlv_s, in_tlvs);
 
+  /* Replacing TLV with an identical one does not change the
+   * container; otherwise, splice it in or out in place. */
+  if (o->tlvs_container && (!t_old || !t_new))
+    {
+      dncp_tlv t2 = t_old ? t_old : t_new;
+      int ofs = _tlvs_offset(o, &t2->tlv);
+
+      if (t_old)
+        _tlvs_splice(o, ofs, tlv_pad_len(&t2->tlv), NULL, 0);
+      else
+        _tlvs_splice(o, ofs, 0, &t2->tlv, tlv_pad_len(&t2->tlv));
+    }
+
   if (t_old)
     {
+      if (dncp_tlv_neighbor(o, &t_old->tlv))
+        _neighbor_remove(o, t_old);
       dncp_notify_subscribers_local_tlv_changed(o, &t_old->tlv, false);
       free(t_old);
     }
   if (t_new)
-    dncp_notify_subscribers_local_tlv_changed(o, &t_new->tlv, true);
+    {
+      if (dncp_tlv_neighbor(o, &t_new->tlv))
+        _neighbor_add(o, t_new);
+      dncp_notify_subscribers_local_tlv_changed(o, &t_new->tlv, true);
+    }
 
   o->tlvs_dirty = true;
   dncp_schedule(o);
@@ -183,6 +671,7 @@ static void update_ep(struct vlist_tree *t,
 
   if (t_old)
     {
+      dncp_ep_set_ifindex(&t_old->conf, 0);
       free(t_old);
     }
   else
@@ -196,23 +685,34 @@ static void update_ep(struct vlist_tree *t,
 dncp_node
 dncp_find_node_by_node_id(dncp o, void *ni, bool create)
 {
-  /* Unfortunately as DNCP_NI_LEN refers to node -> dncp, we cannot
-   * simply use the dncp_node_id pointer as is anymore.. */
-  dncp_node_s fake_node = { .dncp = o };
-  memcpy(&fake_node.node_id, ni, DNCP_NI_LEN(o));
-
-  dncp_node n = vlist_find(&o->nodes, &fake_node, &fake_node, in_nodes);
+  int nilen = DNCP_NI_LEN(o);
+  uint32_t h = _hash_data(ni, nilen);
+  int mask = o->node_hash_size - 1;
+  dncp_node n;
+  int i;
 
-  if (n)
-    return n;
+  for (i = h & mask ; (n = o->node_hash[i]) ; i = (i + 1) & mask)
+    if (n->node_id_hash == h && !memcmp(&n->node_id, ni, nilen))
+      return n;
   if (!create)
     return NULL;
+  /* Keep the load factor at most 1/2 */
+  if ((o->node_hash_count + 1) * 2 > o->node_hash_size
+      && !_node_hash_grow(o)
+      && o->node_hash_count + 1 >= o->node_hash_size)
+    return NULL;
   n = calloc(1, sizeof(*n) + o->ext->conf.ext_node_data_size);
   if (!n)
     return false;
-  memcpy(&n->node_id, ni, DNCP_NI_LEN(o));
+  memcpy(&n->node_id, ni, nilen);
+  n->node_id_hash = h;
   n->dncp = o;
   n->tlv_index_dirty = true;
+  INIT_LIST_HEAD(&n->in_network_hash_dirty);
+  INIT_LIST_HEAD(&n->prune_children);
+  INIT_LIST_HEAD(&n->in_prune_children);
+  INIT_LIST_HEAD(&n->in_graph_dirty);
+  INIT_LIST_HEAD(&n->in_prune_work);
   vlist_add(&o->nodes, &n->in_nodes, n);
   return n;
 }
@@ -229,12 +729,17 @@ bool dncp_init(dncp o, dncp_ext ext, const void *node_id, int len)
   o->ext = ext;
   for (i = 0 ; i < NUM_DNCP_CALLBACKS; i++)
     INIT_LIST_HEAD(&o->subscribers[i]);
+  INIT_LIST_HEAD(&o->network_hash_dirty_nodes);
+  INIT_LIST_HEAD(&o->neighbors);
+  INIT_LIST_HEAD(&o->graph_dirty_nodes);
   vlist_init(&o->nodes, compare_nodes, update_node);
   o->nodes.keep_old = true;
   vlist_init(&o->tlvs, compare_tlvs, update_tlv);
   vlist_init(&o->eps, compare_eps, update_ep);
   memset(&nih, 0, sizeof(nih));
   ext->cb.hash(node_id, len, &nih.h);
+  if (!_neighbor_hash_grow(o) || !_node_hash_grow(o))
+    return false;
   o->first_free_ep_id = 1;
   o->last_prune = 1;
   /* this way new nodes with last_prune=0 won't be reachable */
@@ -258,6 +763,7 @@ bool dncp_set_own_node_id(dncp o, void *nibuf)
       return false;
     }
   o->own_node = n;
+  o->graph_full_dirty = true;
   o->tlvs_dirty = true; /* by default, they are, even if no neighbors yet. */
   n->last_reachable_prune = o->last_prune; /* we're always reachable */
   dncp_schedule(o);
@@ -294,6 +800,8 @@ void dncp_uninit(dncp o)
 {
   /* TLVs should be freed first; they're local phenomenom, but may be
    * reflected on eps/nodes. */
+  free(o->tlvs_container);
+  o->tlvs_container = NULL;
   vlist_flush_all(&o->tlvs);
 
   /* Link destruction will refer to node -> have to be taken out
@@ -311,6 +819,39 @@ void dncp_uninit(dncp o)
   /* Get rid of TLV index. */
   if (o->num_tlv_indexes)
     free(o->tlv_type_to_index);
+
+  /* And the network hash input. */
+  free(o->network_hash_buf);
+
+  /* And the interface index map. */
+  free(o->ep_by_ifindex);
+
+  /* And the per-TLV type subscriber lists. */
+  int i;
+  for (i = 0; i < o->tlv_type_subscribers_length; i++)
+    free(o->tlv_type_subscribers[i].s);
+  free(o->tlv_type_subscribers);
+  free(o->tlvs_added);
+
+  /* And the (by now unused) received message buffers. */
+  for (i = 0; i < DNCP_RBUF_CLASSES; i++)
+    while (o->rbuf_free[i])
+      {
+        dncp_rbuf rb = o->rbuf_free[i];
+
+        o->rbuf_free[i] = rb->next;
+        free(rb);
+      }
+  free(o->recv_bufs);
+
+  /* And the cached network state (queued sends are dropped). */
+  o->num_pending_sends = 0;
+  tlv_buf_free(&o->network_state_body);
+
+  /* And the (by now empty) node and neighbor tables. */
+  free(o->node_hash);
+  free(o->neighbor_hash);
+  free(o->neighbor_sa6_hash);
 }
 
 void dncp_destroy(dncp o)
@@ -424,11 +965,26 @@ dncp_ep dncp_find_ep_by_id(dncp o, uint32_t ep_id)
   return NULL;
 }
 
+dncp_ep dncp_find_ep_by_ifindex(dncp o, uint32_t ifindex)
+{
+  dncp_ep_i l;
+
+  if (!ifindex || ifindex >= o->ep_by_ifindex_size)
+    return NULL;
+  l = o->ep_by_ifindex[ifindex];
+  return l ? &l->conf : NULL;
+}
+
 bool dncp_node_is_self(dncp_node n)
 {
   return n->dncp->own_node == n;
 }
 
+bool dncp_node_is_going_away(dncp_node n)
+{
+  return n->going_away;
+}
+
 dncp_node dncp_node_get_next(dncp_node n)
 {
   dncp o = n->dncp;
@@ -471,39 +1027,33 @@ dncp_tlv dncp_get_next_tlv(dncp o, dncp_tlv n)
 
 static struct tlv_attr *_produce_new_tlvs(dncp_node n)
 {
-  struct tlv_buf tb;
   dncp o = n->dncp;
-  dncp_tlv t;
+  struct tlv_attr *a;
 
   if (!o->tlvs_dirty)
     return NULL;
 
-  /* Dump the contents of dncp->tlvs to single tlv_buf. */
-  /* Based on whether or not that would cause change in things, 'do stuff'. */
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
-  vlist_for_each_element(&o->tlvs, t, in_tlvs)
+  /* The container is normally maintained by update_tlv; it has to be
+   * rebuilt only initially, and after allocation failure. */
+  if (!o->tlvs_container && !_tlvs_rebuild(o))
     {
-      struct tlv_attr *a = tlv_put_raw(&tb, &t->tlv, tlv_pad_len(&t->tlv));
-      if (!a)
-        {
-          L_ERR("dncp_self_flush: tlv_put_raw failed?!?");
-          tlv_buf_free(&tb);
-          return NULL;
-        }
-      tlv_fill_pad(a);
+      L_ERR("dncp_self_flush: _tlvs_rebuild failed?!?");
+      return NULL;
     }
-  tlv_fill_pad(tb.head);
 
-  /* Ok, all puts _did_ succeed. */
   o->tlvs_dirty = false;
 
-  if (n->tlv_container && tlv_attr_equal(tb.head, n->tlv_container))
+  /* The compare and copy are linear in the size of the container
+   * (but not in the number of TLVs). Publishing is that anyway, as
+   * the node data hash covers the whole container. */
+  if (n->tlv_container && tlv_attr_equal(o->tlvs_container, n->tlv_container))
+    return NULL;
+  if (!(a = tlv_memdup(o->tlvs_container)))
     {
-      tlv_buf_free(&tb);
-      return NULL;
+      L_ERR("dncp_self_flush: tlv_memdup failed?!?");
+      o->tlvs_dirty = true;
     }
-  return tb.head;
+  return a;
 }
 
 void dncp_self_flush(dncp_node n)
@@ -553,9 +1103,24 @@ void dncp_calculate_node_data_hash(dncp_node n)
           n == n->dncp->own_node ? " [self]" : "");
 }
 
+static void _update_network_hash_entry(dncp_node n)
+{
+  dncp o = n->dncp;
+  int onelen = 4 + DNCP_HASH_LEN(o);
+  void *dst = o->network_hash_buf + n->network_hash_index * onelen;
+
+  dncp_calculate_node_data_hash(n);
+  *((uint32_t *)dst) = cpu_to_be32(n->update_number);
+  memcpy(dst + 4, &n->node_data_hash, DNCP_HASH_LEN(o));
+  L_DEBUG(".. %s/%d=%s",
+          DNCP_NODE_REPR(n), n->update_number,
+          DNCP_HASH_REPR(n->dncp, &n->node_data_hash));
+}
+
 void dncp_calculate_network_hash(dncp o)
 {
-  dncp_node n;
+  dncp_node n, n2;
+  int onelen = 4 + DNCP_HASH_LEN(o);
 
   if (!o->network_hash_dirty)
     return;
@@ -563,26 +1128,48 @@ void dncp_calculate_network_hash(dncp o)
   /* Store original network hash for future study. */
   dncp_hash_s old_hash = o->network_hash;
 
-  int cnt = 0;
-  dncp_for_each_node(o, n)
-    cnt++;
-  int onelen = 4 + DNCP_HASH_LEN(o);
-  void *buf = malloc(cnt * onelen);
-  if (!buf)
-    return;
-  void *dst = buf;
-  dncp_for_each_node(o, n)
-    {
-      dncp_calculate_node_data_hash(n);
-      *((uint32_t *)dst) = cpu_to_be32(n->update_number);
-      memcpy(dst + 4, &n->node_data_hash, DNCP_HASH_LEN(o));
-      L_DEBUG(".. %s/%d=%s",
-              DNCP_NODE_REPR(n), n->update_number,
-              DNCP_HASH_REPR(n->dncp, &n->node_data_hash));
-      dst += onelen;
-    }
-  o->ext->cb.hash(buf, cnt * onelen, &o->network_hash);
-  free(buf);
+  /* If the set of reachable nodes changed, the entries have to be
+   * laid out again. Otherwise, only the entries of nodes that changed
+   * since the last time need to be patched. */
+  if (o->network_hash_layout_dirty)
+    {
+      int cnt = 0;
+      dncp_for_each_node(o, n)
+        cnt++;
+      if (cnt > o->network_hash_buf_size)
+        {
+          void *buf = realloc(o->network_hash_buf, cnt * onelen);
+          if (!buf)
+            return;
+          o->network_hash_buf = buf;
+          o->network_hash_buf_size = cnt;
+        }
+      cnt = 0;
+      dncp_for_each_node(o, n)
+        {
+          n->network_hash_index = cnt++;
+          _update_network_hash_entry(n);
+        }
+      o->network_hash_buf_count = cnt;
+      o->network_hash_layout_dirty = false;
+      list_for_each_entry_safe(n, n2, &o->network_hash_dirty_nodes,
+                               in_network_hash_dirty)
+        list_del_init(&n->in_network_hash_dirty);
+    }
+  else
+    {
+      list_for_each_entry_safe(n, n2, &o->network_hash_dirty_nodes,
+                               in_network_hash_dirty)
+        {
+          list_del_init(&n->in_network_hash_dirty);
+          /* Unreachable nodes do not contribute to the hash. */
+          if (n->last_reachable_prune == o->last_prune)
+            _update_network_hash_entry(n);
+        }
+    }
+  o->ext->cb.hash(o->network_hash_buf, o->network_hash_buf_count * onelen,
+                  &o->network_hash);
+  o->network_hash_generation++;
   L_DEBUG("dncp_calculate_network_hash =%s",
           DNCP_HASH_REPR(o, &o->network_hash));
 
@@ -709,6 +1296,56 @@ void dncp_node_recalculate_index(dncp_node n)
   n->tlv_index_dirty = false;
 }
 
+void dncp_node_recalculate_adjacency(dncp_node n)
+{
+  dncp o = n->dncp;
+  struct tlv_attr *a, *a2;
+  dncp_t_neighbor ne, ne2;
+  dncp_node n2;
+  int count = 0;
+
+  n->adj_dirty = false;
+  n->adj_count = 0;
+  dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_NEIGHBOR, false)
+    count++;
+  if (count > n->adj_size)
+    {
+      dncp_node_adj adj = realloc(n->adj, count * sizeof(*adj));
+
+      if (!adj)
+        {
+          n->adj_dirty = true;
+          return;
+        }
+      n->adj = adj;
+      n->adj_size = count;
+    }
+
+  /* Only links that the other party also reports are included. */
+  dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_NEIGHBOR, false)
+    {
+      if (!(ne = dncp_tlv_neighbor(o, a)))
+        continue;
+      n2 = dncp_find_node_by_node_id(o, dncp_tlv_get_node_id(o, ne), false);
+      if (!n2)
+        continue;
+      dncp_node_for_each_tlv_with_t_v(n2, a2, DNCP_T_NEIGHBOR, false)
+        if ((ne2 = dncp_tlv_neighbor(o, a2))
+            && ne->ep_id == ne2->neighbor_ep_id
+            && ne->neighbor_ep_id == ne2->ep_id
+            && !memcmp(dncp_tlv_get_node_id(o, ne2),
+                       &n->node_id, DNCP_NI_LEN(o)))
+          {
+            dncp_node_adj adj = &n->adj[n->adj_count++];
+
+            adj->node = n2;
+            adj->tlv = a;
+            adj->ne = ne;
+            break;
+          }
+    }
+}
+
 dncp_tlv dncp_find_tlv(dncp o, uint16_t type, void *data, uint16_t len)
 {
   /* This is actually slower than list iteration if publishing only
@@ -803,6 +1440,46 @@ ep_id_t dncp_ep_get_id(dncp_ep ep)
   return ep ? l->ep_id : 0;
 }
 
+uint32_t dncp_ep_get_ifindex(dncp_ep ep)
+{
+  dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+
+  return ep ? l->ifindex : 0;
+}
+
+bool dncp_ep_set_ifindex(dncp_ep ep, uint32_t ifindex)
+{
+  dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+  dncp o = l->dncp;
+
+  if (l->ifindex == ifindex)
+    return true;
+  if (ifindex && ifindex >= o->ep_by_ifindex_size)
+    {
+      uint32_t size = o->ep_by_ifindex_size ? o->ep_by_ifindex_size : 16;
+      dncp_ep_i *m;
+
+      while (size <= ifindex)
+        size *= 2;
+      if (!(m = realloc(o->ep_by_ifindex, size * sizeof(*m))))
+        return false;
+      memset(m + o->ep_by_ifindex_size, 0,
+             (size - o->ep_by_ifindex_size) * sizeof(*m));
+      o->ep_by_ifindex = m;
+      o->ep_by_ifindex_size = size;
+    }
+  if (l->ifindex)
+    o->ep_by_ifindex[l->ifindex] = NULL;
+  if (ifindex)
+    {
+      if (o->ep_by_ifindex[ifindex])
+        o->ep_by_ifindex[ifindex]->ifindex = 0;
+      o->ep_by_ifindex[ifindex] = l;
+    }
+  l->ifindex = ifindex;
+  return true;
+}
+
 bool dncp_ep_is_enabled(dncp_ep ep)
 {
   dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
@@ -19,6 +19,9 @@
 /* in6_addr */
 #include <netinet/in.h>
 
+/* iovec */
+#include <sys/uio.h>
+
 /* IFNAMSIZ */
 #include <net/if.h>
 
@@ -124,6 +127,14 @@ struct dncp_subscriber_struct {
   void (*tlv_change_cb)(dncp_subscriber s,
                         dncp_node n, struct tlv_attr *tlv, bool add);
 
+  /**
+   * TLV types for which tlv_change_cb is called (zero-terminated).
+   *
+   * If NULL, tlv_change_cb is called for all TLVs. This must not be
+   * changed while subscribed.
+   */
+  const uint16_t *tlv_types;
+
   /**
    * Node change notification.
    *
@@ -192,6 +203,11 @@ struct dncp_ep_struct {
   /* How large can the multicasts be? */
   ssize_t maximum_multicast_size;
 
+  /* How large can batched unicast node state requests and replies
+   * be? (0 = unlimited) A single node state larger than this is still
+   * sent on its own. */
+  ssize_t maximum_unicast_size;
+
   /* Do we accept node data updates via multicast? */
   bool accept_node_data_updates_via_multicast;
 
@@ -210,6 +226,38 @@ struct dncp_ep_struct {
 
   /* Is unicast stream + reliable? */
   bool unicast_is_reliable_stream;
+
+  /* Use hierarchical network state when synchronizing over unicast.
+   *
+   * The network state is then treated as a tree over node identifier
+   * prefixes, and only the mismatching subtrees are walked (instead
+   * of receiving the whole network state at once). Peers that do not
+   * do this ignore the range TLVs, and reply with the full network
+   * state instead. */
+  bool hierarchical_network_state;
+
+  /* Request node data as a delta against the version we have.
+   *
+   * Only the TLVs added and removed since that version are then
+   * received, if the peer still knows the difference; otherwise, the
+   * peer ignores the delta request, and replies with the full node
+   * data instead. The default endpoint configuration also controls
+   * whether deltas of our own node data are kept around for peers. */
+  bool node_data_delta;
+
+  /* Request (and serve) the whole network state at once, when
+   * joining.
+   *
+   * Until we have been in sync with a neighbor (e.g. after a restart,
+   * even if node data was restored from a snapshot), or when we reach
+   * no other nodes, the network state request also asks for the node
+   * data of every node. It is then sent in as few unicast messages (of
+   * at most maximum_unicast_size) as possible, instead of the node
+   * states, and only then requests for the node data of each node.
+   * Peers that do not do this, or that sent the bulk state to us less
+   * than DNCP_BULK_STATE_MIN_INTERVAL ago, reply with just the network
+   * state instead. */
+  bool bulk_initial_sync;
 };
 
 /**
@@ -222,6 +270,13 @@ dncp_ep dncp_find_ep_by_name(dncp o, const char *name);
  */
 dncp_ep dncp_find_ep_by_id(dncp o, ep_id_t ep_id);
 
+/**
+ * Find an endpoint that matches the (operating system) interface
+ * index, or NULL if it is not known. The index is not derived by
+ * dncp itself; ext has to provide it using dncp_ep_set_ifindex.
+ */
+dncp_ep dncp_find_ep_by_ifindex(dncp o, uint32_t ifindex);
+
 /**
  * Does the current DNCP instance have highest ID on the given endpoint?
  */
@@ -242,6 +297,11 @@ dncp_ep dncp_ep_get_next(dncp_ep ep);
 dncp dncp_ep_get_dncp(dncp_ep ep);
 ep_id_t dncp_ep_get_id(dncp_ep ep);
 bool dncp_ep_is_enabled(dncp_ep ep);
+uint32_t dncp_ep_get_ifindex(dncp_ep ep);
+
+/* Set the interface index of the endpoint (0 = unknown). Any other
+ * endpoint with the same index loses it. */
+bool dncp_ep_set_ifindex(dncp_ep ep, uint32_t ifindex);
 
 /************************************************ API for whole dncp instance */
 
@@ -351,6 +411,13 @@ dncp_node dncp_node_get_next(dncp_node n);
  */
 bool dncp_node_is_self(dncp_node n);
 
+/**
+ * Check if the TLV removal being notified is due to the whole node
+ * going away. Node removal notification follows, so subscribers may
+ * handle such removals there in bulk instead.
+ */
+bool dncp_node_is_going_away(dncp_node n);
+
 /**
  * Get the TLVs for particular DNCP node.
  */
@@ -448,11 +515,22 @@ struct dncp_ext_configuration_struct {
    * be used to respond to node data requests. */
   hnetd_time_t minimum_prune_interval;
 
+  /* How often the full prune (flood fill from own node) is done at
+   * least; in between, reachability is updated incrementally based on
+   * the nodes whose neighbor TLVs may have changed. Zero means that
+   * full prune is always done. */
+  hnetd_time_t full_prune_interval;
+
   /* How much memory do we allocate for external code parts per node? */
   size_t ext_node_data_size;
 
   /* How much memory do we allocate for external code parts per ep? */
   size_t ext_ep_data_size;
+
+  /* The I/O does not carry unicast over reliable streams (e.g. with
+   * DTLS); unicast_is_reliable_stream of endpoints is then ignored,
+   * and so is their zero keepalive interval. */
+  bool disable_unicast_streams;
 };
 
 /* While the code uses sockaddr_in6 for now, it intentionally does not
@@ -474,6 +552,40 @@ struct dncp_ext_configuration_struct {
  * FLAG_SECURE is not, packet should be probably ignored. */
 #define DNCP_RECV_FLAG_SECURE_TRIED  0x8
 
+/* One received message within dncp_ext_cbs_struct.recv_batch. */
+typedef struct dncp_ext_msg_struct {
+  /* Set by DNCP (the buffer may be swapped with another message's) */
+  void *buf;
+  size_t buf_len;
+
+  /* Set by the I/O; src and dst point to the _store fields (or dst
+   * is NULL for multicast), ep, flags as with recv. */
+  dncp_ep ep;
+  struct sockaddr_in6 *src;
+  struct sockaddr_in6 *dst;
+  struct sockaddr_in6 src_store;
+  struct sockaddr_in6 dst_store;
+  int flags;
+  ssize_t len;
+} dncp_ext_msg_s, *dncp_ext_msg;
+
+/* Maximum number of messages handled per recv_batch call. */
+#define DNCP_RECV_BATCH 8
+
+/* One message to send within dncp_ext_cbs_struct.send_batch. The
+ * payload is the concatenation of the iovecs; ep, src and dst are as
+ * with send. */
+typedef struct dncp_ext_send_struct {
+  dncp_ep ep;
+  struct sockaddr_in6 *src;
+  struct sockaddr_in6 *dst;
+  struct iovec iov[2];
+  int iov_len;
+} dncp_ext_send_s, *dncp_ext_send;
+
+/* Maximum number of messages passed to one send_batch call. */
+#define DNCP_SEND_BATCH 32
+
 struct dncp_ext_cbs_struct {
   /* I/O-related callbacks */
 
@@ -484,12 +596,25 @@ struct dncp_ext_cbs_struct {
                   int *flags,
                   void *buf, size_t buf_len);
 
+  /**
+   * Receive up to count messages from the network at once
+   * (optional; if not set, recv is used instead). Returns the number
+   * of messages stored in msgs, or -1 if no more are available.
+   */
+  int (*recv_batch)(dncp_ext e, dncp_ext_msg msgs, int count);
+
   /** Send bytes to the network. */
   void (*send)(dncp_ext e, dncp_ep ep,
                struct sockaddr_in6 *src,
                struct sockaddr_in6 *dst,
                void *buf, size_t buf_len);
 
+  /**
+   * Send a number of messages to the network at once (optional; if
+   * not set, send is used for each of them).
+   */
+  void (*send_batch)(dncp_ext e, dncp_ext_send msgs, int count);
+
   /* Profile-related callbacks */
 
   /**
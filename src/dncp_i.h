@@ -33,10 +33,42 @@
 /* Rough approximation - should think of real figure. */
 #define DNCP_MAXIMUM_PAYLOAD_SIZE 65536
 
+/* Minimum interval between bulk states sent to the same neighbor;
+ * requests in between get the ordinary network state reply. */
+#define DNCP_BULK_STATE_MIN_INTERVAL (5 * HNETD_TIME_PER_SECOND)
+
 #include <libubox/vlist.h>
 #include <libubox/list.h>
 
 typedef struct dncp_ep_i_struct dncp_ep_i_s, *dncp_ep_i;
+typedef struct dncp_neighbor_struct dncp_neighbor_s, *dncp_neighbor;
+typedef struct dncp_node_adj_struct dncp_node_adj_s, *dncp_node_adj;
+
+typedef struct {
+  dncp_subscriber *s;
+  int num;
+} dncp_tlv_subscribers_s, *dncp_tlv_subscribers;
+
+/* Reference counted copy of a received message. Node data received
+ * within the message is used in place (tlv_container points within
+ * buf) instead of being copied to a separate allocation. Released
+ * buffers are kept in per-size class free lists for reuse. */
+typedef struct dncp_rbuf_struct dncp_rbuf_s, *dncp_rbuf;
+
+struct dncp_rbuf_struct {
+  /* Next buffer in the free list (if free) */
+  dncp_rbuf next;
+
+  int refcount;
+  int size_class;
+
+  unsigned char buf[];
+};
+
+/* Buffer sizes are DNCP_RBUF_MIN_SIZE << size class */
+#define DNCP_RBUF_MIN_SIZE 256
+#define DNCP_RBUF_CLASSES 10
+#define DNCP_RBUF_FREE_MAX 8
 
 
 typedef struct __packed {
@@ -47,6 +79,20 @@ typedef struct __packed {
   unsigned char buf[DNCP_NI_MAX_LEN];
 } dncp_node_id_s, *dncp_node_id;
 
+/* Queued network state message; endpoint identifier TLV followed by
+ * body_len bytes of dncp->network_state_body. */
+typedef struct {
+  dncp_ep_i l;
+  struct sockaddr_in6 src;
+  struct sockaddr_in6 dst;
+  bool has_src;
+  bool has_dst;
+  int prefix_len;
+  unsigned char prefix[sizeof(struct tlv_attr) + sizeof(dncp_node_id_s)
+                       + sizeof(dncp_t_ep_id_s)];
+  int body_len;
+} dncp_pending_send_s, *dncp_pending_send;
+
 struct dncp_struct {
   /* 'external' handling structure */
   dncp_ext ext;
@@ -60,12 +106,27 @@ struct dncp_struct {
   /* nodes (as contained within the protocol, that is, raw TLV data blobs). */
   struct vlist_tree nodes;
 
+  /* Open addressing (linear probing) hash index of nodes by node
+   * identifier; size is power of two, and at most half is in use. */
+  dncp_node *node_hash;
+  int node_hash_size;
+  int node_hash_count;
+
   /* local data (TLVs API's clients want published). */
   struct vlist_tree tlvs;
 
+  /* Serialized (sorted) form of tlvs, spliced on every add/remove;
+   * NULL if it has to be rebuilt from scratch. */
+  struct tlv_attr *tlvs_container;
+  int tlvs_container_size;
+
   /* local endpoints (endpoints clients have at least referred to once). */
   struct vlist_tree eps;
 
+  /* Endpoints indexed by interface index (NULL if none). */
+  dncp_ep_i *ep_by_ifindex;
+  uint32_t ep_by_ifindex_size;
+
   /* flag which indicates that we should perhaps re-publish our node
    * in nodes. */
   bool tlvs_dirty;
@@ -82,14 +143,70 @@ struct dncp_struct {
    * changed connectivity. */
   bool graph_dirty;
 
+  /* Nodes whose data (and therefore maybe neighbor TLVs) changed
+   * since the last reachability update. */
+  struct list_head graph_dirty_nodes;
+
+  /* flag which indicates that the next reachability update must be
+   * full prune (e.g. own node changed). */
+  bool graph_full_dirty;
+
   /* Few different times.. */
-  hnetd_time_t last_prune;
-  hnetd_time_t next_prune;
+  hnetd_time_t last_prune; /* last full prune */
+  hnetd_time_t next_prune; /* next full prune */
+  hnetd_time_t last_graph_update; /* last full or incremental prune */
+
+  /* Reachability update statistics. */
+  int num_prune_full;
+  int num_prune_incremental;
+  int num_prune_visits;
+
+  /* Number of node data deltas received and applied. */
+  int num_node_delta_applied;
+
+  /* Number of bulk network states sent. */
+  int num_bulk_state_sent;
+
+  /* Have we received network state consistent with ours from a
+   * neighbor (i.e. been in sync at least once). */
+  bool network_state_synced;
 
   /* flag which indicates that we should re-calculate network hash
    * based on nodes' state. */
   bool network_hash_dirty;
 
+  /* flag which indicates that the set of reachable nodes (and
+   * therefore layout of network_hash_buf) has changed. */
+  bool network_hash_layout_dirty;
+
+  /* The network hash input; (update number, node data hash) of every
+   * reachable node, in node identifier order. The entries of nodes on
+   * network_hash_dirty_nodes are patched in place, and the whole
+   * buffer is rebuilt only if the layout is dirty. */
+  void *network_hash_buf;
+  int network_hash_buf_count;
+  int network_hash_buf_size;
+  struct list_head network_hash_dirty_nodes;
+
+  /* Incremented whenever the network hash is recalculated. */
+  uint32_t network_hash_generation;
+
+  /* The endpoint-independent part of network state messages: network
+   * state TLV (network_state_body_short_len bytes) followed by the
+   * node state TLVs. Rebuilt only if the network hash generation or
+   * the time (node states contain relative times) changes. */
+  struct tlv_buf network_state_body;
+  int network_state_body_short_len;
+  uint32_t network_state_body_generation;
+  hnetd_time_t network_state_body_time;
+  bool network_state_body_valid;
+
+  /* Network state messages waiting to be sent with one send_batch
+   * call. They are queued only within dncp_ext_timeout. */
+  bool queue_sends;
+  dncp_pending_send_s pending_sends[DNCP_SEND_BATCH];
+  int num_pending_sends;
+
   bool immediate_scheduled;
 
   /* Our own node (it should be constant, never purged) */
@@ -105,6 +222,22 @@ struct dncp_struct {
   /* List of subscribers to change notifications. */
   struct list_head subscribers[NUM_DNCP_CALLBACKS];
 
+  /* Type -> subscribers interested in TLV changes of only specific
+   * TLV types (the others are in subscribers[DNCP_CALLBACK_TLV]). */
+  dncp_tlv_subscribers tlv_type_subscribers;
+  int tlv_type_subscribers_length;
+
+  /* Scratch space for TLVs added within node data update. */
+  struct tlv_attr **tlvs_added;
+  int tlvs_added_size;
+
+  /* Free lists of received message buffers. */
+  dncp_rbuf rbuf_free[DNCP_RBUF_CLASSES];
+  int rbuf_free_count[DNCP_RBUF_CLASSES];
+
+  /* Receive buffers for recv_batch (allocated on first use). */
+  unsigned char *recv_bufs;
+
   /* An array that contains type -> index+1 (if available) or type ->
    * 0 (if no index yet allocated). */
   int *tlv_type_to_index;
@@ -118,6 +251,16 @@ struct dncp_struct {
 
   /* Number of times neighbor has been dropped. */
   int num_neighbor_dropped;
+
+  /* Neighbor table; the neighbors stored within local DNCP_T_NEIGHBOR
+   * TLVs, with hash indexes by the TLV content (node identifier,
+   * remote and local endpoint identifiers) and by most recent remote
+   * address. Maintained in update_tlv. */
+  struct list_head neighbors;
+  int num_neighbors;
+  int neighbor_hash_size;
+  dncp_neighbor *neighbor_hash;
+  dncp_neighbor *neighbor_sa6_hash;
 };
 
 typedef struct dncp_trickle_struct dncp_trickle_s, *dncp_trickle;
@@ -150,6 +293,10 @@ struct dncp_ep_i_struct {
    * dncp process. */
   ep_id_t ep_id;
 
+  /* Operating system interface index (0 = unknown); maintained by
+   * ext using dncp_ep_set_ifindex. */
+  uint32_t ifindex;
+
   /* What value we have TLV for, if any */
   uint32_t published_keepalive_interval;
 
@@ -161,18 +308,37 @@ struct dncp_ep_i_struct {
   dncp_trickle_s trickle;
 };
 
-typedef struct dncp_neighbor_struct dncp_neighbor_s, *dncp_neighbor;
 
 struct dncp_neighbor_struct {
-  /* Most recent address we heard from this particular neighbor */
+  /* dncp->neighbors entry */
+  struct list_head lh;
+
+  /* The local TLV this neighbor lives in */
+  dncp_tlv tlv;
+
+  /* dncp->neighbor_hash and dncp->neighbor_sa6_hash chains */
+  dncp_neighbor next_by_id;
+  dncp_neighbor next_by_sa6;
+  bool in_sa6_hash;
+
+  /* Most recent address we heard from this particular neighbor;
+   * change only using dncp_neighbor_set_sa6. */
   struct sockaddr_in6 last_sa6;
 
   /* When did we last time receive _consistent_ state from the peer
    * (multicast) or any contact (unicast). */
   hnetd_time_t last_contact;
 
+  /* Keepalive interval the peer has published for the endpoint;
+   * invalidated whenever the peer's node data changes. */
+  hnetd_time_t keepalive_interval;
+  bool keepalive_interval_valid;
+
   /* The per-(local)peer Trickle state. */
   dncp_trickle_s trickle;
+
+  /* When did we last send the bulk state to the peer. */
+  hnetd_time_t last_bulk_state_sent;
 };
 
 
@@ -187,9 +353,36 @@ struct dncp_node_struct {
   dncp_node_id_s node_id;
   uint32_t update_number;
 
+  /* Hash of node_id (for dncp->node_hash) */
+  uint32_t node_id_hash;
+
   /* When was the last prune during which this node was reachable */
   hnetd_time_t last_reachable_prune;
 
+  /* Set while the TLV removals of a node becoming unreachable are
+   * notified (the node removal notification follows). */
+  bool going_away;
+
+  /* Reachability spanning tree rooted at own node (valid only if
+   * reachable). */
+  dncp_node prune_parent;
+  struct list_head prune_children;
+  struct list_head in_prune_children;
+
+  /* dncp->graph_dirty_nodes entry */
+  struct list_head in_graph_dirty;
+
+  /* Work list entry, and flag, used by incremental reachability update */
+  struct list_head in_prune_work;
+  bool prune_orphan;
+
+  /* Entry index within dncp->network_hash_buf (valid only if
+   * reachable, and the layout is not dirty). */
+  int network_hash_index;
+
+  /* dncp->network_hash_dirty_nodes entry (if entry needs patching) */
+  struct list_head in_network_hash_dirty;
+
   /* Node state stuff */
   dncp_hash_s node_data_hash;
   bool node_data_hash_dirty; /* Something related to hash changed */
@@ -202,6 +395,10 @@ struct dncp_node_struct {
    * changes, so probably just faster to keep a pointer to it. */
   struct tlv_attr *tlv_container;
 
+  /* Received message tlv_container points within (if any); otherwise,
+   * tlv_container is separately allocated. */
+  dncp_rbuf tlv_container_rbuf;
+
   /* TLV data, that is of correct version # and otherwise looks like
    * it should be used by us. Either tlv_container, or NULL. */
   struct tlv_attr *tlv_container_valid;
@@ -218,6 +415,40 @@ struct dncp_node_struct {
    * re-alloc when tlv_container changes and we don't immediately want
    * to recalculate tlv_index. */
   bool tlv_index_dirty;
+
+  /* Bidirectional neighbors of the node; one entry per (raw) neighbor
+   * TLV that is matched by the neighbor's own neighbor TLV. Rebuilt
+   * on access if adj_dirty is set, which happens whenever either
+   * this node, or node it refers to (or is referred to by) in its
+   * neighbor TLVs, changes its data. */
+  dncp_node_adj adj;
+  int adj_count;
+  int adj_size;
+  bool adj_dirty;
+
+  /* Serialized node state TLV, including the node data, as sent in
+   * replies to node state requests. Only ms_since_origination is
+   * patched when it is sent. Built on first request, and freed
+   * whenever the node is set. */
+  struct tlv_attr *node_state_cache;
+
+  /* Difference between the node data of update number
+   * node_delta_base and the current node data: removed TLVs
+   * (node_delta_removed_len bytes), followed by added TLVs. Kept only
+   * if node data deltas are enabled. */
+  unsigned char *node_delta;
+  int node_delta_len;
+  int node_delta_removed_len;
+  uint32_t node_delta_base;
+};
+
+struct dncp_node_adj_struct {
+  /* The bidirectional neighbor */
+  dncp_node node;
+
+  /* Our neighbor TLV (within tlv_container) pointing at it */
+  struct tlv_attr *tlv;
+  dncp_t_neighbor ne;
 };
 
 struct dncp_tlv_struct {
@@ -242,7 +473,15 @@ void dncp_uninit(dncp o);
 void dncp_node_set(dncp_node n,
                    uint32_t update_number, hnetd_time_t t,
                    struct tlv_attr *a);
+/* As above, but a points within rb; the reference to rb is consumed. */
+void dncp_node_set_rbuf(dncp_node n,
+                        uint32_t update_number, hnetd_time_t t,
+                        struct tlv_attr *a, dncp_rbuf rb);
+dncp_rbuf dncp_rbuf_alloc(dncp o, int len);
+dncp_rbuf dncp_rbuf_copy(dncp o, struct tlv_attr *msg);
+void dncp_rbuf_unref(dncp o, dncp_rbuf rb);
 void dncp_node_recalculate_index(dncp_node n);
+void dncp_node_recalculate_adjacency(dncp_node n);
 
 bool dncp_add_tlv_index(dncp o, uint16_t type);
 
@@ -251,8 +490,18 @@ void dncp_schedule(dncp o);
 /* Flush own TLV changes to own node. */
 void dncp_self_flush(dncp_node n);
 
+/* Walk the ordered difference of two (sorted) node data containers:
+ * cb is called for each TLV only in a_old (add = false) and only in
+ * a_new (add = true), in order. Malformed trailing data is ignored. The
+ * walk stops, and false is returned, if cb returns false. */
+typedef bool (*dncp_tlv_diff_cb)(void *context, struct tlv_attr *a,
+                                 bool add);
+bool dncp_tlv_diff(struct tlv_attr *a_old, struct tlv_attr *a_new,
+                   dncp_tlv_diff_cb cb, void *context);
+
 /* Various hash calculation utilities. */
 void dncp_calculate_network_hash(dncp o);
+void dncp_calculate_node_data_hash(dncp_node n);
 
 /* Utility functions to send frames. */
 void dncp_ep_i_send_network_state(dncp_ep_i l,
@@ -260,7 +509,19 @@ void dncp_ep_i_send_network_state(dncp_ep_i l,
                                   struct sockaddr_in6 *dst,
                                   size_t maximum_size,
                                   bool always_ep_id);
+void dncp_flush_sends(dncp o);
+
+/* Neighbor table utilities. */
+dncp_neighbor dncp_find_neighbor(dncp o, dncp_node_id ni,
+                                 ep_id_t neighbor_ep_id, ep_id_t ep_id);
+dncp_neighbor dncp_find_neighbor_by_sa6(dncp o, struct sockaddr_in6 *sa6);
+void dncp_neighbor_set_sa6(dncp o, dncp_neighbor n, struct sockaddr_in6 *sa6);
 
+#define dncp_for_each_neighbor(o, n)                    \
+  list_for_each_entry(n, &(o)->neighbors, lh)
+
+#define dncp_for_each_neighbor_safe(o, n, n2)                   \
+  list_for_each_entry_safe(n, n2, &(o)->neighbors, lh)
 
 /* Miscellaneous utilities that live in dncp_timeout */
 void dncp_trickle_reset(dncp o);
@@ -279,6 +540,23 @@ static inline hnetd_time_t dncp_time(dncp o)
   return o->now;
 }
 
+/* Is the unicast of the endpoint actually sent over a reliable stream? */
+static inline bool dncp_ep_i_unicast_stream(dncp_ep_i l)
+{
+  return l->conf.unicast_is_reliable_stream
+    && !l->dncp->ext->conf.disable_unicast_streams;
+}
+
+/* Keepalive interval to use on the endpoint; the zero one configured
+ * for streams does not apply if streams are not used. */
+static inline hnetd_time_t dncp_ep_i_keepalive_interval(dncp_ep_i l)
+{
+  if (!l->conf.keepalive_interval && l->conf.unicast_is_reliable_stream
+      && !dncp_ep_i_unicast_stream(l))
+    return DNCP_KEEPALIVE_INTERVAL(l->dncp);
+  return l->conf.keepalive_interval;
+}
+
 #define TMIN(x,y) ((x) == 0 ? (y) : (y) == 0 ? (x) : (x) < (y) ? (x) : (y))
 
 #define DNCP_LINK_F "link %s[#%d]"
@@ -321,27 +599,38 @@ dncp_tlv_get_node_id(dncp o, void *tlv)
                                o->ext->conf.node_id_length);
 }
 
+static inline dncp_t_neighbor
+dncp_neighbor_get_t(dncp o, dncp_neighbor n)
+{
+  return dncp_tlv_neighbor(o, &n->tlv->tlv);
+}
+
+static inline dncp_node_adj
+dncp_node_get_adjacency(dncp_node n)
+{
+  if (n->adj_dirty)
+    dncp_node_recalculate_adjacency(n);
+  return n->adj;
+}
+
+#define dncp_node_for_each_adj(n, adj)                          \
+  for (adj = dncp_node_get_adjacency(n) ;                       \
+       adj && adj < (n)->adj + (n)->adj_count ; adj++)
+
 static inline dncp_node
 dncp_node_find_neigh_bidir(dncp_node n, dncp_t_neighbor ne)
 {
   if (!n)
     return NULL;
-  dncp_node_id ni = dncp_tlv_get_node_id(n->dncp, ne);
-  dncp_node n2 = dncp_find_node_by_node_id(n->dncp, ni, false);
-  if (!n2)
-    return NULL;
-  struct tlv_attr *a;
-  dncp_t_neighbor ne2;
-
-  dncp_node_for_each_tlv_with_t_v(n2, a, DNCP_T_NEIGHBOR, false)
-    if ((ne2 = dncp_tlv_neighbor(n->dncp, a)))
-      {
-        if (ne->ep_id == ne2->neighbor_ep_id
-            && ne->neighbor_ep_id == ne2->ep_id &&
-            !memcmp(dncp_tlv_get_node_id(n->dncp, ne2),
-                    &n->node_id, DNCP_NI_LEN(n->dncp)))
-          return n2;
-      }
-
+  dncp_node_adj adj;
+
+  dncp_node_for_each_adj(n, adj)
+    if (adj->ne == ne
+        || (adj->ne->ep_id == ne->ep_id
+            && adj->ne->neighbor_ep_id == ne->neighbor_ep_id
+            && !memcmp(dncp_tlv_get_node_id(n->dncp, adj->ne),
+                       dncp_tlv_get_node_id(n->dncp, ne),
+                       DNCP_NI_LEN(n->dncp))))
+      return adj->node;
   return NULL;
 }
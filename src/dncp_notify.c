@@ -27,8 +27,76 @@
     x(o, s, DNCP_CALLBACK_SOCKET_MSG, msg_received_cb);         \
   } while(0)
 
+/* Subscribers with TLV types are kept in per-type arrays instead of
+ * the subscribers[DNCP_CALLBACK_TLV] list. */
+#define HANDLE_IS_LISTED(s, e)                          \
+  (e != DNCP_CALLBACK_TLV || !s->tlv_types)
+
 #define HANDLE_ADD(o, s, e, cb)                         \
-  if (s->cb) list_add(&s->lhs[e], &o->subscribers[e])
+  if (s->cb && HANDLE_IS_LISTED(s, e))                  \
+    list_add(&s->lhs[e], &o->subscribers[e])
+
+static bool _subscriber_wants_tlv(dncp_subscriber s, struct tlv_attr *a)
+{
+  const uint16_t *t;
+
+  if (!s->tlv_types)
+    return true;
+  for (t = s->tlv_types; *t; t++)
+    if (*t == tlv_id(a))
+      return true;
+  return false;
+}
+
+static void _tlv_type_subscribe(dncp o, dncp_subscriber s)
+{
+  const uint16_t *t;
+
+  for (t = s->tlv_types; *t; t++)
+    {
+      if (*t >= o->tlv_type_subscribers_length)
+        {
+          int old_len = o->tlv_type_subscribers_length;
+          int new_len = *t + 1;
+          dncp_tlv_subscribers ts =
+            realloc(o->tlv_type_subscribers, new_len * sizeof(*ts));
+          if (!ts)
+            goto oom;
+          memset(ts + old_len, 0, (new_len - old_len) * sizeof(*ts));
+          o->tlv_type_subscribers = ts;
+          o->tlv_type_subscribers_length = new_len;
+        }
+      dncp_tlv_subscribers ts = &o->tlv_type_subscribers[*t];
+      dncp_subscriber *ns = realloc(ts->s, (ts->num + 1) * sizeof(*ns));
+      if (!ns)
+        goto oom;
+      ts->s = ns;
+      ts->s[ts->num++] = s;
+    }
+  return;
+ oom:
+  L_ERR("unable to subscribe to TLV type %d", (int)*t);
+}
+
+static void _tlv_type_unsubscribe(dncp o, dncp_subscriber s)
+{
+  const uint16_t *t;
+  int i;
+
+  for (t = s->tlv_types; *t; t++)
+    {
+      if (*t >= o->tlv_type_subscribers_length)
+        continue;
+      dncp_tlv_subscribers ts = &o->tlv_type_subscribers[*t];
+      for (i = 0; i < ts->num; i++)
+        if (ts->s[i] == s)
+          {
+            memmove(&ts->s[i], &ts->s[i + 1],
+                    (--ts->num - i) * sizeof(ts->s[0]));
+            break;
+          }
+    }
+}
 
 void dncp_subscribe(dncp o, dncp_subscriber s)
 {
@@ -37,6 +105,8 @@ void dncp_subscribe(dncp o, dncp_subscriber s)
   struct tlv_attr *a;
 
   HANDLE_ENUM_CB(o, s, HANDLE_ADD);
+  if (s->tlv_change_cb && s->tlv_types)
+    _tlv_type_subscribe(o, s);
   if (s->local_tlv_change_cb)
     {
       vlist_for_each_element(&o->tlvs, t, in_tlvs)
@@ -48,12 +118,14 @@ void dncp_subscribe(dncp o, dncp_subscriber s)
         s->node_change_cb(s, n, true);
       if (s->tlv_change_cb)
         dncp_node_for_each_tlv(n, a)
-          s->tlv_change_cb(s, n, a, true);
+          if (_subscriber_wants_tlv(s, a))
+            s->tlv_change_cb(s, n, a, true);
     }
 }
 
 #define HANDLE_DEL(o, s, e, cb)                 \
-  if (s->cb) list_del(&s->lhs[e])
+  if (s->cb && HANDLE_IS_LISTED(s, e))          \
+    list_del(&s->lhs[e])
 
 void dncp_unsubscribe(dncp o, dncp_subscriber s)
 {
@@ -70,11 +142,14 @@ void dncp_unsubscribe(dncp o, dncp_subscriber s)
     {
       if (s->tlv_change_cb)
         dncp_node_for_each_tlv(n, a)
-          s->tlv_change_cb(s, n, a, false);
+          if (_subscriber_wants_tlv(s, a))
+            s->tlv_change_cb(s, n, a, false);
       if (s->node_change_cb)
         s->node_change_cb(s, n, false);
     }
   HANDLE_ENUM_CB(o, s, HANDLE_DEL);
+  if (s->tlv_change_cb && s->tlv_types)
+    _tlv_type_unsubscribe(o, s);
 }
 
 /* This can be only used in a loop which makes sure that the p stays
@@ -92,105 +167,153 @@ void dncp_unsubscribe(dncp o, dncp_subscriber s)
       break;                                    \
     }
 
-void dncp_notify_subscribers_tlvs_changed(dncp_node n,
-                                          struct tlv_attr *a_old,
-                                          struct tlv_attr *a_new)
+static void _notify_tlv_changed(dncp_node n, struct tlv_attr *a, bool add)
 {
+  dncp o = n->dncp;
   dncp_subscriber s;
-  void *old_end = (void *)a_old + (a_old ? tlv_pad_len(a_old) : 0);
-  void *new_end = (void *)a_new + (a_new ? tlv_pad_len(a_new) : 0);
-  int r;
+  int i;
 
-  /* There are two distinct steps here: First we remove missing, and
-   * then we add new ones. Otherwise, there may be confusion if we get
-   * first new + then remove, and the underlying TLV has same
-   * key.. :-p */
-  list_for_each_entry(s, &n->dncp->subscribers[DNCP_CALLBACK_TLV],
+  list_for_each_entry(s, &o->subscribers[DNCP_CALLBACK_TLV],
                       lhs[DNCP_CALLBACK_TLV])
+    s->tlv_change_cb(s, n, a, add);
+  if ((int)tlv_id(a) >= o->tlv_type_subscribers_length)
+    return;
+  dncp_tlv_subscribers ts = &o->tlv_type_subscribers[tlv_id(a)];
+  for (i = 0; i < ts->num; i++)
+    ts->s[i]->tlv_change_cb(ts->s[i], n, a, add);
+}
+
+/* Remember added TLV within added (which is o->tlvs_added taken over
+ * by the caller, as callbacks might in theory recurse here). */
+static bool _push_added(struct tlv_attr ***added, int *size, int *num,
+                        struct tlv_attr *a)
+{
+  if (*num == *size)
     {
-      struct tlv_attr *op = a_old ? tlv_data(a_old) : NULL;
-      struct tlv_attr *np = a_new ? tlv_data(a_new) : NULL;
+      int new_size = *size ? *size * 2 : 16;
+      struct tlv_attr **na = realloc(*added, new_size * sizeof(*na));
+      if (!na)
+        return false;
+      *added = na;
+      *size = new_size;
+    }
+  (*added)[(*num)++] = a;
+  return true;
+}
 
-      /* Keep two pointers, one for old, one for new. */
+bool dncp_tlv_diff(struct tlv_attr *a_old, struct tlv_attr *a_new,
+                   dncp_tlv_diff_cb cb, void *context)
+{
+  void *old_end = (void *)a_old + (a_old ? tlv_pad_len(a_old) : 0);
+  void *new_end = (void *)a_new + (a_new ? tlv_pad_len(a_new) : 0);
+  struct tlv_attr *op = a_old ? tlv_data(a_old) : NULL;
+  struct tlv_attr *np = a_new ? tlv_data(a_new) : NULL;
+  int r;
+
+  /* Keep two pointers, one for old, one for new. */
 
-      /* While there's data in both, and it looks valid, we drain each
-       * 0-1 at the time. */
-      while (op && np)
+  /* While there's data in both, and it looks valid, we drain each
+   * 0-1 at the time. */
+  while (op && np)
+    {
+      ENSURE_VALID(op, old_end);
+      ENSURE_VALID(np, new_end);
+      /* Ok, op and np both point at valid structs. */
+      r = tlv_attr_cmp(op, np);
+      /* If they're equal, we can skip both, no sense giving notification */
+      if (!r)
         {
-          ENSURE_VALID(op, old_end);
-          ENSURE_VALID(np, new_end);
-          /* Ok, op and np both point at valid structs. */
-          r = tlv_attr_cmp(op, np);
-          /* If they're equal, we can skip both, no sense giving notification */
-          if (!r)
-            {
-              op = tlv_next(op);
-              np = tlv_next(np);
-            }
-          else if (r < 0)
-            {
-              /* op < np => op deleted */
-              s->tlv_change_cb(s, n, op, false);
-              op = tlv_next(op);
-            }
-          else
-            {
-              /* op > np => np added */
-              /* in part 2 */
-              np = tlv_next(np);
-            }
+          op = tlv_next(op);
+          np = tlv_next(np);
         }
-      /* Anything left in op was deleted. */
-      while (op)
+      else if (r < 0)
         {
-          ENSURE_VALID(op, old_end);
-          s->tlv_change_cb(s, n, op, false);
+          /* op < np => op deleted */
+          if (!cb(context, op, false))
+            return false;
           op = tlv_next(op);
         }
+      else
+        {
+          /* op > np => np added */
+          if (!cb(context, np, true))
+            return false;
+          np = tlv_next(np);
+        }
     }
-  list_for_each_entry(s, &n->dncp->subscribers[DNCP_CALLBACK_TLV],
-                      lhs[DNCP_CALLBACK_TLV])
+  /* Anything left in op was deleted. */
+  while (op)
+    {
+      ENSURE_VALID(op, old_end);
+      if (!cb(context, op, false))
+        return false;
+      op = tlv_next(op);
+    }
+  /* Anything left in np was added. */
+  while (np)
     {
-      struct tlv_attr *op = a_old ? tlv_data(a_old) : NULL;
-      struct tlv_attr *np = a_new ? tlv_data(a_new) : NULL;
+      ENSURE_VALID(np, new_end);
+      if (!cb(context, np, true))
+        return false;
+      np = tlv_next(np);
+    }
+  return true;
+}
 
-      /* Keep two pointers, one for old, one for new. */
+typedef struct {
+  dncp_node n;
+  struct tlv_attr **added;
+  int size;
+  int num;
+} dncp_notify_diff_s, *dncp_notify_diff;
 
-      /* While there's data in both, and it looks valid, we drain each
-       * 0-1 at the time. */
-      while (op && np)
-        {
-          ENSURE_VALID(op, old_end);
-          ENSURE_VALID(np, new_end);
-          /* Ok, op and np both point at valid structs. */
-          r = tlv_attr_cmp(op, np);
-          /* If they're equal, we can skip both, no sense giving notification */
-          if (!r)
-            {
-              op = tlv_next(op);
-              np = tlv_next(np);
-            }
-          else if (r < 0)
-            {
-              /* op < np => op deleted */
-              /* we did this in part 1 */
-              op = tlv_next(op);
-            }
-          else
-            {
-              /* op > np => np added */
-              s->tlv_change_cb(s, n, np, true);
-              np = tlv_next(np);
-            }
-        }
-      /* Anything left in np was added. */
-      while (np)
-        {
-          ENSURE_VALID(np, new_end);
-          s->tlv_change_cb(s, n, np, true);
-          np = tlv_next(np);
-        }
+static bool _notify_diff_cb(void *context, struct tlv_attr *a, bool add)
+{
+  dncp_notify_diff d = context;
+
+  if (!add)
+    {
+      _notify_tlv_changed(d->n, a, false);
+      return true;
+    }
+  return _push_added(&d->added, &d->size, &d->num, a);
+}
+
+void dncp_notify_subscribers_tlvs_changed(dncp_node n,
+                                          struct tlv_attr *a_old,
+                                          struct tlv_attr *a_new)
+{
+  dncp o = n->dncp;
+  dncp_notify_diff_s d;
+  int i;
+
+  if (list_empty(&o->subscribers[DNCP_CALLBACK_TLV])
+      && !o->tlv_type_subscribers_length)
+    return;
+  d.n = n;
+  d.added = o->tlvs_added;
+  d.size = o->tlvs_added_size;
+  d.num = 0;
+  o->tlvs_added = NULL;
+  o->tlvs_added_size = 0;
+
+  /* The diff is calculated only once, but there are two distinct
+   * steps in notification: First we remove missing, and then we add
+   * new ones. Otherwise, there may be confusion if we get first new +
+   * then remove, and the underlying TLV has same key.. :-p Added
+   * ones are therefore stored until the removals are done. */
+  if (!dncp_tlv_diff(a_old, a_new, _notify_diff_cb, &d))
+    L_ERR("out of memory - dropping TLV add notifications");
+  for (i = 0; i < d.num; i++)
+    _notify_tlv_changed(n, d.added[i], true);
+  if (o->tlvs_added)
+    {
+      /* Someone recursed here and left their buffer in place. */
+      free(d.added);
+      return;
     }
+  o->tlvs_added = d.added;
+  o->tlvs_added_size = d.size;
 }
 
 void dncp_notify_subscribers_local_tlv_changed(dncp o,
@@ -12,6 +12,7 @@
  */
 
 #include "dncp_i.h"
+#include "bitops.h"
 
 /*
  * This module contains the logic to handle receiving and sending of
@@ -21,7 +22,7 @@
 
 /***************************************************** Low-level TLV pushing */
 
-static bool _push_node_state_tlv(struct tlv_buf *tb, dncp_node n,
+static void _fill_node_state_tlv(struct tlv_attr *a, dncp_node n,
                                  bool incl_data)
 {
   hnetd_time_t now = dncp_time(n->dncp);
@@ -29,13 +30,8 @@ static bool _push_node_state_tlv(struct tlv_buf *tb, dncp_node n,
   int nilen = DNCP_NI_LEN(n->dncp);
   int hlen = DNCP_HASH_LEN(n->dncp);
   dncp_t_node_state s;
-  int tlen = nilen + sizeof(*s) + hlen + l;
-  struct tlv_attr *a = tlv_new(tb, DNCP_T_NODE_STATE, tlen);
-
-  if (!a)
-    return false;
-
   void *p = tlv_data(a);
+
   memcpy(p, &n->node_id, nilen);
   p += nilen;
 
@@ -49,7 +45,52 @@ static bool _push_node_state_tlv(struct tlv_buf *tb, dncp_node n,
 
   if (l)
     memcpy(p, tlv_data(n->tlv_container), l);
+}
+
+static bool _push_node_state_tlv(struct tlv_buf *tb, dncp_node n,
+                                 bool incl_data)
+{
+  int l = incl_data && n->tlv_container ? tlv_len(n->tlv_container) : 0;
+  int nilen = DNCP_NI_LEN(n->dncp);
+  int hlen = DNCP_HASH_LEN(n->dncp);
+  int tlen = nilen + sizeof(dncp_t_node_state_s) + hlen + l;
+  struct tlv_attr *a = tlv_new(tb, DNCP_T_NODE_STATE, tlen);
+
+  if (!a)
+    return false;
+  _fill_node_state_tlv(a, n, incl_data);
+  return true;
+}
+
+/* Push node state with data. The serialized TLV is cached in the
+ * node until it is next set, so repeated requests for the same node
+ * (e.g. when a router joins, and every neighbor asks for everything)
+ * cost only a copy and the ms_since_origination patch. */
+static bool _push_node_state_tlv_cached(struct tlv_buf *tb, dncp_node n)
+{
+  struct tlv_attr *c = n->node_state_cache;
+  int nilen = DNCP_NI_LEN(n->dncp);
+  struct tlv_attr *a;
+  dncp_t_node_state s;
 
+  if (!c)
+    {
+      int tlen = nilen + sizeof(*s) + DNCP_HASH_LEN(n->dncp)
+        + (n->tlv_container ? tlv_len(n->tlv_container) : 0);
+
+      dncp_calculate_node_data_hash(n);
+      if (!(c = malloc(TLV_SIZE + tlen)))
+        return _push_node_state_tlv(tb, n, true);
+      tlv_init(c, DNCP_T_NODE_STATE, TLV_SIZE + tlen);
+      _fill_node_state_tlv(c, n, true);
+      n->node_state_cache = c;
+    }
+  if (!(a = tlv_new(tb, DNCP_T_NODE_STATE, tlv_len(c))))
+    return false;
+  memcpy(tlv_data(a), tlv_data(c), tlv_len(c));
+  s = tlv_data(a) + nilen;
+  s->ms_since_origination =
+    cpu_to_be32(dncp_time(n->dncp) - n->origination_time);
   return true;
 }
 
@@ -64,199 +105,783 @@ static bool _push_network_state_tlv(struct tlv_buf *tb, dncp o)
   return true;
 }
 
+static void _fill_ep_id_tlv(struct tlv_attr *a, dncp_ep_i l)
+{
+  dncp_t_ep_id lid;
+
+  memcpy(tlv_data(a), &l->dncp->own_node->node_id, DNCP_NI_LEN(l->dncp));
+  lid = tlv_data(a) + DNCP_NI_LEN(l->dncp);
+  lid->ep_id = l->ep_id;
+}
+
 static bool _push_ep_id_tlv(struct tlv_buf *tb, dncp_ep_i l,
                             struct sockaddr_in6 *dst, bool always_ep_id)
 {
-  dncp_t_ep_id lid;
-  int tl = DNCP_NI_LEN(l->dncp) + sizeof(*lid);
+  int tl = DNCP_NI_LEN(l->dncp) + sizeof(dncp_t_ep_id_s);
 
-  if (l->conf.unicast_is_reliable_stream && dst && !always_ep_id)
+  if (dncp_ep_i_unicast_stream(l) && dst && !always_ep_id)
     return true;
 
   struct tlv_attr *a = tlv_new(tb, DNCP_T_ENDPOINT_ID, tl);
 
   if (!a)
     return false;
-  memcpy(tlv_data(a), &l->dncp->own_node->node_id, DNCP_NI_LEN(l->dncp));
-  lid = tlv_data(a) + DNCP_NI_LEN(l->dncp);
-  lid->ep_id = l->ep_id;
+  _fill_ep_id_tlv(a, l);
   return true;
 }
 
+/********************************************* Hierarchical network state */
+
+/*
+ * The node identifier space is split into ranges by node identifier
+ * prefix. Hash of a range is calculated over the network hash input
+ * entries of the reachable nodes within it; as they are consecutive
+ * in dncp->network_hash_buf, zero length prefix covers everything and
+ * yields the network hash itself.
+ */
+
+/* How many prefix bits each split adds; i.e. 2^N subranges per split. */
+#define NET_STATE_RANGE_SPLIT_BITS 4
+
+static int _range_count(dncp o, dncp_node_id prefix, int plen,
+                        dncp_node *first)
+{
+  dncp_node_s fake_node = { .dncp = o };
+  dncp_node n, last;
+  int c = 0;
+
+  *first = NULL;
+  if (avl_is_empty(&o->nodes.avl))
+    return 0;
+  memcpy(&fake_node.node_id, prefix, DNCP_NI_LEN(o));
+  n = avl_find_ge_element(&o->nodes.avl, &fake_node, n, in_nodes.avl);
+  last = avl_last_element(&o->nodes.avl, n, in_nodes.avl);
+  for ( ; n ; n = n == last ? NULL : avl_next_element(n, in_nodes.avl))
+    {
+      if (bmemcmp(&n->node_id, prefix, plen))
+        break;
+      if (n->last_reachable_prune != o->last_prune)
+        continue;
+      if (!c++)
+        *first = n;
+    }
+  return c;
+}
+
+static void _range_hash(dncp o, dncp_node_id prefix, int plen, void *dst)
+{
+  int onelen = 4 + DNCP_HASH_LEN(o);
+  dncp_node n;
+  int c;
+
+  dncp_calculate_network_hash(o);
+  c = _range_count(o, prefix, plen, &n);
+  o->ext->cb.hash(n ? o->network_hash_buf + n->network_hash_index * onelen
+                  : o->network_hash_buf, c * onelen, dst);
+}
+
+static bool _parse_range(dncp o, void *p, int len,
+                         dncp_node_id prefix, int *plen)
+{
+  dncp_t_net_state_range r = p;
+  int bits, bytes;
+
+  if (len < (int)sizeof(*r))
+    return false;
+  bits = r->prefix_length_bits;
+  bytes = ROUND_BITS_TO_BYTES(bits);
+  if (bits > DNCP_NI_LEN(o) * 8 || len != (int)sizeof(*r) + bytes)
+    return false;
+  memset(prefix, 0, sizeof(*prefix));
+  memcpy(prefix, r->prefix_data, bytes);
+  if (bits % 8)
+    prefix->buf[bits / 8] &= 0xFF << (8 - bits % 8);
+  *plen = bits;
+  return true;
+}
+
+static bool _push_range_tlv(struct tlv_buf *tb, dncp o, int type,
+                            dncp_node_id prefix, int plen)
+{
+  int hlen = type == DNCP_T_NET_STATE_RANGE ? DNCP_HASH_LEN(o) : 0;
+  int bytes = ROUND_BITS_TO_BYTES(plen);
+  struct tlv_attr *a =
+    tlv_new(tb, type, hlen + sizeof(dncp_t_net_state_range_s) + bytes);
+  dncp_t_net_state_range r;
+
+  if (!a)
+    return false;
+  if (hlen)
+    _range_hash(o, prefix, plen, tlv_data(a));
+  r = tlv_data(a) + hlen;
+  r->prefix_length_bits = plen;
+  memcpy(r->prefix_data, prefix, bytes);
+  return true;
+}
+
+/* Number of prefix bits the range prefix/plen is split by when
+ * replying to a request for it; zero if the node states within it fit
+ * in a single multicast sized datagram (or it cannot be split). */
+static int _range_split_bits(dncp_ep_i l, dncp_node_id prefix, int plen)
+{
+  dncp o = l->dncp;
+  int ns_len = TLV_SIZE + DNCP_NI_LEN(o) + sizeof(dncp_t_node_state_s)
+    + DNCP_HASH_LEN(o);
+  int bits = DNCP_NI_LEN(o) * 8 - plen;
+  dncp_node n;
+
+  if (!bits
+      || _range_count(o, prefix, plen, &n) * ns_len
+      <= l->conf.maximum_multicast_size)
+    return 0;
+  return bits > NET_STATE_RANGE_SPLIT_BITS ? NET_STATE_RANGE_SPLIT_BITS : bits;
+}
+
+static void _range_child(dncp_node_id child, dncp_node_id prefix, int plen,
+                         int bits, int i)
+{
+  int j, b;
+
+  *child = *prefix;
+  for (j = 0 ; j < bits ; j++)
+    {
+      b = plen + j;
+      if (i & (1 << (bits - 1 - j)))
+        child->buf[b / 8] |= 0x80 >> (b % 8);
+      else
+        child->buf[b / 8] &= ~(0x80 >> (b % 8));
+    }
+}
+
+/* Hash of the range prefix/plen as given by the peer in msg, if any. */
+static void *_range_hint(dncp o, struct tlv_attr *msg,
+                         dncp_node_id prefix, int plen)
+{
+  int hlen = DNCP_HASH_LEN(o);
+  dncp_node_id_s p;
+  struct tlv_attr *a;
+  int pl;
+
+  if (!msg)
+    return NULL;
+  tlv_for_each_attr(a, msg)
+    if (tlv_id(a) == DNCP_T_NET_STATE_RANGE && (int)tlv_len(a) >= hlen
+        && _parse_range(o, tlv_data(a) + hlen, tlv_len(a) - hlen, &p, &pl)
+        && pl == plen && !memcmp(&p, prefix, DNCP_NI_LEN(o)))
+      return tlv_data(a);
+  return NULL;
+}
+
 /****************************************** Actual payload sending utilities */
 
+/* The network state and node state TLVs of the current network hash
+ * generation; shared by all network state messages. */
+static struct tlv_attr *_network_state_body(dncp o)
+{
+  struct tlv_buf *tb = &o->network_state_body;
+  hnetd_time_t now = dncp_time(o);
+  dncp_node n;
+
+  dncp_calculate_network_hash(o);
+  if (o->network_state_body_valid
+      && o->network_state_body_generation == o->network_hash_generation
+      && o->network_state_body_time == now)
+    return tb->head;
+
+  /* Queued messages refer to the current body. */
+  dncp_flush_sends(o);
+  o->network_state_body_valid = false;
+  if (tlv_buf_init(tb, 0) || !_push_network_state_tlv(tb, o))
+    return NULL;
+  o->network_state_body_short_len = tlv_len(tb->head);
+  dncp_for_each_node(o, n)
+    if (!_push_node_state_tlv(tb, n, false))
+      return NULL;
+  o->network_state_body_generation = o->network_hash_generation;
+  o->network_state_body_time = now;
+  o->network_state_body_valid = true;
+  return tb->head;
+}
+
+void dncp_flush_sends(dncp o)
+{
+  dncp_ext_send_s msgs[DNCP_SEND_BATCH];
+  int i, n = o->num_pending_sends;
+  void *body = o->network_state_body.head ?
+    tlv_data(o->network_state_body.head) : NULL;
+
+  if (!n)
+    return;
+  o->num_pending_sends = 0;
+  for (i = 0 ; i < n ; i++)
+    {
+      dncp_pending_send p = &o->pending_sends[i];
+      dncp_ext_send m = &msgs[i];
+
+      m->ep = &p->l->conf;
+      m->src = p->has_src ? &p->src : NULL;
+      m->dst = p->has_dst ? &p->dst : NULL;
+      m->iov[0].iov_base = p->prefix;
+      m->iov[0].iov_len = p->prefix_len;
+      m->iov[1].iov_base = body;
+      m->iov[1].iov_len = p->body_len;
+      m->iov_len = 2;
+    }
+  if (o->ext->cb.send_batch)
+    {
+      o->ext->cb.send_batch(o->ext, msgs, n);
+      return;
+    }
+  for (i = 0 ; i < n ; i++)
+    {
+      dncp_ext_send m = &msgs[i];
+      size_t len = m->iov[0].iov_len + m->iov[1].iov_len;
+      unsigned char *buf = malloc(len);
+
+      if (!buf)
+        continue;
+      memcpy(buf, m->iov[0].iov_base, m->iov[0].iov_len);
+      memcpy(buf + m->iov[0].iov_len, m->iov[1].iov_base, m->iov[1].iov_len);
+      o->ext->cb.send(o->ext, m->ep, m->src, m->dst, buf, len);
+      free(buf);
+    }
+}
+
 void dncp_ep_i_send_network_state(dncp_ep_i l,
                                   struct sockaddr_in6 *src,
                                   struct sockaddr_in6 *dst,
                                   size_t maximum_size,
                                   bool always_ep_id)
 {
-  struct tlv_buf tb;
   dncp o = l->dncp;
-  dncp_node n;
+  struct tlv_attr *body = _network_state_body(o);
+  dncp_pending_send p;
+  int body_len;
 
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
-  if (!_push_ep_id_tlv(&tb, l, dst, always_ep_id))
-    goto done;
-  if (!_push_network_state_tlv(&tb, o))
-    goto done;
+  if (!body)
+    return;
+  if (o->num_pending_sends == DNCP_SEND_BATCH)
+    dncp_flush_sends(o);
+  p = &o->pending_sends[o->num_pending_sends];
+  p->prefix_len = 0;
+  if (!dncp_ep_i_unicast_stream(l) || !dst || always_ep_id)
+    {
+      struct tlv_attr *a = (struct tlv_attr *)p->prefix;
 
-  /* We multicast only 'stable' state. Unicast, we give everything we have. */
-  if (!o->graph_dirty || !maximum_size)
-    {
-      int nn = 0;
-      int nilen = DNCP_NI_LEN(o);
-      int hlen = DNCP_HASH_LEN(o);
-      int ns_len = sizeof(dncp_t_node_state_s) + nilen + hlen;
-
-      if (maximum_size)
-        dncp_for_each_node(o, n)
-          nn++;
-      if (!maximum_size
-          || maximum_size >= (tlv_len(tb.head)
-                              + nn * (4 + ns_len)))
-        {
-          dncp_for_each_node(o, n)
-            {
-              if (!_push_node_state_tlv(&tb, n, false))
-                goto done;
-            }
-        }
+      tlv_init(a, DNCP_T_ENDPOINT_ID, sizeof(*a) + DNCP_NI_LEN(o)
+               + sizeof(dncp_t_ep_id_s));
+      _fill_ep_id_tlv(a, l);
+      tlv_fill_pad(a);
+      p->prefix_len = tlv_pad_len(a);
     }
-  if (maximum_size && tlv_len(tb.head) > maximum_size)
+
+  /* We multicast only 'stable' state. Unicast, we give everything we have. */
+  body_len = o->network_state_body_short_len;
+  if ((!o->graph_dirty || !maximum_size)
+      && (!maximum_size
+          || maximum_size >= (size_t)p->prefix_len + tlv_len(body)))
+    body_len = tlv_len(body);
+  if (maximum_size && (size_t)(p->prefix_len + body_len) > maximum_size)
     {
       L_ERR("dncp_ep_i_send_network_state failed: %d > %d",
-            (int)tlv_len(tb.head), (int)maximum_size);
-      goto done;
+            p->prefix_len + body_len, (int)maximum_size);
+      return;
     }
   L_DEBUG("dncp_ep_i_send_network_state -> " SA6_F "%%" DNCP_LINK_F,
           SA6_D(dst), DNCP_LINK_D(l));
-  o->ext->cb.send(o->ext, &l->conf, src, dst,
-                  tlv_data(tb.head), tlv_len(tb.head));
- done:
-  tlv_buf_free(&tb);
+  p->l = l;
+  p->has_src = src != NULL;
+  if (src)
+    p->src = *src;
+  p->has_dst = dst != NULL;
+  if (dst)
+    p->dst = *dst;
+  p->body_len = body_len;
+  o->num_pending_sends++;
+  if (!o->queue_sends)
+    dncp_flush_sends(o);
 }
 
-void dncp_ep_i_send_node_state(dncp_ep_i l,
-                               struct sockaddr_in6 *src,
-                               struct sockaddr_in6 *dst,
-                               dncp_node n)
-{
+/*
+ * Node state requests and replies generated while handling a single
+ * received message are gathered in a batch per peer, and sent as few
+ * datagrams of at most maximum_unicast_size bytes as possible.
+ */
+
+typedef struct {
+  dncp_ep_i l;
+  struct sockaddr_in6 *src;
+  struct sockaddr_in6 *dst;
   struct tlv_buf tb;
-  dncp o = l->dncp;
+  int count;
+  const char *what;
+} dncp_batch_s, *dncp_batch;
 
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
-  if (_push_ep_id_tlv(&tb, l, dst, false)
-      && _push_node_state_tlv(&tb, n, true))
+static void _batch_init(dncp_batch b, dncp_ep_i l,
+                        struct sockaddr_in6 *src,
+                        struct sockaddr_in6 *dst,
+                        const char *what)
+{
+  memset(b, 0, sizeof(*b));
+  b->l = l;
+  b->src = src;
+  b->dst = dst;
+  b->what = what;
+}
+
+static void _batch_flush(dncp_batch b)
+{
+  dncp o = b->l->dncp;
+
+  if (!b->tb.head)
+    return;
+  if (b->count)
     {
-      L_DEBUG("dncp_ep_i_send_node_data %s -> " SA6_F " %%" DNCP_LINK_F,
-              DNCP_NODE_REPR(n), SA6_D(dst), DNCP_LINK_D(l));
-      o->ext->cb.send(o->ext, &l->conf, src, dst,
-                      tlv_data(tb.head), tlv_len(tb.head));
+      L_DEBUG("sending %d %s -> " SA6_F "%%" DNCP_LINK_F,
+              b->count, b->what, SA6_D(b->dst), DNCP_LINK_D(b->l));
+      o->ext->cb.send(o->ext, &b->l->conf, b->src, b->dst,
+                      tlv_data(b->tb.head), tlv_len(b->tb.head));
     }
-  tlv_buf_free(&tb);
+  tlv_buf_free(&b->tb);
+  memset(&b->tb, 0, sizeof(b->tb));
+  b->count = 0;
 }
 
-void dncp_ep_i_send_req_network_state(dncp_ep_i l,
-                                      struct sockaddr_in6 *src,
-                                      struct sockaddr_in6 *dst)
+/* Make sure there is room for a TLV of tlen bytes (payload) in the
+ * batch, flushing the already batched TLVs if necessary. */
+static bool _batch_reserve(dncp_batch b, int tlen)
 {
-  struct tlv_buf tb;
-  dncp o = l->dncp;
+  ssize_t max = b->l->conf.maximum_unicast_size;
 
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
-  if (_push_ep_id_tlv(&tb, l, dst, false)
-      && _push_network_state_tlv(&tb, l->dncp) /* SHOULD include local */
-      && tlv_new(&tb, DNCP_T_REQ_NET_STATE, 0))
+  if (b->tb.head && max
+      && (ssize_t)(tlv_len(b->tb.head) + TLV_SIZE + ROUND_BYTES_TO_4BYTES(tlen))
+      > max)
+    _batch_flush(b);
+  if (!b->tb.head)
     {
-      L_DEBUG("dncp_ep_i_send_req_network_state -> " SA6_F "%%" DNCP_LINK_F,
-              SA6_D(dst), DNCP_LINK_D(l));
-      o->ext->cb.send(o->ext, &l->conf, src, dst,
-                      tlv_data(tb.head), tlv_len(tb.head));
+      tlv_buf_init(&b->tb, 0); /* not passed anywhere */
+      if (!_push_ep_id_tlv(&b->tb, b->l, b->dst, false))
+        {
+          tlv_buf_free(&b->tb);
+          memset(&b->tb, 0, sizeof(b->tb));
+          return false;
+        }
     }
-  tlv_buf_free(&tb);
+  b->count++;
+  return true;
 }
 
-void dncp_ep_i_send_req_node_data(dncp_ep_i l,
-                                  struct sockaddr_in6 *src,
-                                  struct sockaddr_in6 *dst,
-                                  dncp_t_node_state ns)
+static void _batch_push_node_state(dncp_batch b, dncp_node n)
 {
-  struct tlv_buf tb;
+  int nilen = DNCP_NI_LEN(n->dncp);
+  int hlen = DNCP_HASH_LEN(n->dncp);
+  int tlen = nilen + sizeof(dncp_t_node_state_s) + hlen
+    + (n->tlv_container ? tlv_len(n->tlv_container) : 0);
+
+  L_DEBUG("batching node data %s -> " SA6_F,
+          DNCP_NODE_REPR(n), SA6_D(b->dst));
+  if (_batch_reserve(b, tlen))
+    _push_node_state_tlv_cached(&b->tb, n);
+}
+
+/* Push the node data delta of n (which must be present). Returns
+ * false if it could not be batched. */
+static bool _batch_push_node_delta(dncp_batch b, dncp_node n)
+{
+  int nilen = DNCP_NI_LEN(n->dncp);
+  int hlen = DNCP_HASH_LEN(n->dncp);
+  int tlen = nilen + sizeof(dncp_t_node_delta_s) + hlen + n->node_delta_len;
+  struct tlv_attr *a;
+  dncp_t_node_delta d;
+  void *p;
+
+  L_DEBUG("batching node data delta %s (%d -> %d) -> " SA6_F,
+          DNCP_NODE_REPR(n), (int)n->node_delta_base,
+          (int)n->update_number, SA6_D(b->dst));
+  dncp_calculate_node_data_hash(n);
+  if (!_batch_reserve(b, tlen)
+      || !(a = tlv_new(&b->tb, DNCP_T_NODE_DELTA, tlen)))
+    return false;
+  p = tlv_data(a);
+  memcpy(p, &n->node_id, nilen);
+  p += nilen;
+  d = p;
+  d->update_number = cpu_to_be32(n->update_number);
+  d->ms_since_origination =
+    cpu_to_be32(dncp_time(n->dncp) - n->origination_time);
+  d->base_update_number = cpu_to_be32(n->node_delta_base);
+  d->removed_length = cpu_to_be32(n->node_delta_removed_len);
+  p += sizeof(*d);
+  memcpy(p, &n->node_data_hash, hlen);
+  p += hlen;
+  memcpy(p, n->node_delta, n->node_delta_len);
+  return true;
+}
+
+/* Request node data of ni. If we have some version of it already (n),
+ * and deltas are enabled, the delta against it is requested first;
+ * peers that do not know (or do not want to send) the delta ignore
+ * the delta request, and reply to the full request instead. */
+static void _batch_push_req_node_data(dncp_batch b, dncp_node_id ni,
+                                      dncp_node n)
+{
+  dncp o = b->l->dncp;
+  int nilen = DNCP_NI_LEN(o);
+  int dlen = nilen + sizeof(dncp_t_req_node_delta_s);
+  bool delta = b->l->conf.node_data_delta && n && n->tlv_container
+    && !dncp_node_is_self(n);
   struct tlv_attr *a;
+
+  /* Both have to end up in the same message. */
+  if (!_batch_reserve(b, nilen + (delta ? TLV_SIZE + dlen : 0)))
+    return;
+  if (delta && (a = tlv_new(&b->tb, DNCP_T_REQ_NODE_DELTA, dlen)))
+    {
+      dncp_t_req_node_delta rd = tlv_data(a) + nilen;
+
+      memcpy(tlv_data(a), ni, nilen);
+      rd->base_update_number = cpu_to_be32(n->update_number);
+    }
+  if ((a = tlv_new(&b->tb, DNCP_T_REQ_NODE_STATE, nilen)))
+    memcpy(tlv_data(a), ni, nilen);
+}
+
+/* Request the range prefix/plen. If the peer is going to split it,
+ * our hashes of the subranges are included, so that it can skip the
+ * ones we already have and reply to the rest directly instead of
+ * costing another round trip. */
+static bool _batch_push_req_range(dncp_batch b, dncp_node_id prefix, int plen)
+{
+  dncp o = b->l->dncp;
+  int rlen = sizeof(dncp_t_net_state_range_s);
+  int bits = _range_split_bits(b->l, prefix, plen);
+  int len = rlen + ROUND_BITS_TO_BYTES(plen);
+  dncp_node_id_s child;
+  int i;
+
+  /* Both have to end up in the same message. */
+  if (bits)
+    len += (1 << bits) * (TLV_SIZE + ROUND_BYTES_TO_4BYTES(
+      DNCP_HASH_LEN(o) + rlen + ROUND_BITS_TO_BYTES(plen + bits)));
+  if (!_batch_reserve(b, len)
+      || !_push_range_tlv(&b->tb, o, DNCP_T_REQ_NET_STATE_RANGE, prefix, plen))
+    return false;
+  for (i = 0 ; bits && i < (1 << bits) ; i++)
+    {
+      _range_child(&child, prefix, plen, bits, i);
+      if (!_push_range_tlv(&b->tb, o, DNCP_T_NET_STATE_RANGE,
+                           &child, plen + bits))
+        return false;
+    }
+  return true;
+}
+
+/* Reply to a request for the range prefix/plen with the node states
+ * within it, or if they do not fit in a multicast sized datagram, with
+ * the hashes of its subranges. Subranges the peer included its hash
+ * of in msg are skipped if it matches, and replied to in turn if not. */
+static void _batch_push_range_reply(dncp_batch b, struct tlv_attr *msg,
+                                    dncp_node_id prefix, int plen)
+{
+  dncp o = b->l->dncp;
+  int hlen = DNCP_HASH_LEN(o);
+  int rlen = sizeof(dncp_t_net_state_range_s);
+  int bits = _range_split_bits(b->l, prefix, plen);
+  dncp_node_id_s child;
+  dncp_hash_s h;
+  dncp_node n;
+  void *hint;
+  int i, c;
+
+  if (!bits)
+    {
+      c = _range_count(o, prefix, plen, &n);
+      for ( ; c-- > 0 ; n = dncp_node_get_next(n))
+        if (_batch_reserve(b, DNCP_NI_LEN(o) + sizeof(dncp_t_node_state_s)
+                           + hlen))
+          _push_node_state_tlv(&b->tb, n, false);
+      return;
+    }
+  for (i = 0 ; i < (1 << bits) ; i++)
+    {
+      _range_child(&child, prefix, plen, bits, i);
+      if ((hint = _range_hint(o, msg, &child, plen + bits)))
+        {
+          _range_hash(o, &child, plen + bits, &h);
+          if (memcmp(&h, hint, hlen))
+            _batch_push_range_reply(b, NULL, &child, plen + bits);
+          continue;
+        }
+      if (_batch_reserve(b, hlen + rlen + ROUND_BITS_TO_BYTES(plen + bits)))
+        _push_range_tlv(&b->tb, o, DNCP_T_NET_STATE_RANGE,
+                        &child, plen + bits);
+    }
+}
+
+/* Should we request bulk state instead of the network state: if we
+ * have not been in sync with anyone yet (our node data may be from a
+ * snapshot), or know just ourselves. */
+static bool _want_bulk(dncp_ep_i l)
+{
+  dncp o = l->dncp;
+
+  if (!l->conf.bulk_initial_sync)
+    return false;
+  if (!o->network_state_synced)
+    return true;
+  dncp_calculate_network_hash(o);
+  return o->network_hash_buf_count <= 1;
+}
+
+void dncp_ep_i_send_req_network_state(dncp_ep_i l,
+                                      struct sockaddr_in6 *src,
+                                      struct sockaddr_in6 *dst)
+{
+  dncp_batch_s b;
   dncp o = l->dncp;
+  dncp_node_id_s root;
+  bool bulk = _want_bulk(l);
 
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
-  if (_push_ep_id_tlv(&tb, l, dst, false)
-      && (a = tlv_new(&tb, DNCP_T_REQ_NODE_STATE, DNCP_NI_LEN(o))))
+  memset(&root, 0, sizeof(root));
+  _batch_init(&b, l, src, dst, "network state requests");
+  if (_batch_reserve(&b, DNCP_HASH_LEN(o))
+      && _push_network_state_tlv(&b.tb, o) /* SHOULD include local */
+      && tlv_new(&b.tb, DNCP_T_REQ_NET_STATE, 0)
+      && (!bulk || tlv_new(&b.tb, DNCP_T_REQ_BULK_STATE, 0))
+      && (!l->conf.hierarchical_network_state || bulk
+          || _batch_push_req_range(&b, &root, 0)))
     {
-      L_DEBUG("dncp_ep_i_send_req_node_data -> " SA6_F "%%" DNCP_LINK_F,
+      L_DEBUG("dncp_ep_i_send_req_network_state -> " SA6_F "%%" DNCP_LINK_F,
               SA6_D(dst), DNCP_LINK_D(l));
-      dncp_node_id ni = dncp_tlv_get_node_id(l->dncp, ns);
-      memcpy(tlv_data(a), ni, DNCP_NI_LEN(o));
-      o->ext->cb.send(o->ext, &l->conf, src, dst,
-                      tlv_data(tb.head), tlv_len(tb.head));
+      _batch_flush(&b);
     }
-  tlv_buf_free(&tb);
+  tlv_buf_free(&b.tb);
 }
 
-/************************************************************ Input handling */
-
-static dncp_tlv
-_find_local_tlv_by_remote(dncp o, struct sockaddr_in6 *remote)
+/* Handle range TLVs within an unicast message: reply to range
+ * requests, and request ranges whose hashes do not match ours. */
+static void _handle_ranges(dncp_ep_i l, struct tlv_attr *msg,
+                           dncp_batch reply_batch, dncp_batch req_batch,
+                           bool *replied, bool *requested)
 {
-  dncp_tlv t;
-  dncp_t_neighbor ne;
+  dncp o = l->dncp;
+  int hlen = DNCP_HASH_LEN(o);
+  bool hints = false;
+  struct tlv_attr *a;
+  dncp_node_id_s prefix;
+  dncp_hash_s h;
+  int plen;
 
-  dncp_for_each_tlv(o, t)
-    if ((ne = dncp_tlv_neighbor(o, &t->tlv)))
+  tlv_for_each_attr(a, msg)
+    if (tlv_id(a) == DNCP_T_REQ_NET_STATE_RANGE)
+      hints = true;
+  tlv_for_each_attr(a, msg)
+    switch (tlv_id(a))
       {
-        dncp_neighbor n = dncp_tlv_get_extra(t);
-        if (memcmp(&n->last_sa6, remote, sizeof(*remote)) == 0)
-          return t;
+      case DNCP_T_REQ_NET_STATE_RANGE:
+        if (!_parse_range(o, tlv_data(a), tlv_len(a), &prefix, &plen))
+          {
+            L_DEBUG("invalid req-net-state-range");
+            break;
+          }
+        if (!*replied && _batch_reserve(reply_batch, hlen))
+          _push_network_state_tlv(&reply_batch->tb, o);
+        *replied = true;
+        _batch_push_range_reply(reply_batch, msg, &prefix, plen);
+        break;
+
+      case DNCP_T_NET_STATE_RANGE:
+        /* Alongside requests, these are the subranges of the request. */
+        if (hints)
+          break;
+        if ((int)tlv_len(a) < hlen
+            || !_parse_range(o, tlv_data(a) + hlen, tlv_len(a) - hlen,
+                             &prefix, &plen))
+          {
+            L_DEBUG("invalid net-state-range");
+            break;
+          }
+        _range_hash(o, &prefix, plen, &h);
+        if (memcmp(&h, tlv_data(a), hlen)
+            && _batch_push_req_range(req_batch, &prefix, plen))
+          *requested = true;
+        break;
       }
-  return NULL;
 }
 
-static dncp_tlv
+/************************************************************ Input handling */
+
+static dncp_neighbor
 _heard(dncp_ep_i l, dncp_t_ep_id lid, struct sockaddr_in6 *src,
        bool multicast)
 {
-  int nplen = sizeof(dncp_t_neighbor_s) + DNCP_NI_LEN(l->dncp);
-  void *np = alloca(nplen);
-  dncp_t_neighbor n_sample = np + DNCP_NI_LEN(l->dncp);
-  memcpy(np, dncp_tlv_get_node_id(l->dncp, lid), DNCP_NI_LEN(l->dncp));
-  n_sample->neighbor_ep_id = lid->ep_id;
-  n_sample->ep_id = l->ep_id;
+  dncp_node_id ni = dncp_tlv_get_node_id(l->dncp, lid);
+  dncp_neighbor n = dncp_find_neighbor(l->dncp, ni, lid->ep_id, l->ep_id);
 
-  dncp_neighbor n;
-  dncp_tlv t = dncp_find_tlv(l->dncp, DNCP_T_NEIGHBOR, np, nplen);
-  if (!t)
+  if (!n)
     {
       /* Doing add based on multicast is relatively insecure. */
       if (multicast)
         return NULL;
-      t = dncp_add_tlv(l->dncp, DNCP_T_NEIGHBOR, np, nplen, sizeof(*n));
+      int nplen = sizeof(dncp_t_neighbor_s) + DNCP_NI_LEN(l->dncp);
+      void *np = alloca(nplen);
+      dncp_t_neighbor n_sample = np + DNCP_NI_LEN(l->dncp);
+      memcpy(np, ni, DNCP_NI_LEN(l->dncp));
+      n_sample->neighbor_ep_id = lid->ep_id;
+      n_sample->ep_id = l->ep_id;
+      dncp_tlv t = dncp_add_tlv(l->dncp, DNCP_T_NEIGHBOR, np, nplen,
+                                sizeof(*n));
       if (!t)
         return NULL;
       n = dncp_tlv_get_extra(t);
       n->last_contact = dncp_time(l->dncp);
       L_DEBUG("Neighbor %s added on " DNCP_LINK_F,
-              DNCP_NI_REPR(l->dncp, dncp_tlv_get_node_id(l->dncp, lid)),
-              DNCP_LINK_D(l));
+              DNCP_NI_REPR(l->dncp, ni), DNCP_LINK_D(l));
     }
-  else
-    n = dncp_tlv_get_extra(t);
 
   if (!multicast)
+    dncp_neighbor_set_sa6(l->dncp, n, src);
+  return n;
+}
+
+/* Reply to a bulk state request within an unicast message (if any)
+ * with the node states, including node data, of all reachable
+ * nodes. ne is the neighbor the message is from, if known. */
+static bool _handle_bulk(dncp_ep_i l, dncp_neighbor ne,
+                         struct tlv_attr *msg, dncp_batch b)
+{
+  dncp o = l->dncp;
+  int nilen = DNCP_NI_LEN(o);
+  struct tlv_attr *a;
+  dncp_t_ep_id lid;
+  dncp_node n;
+  bool requested = false;
+
+  tlv_for_each_attr(a, msg)
+    switch (tlv_id(a))
+      {
+      case DNCP_T_REQ_BULK_STATE:
+        requested = true;
+        break;
+      case DNCP_T_ENDPOINT_ID:
+        if (!ne && tlv_len(a) == sizeof(*lid) + nilen)
+          {
+            lid = tlv_data(a) + nilen;
+            ne = dncp_find_neighbor(o, tlv_data(a), lid->ep_id, l->ep_id);
+          }
+        break;
+      }
+  if (!requested)
+    return false;
+  /* Reachability is not known; let the network state do. */
+  if (o->graph_dirty)
+    {
+      L_DEBUG("prune pending, ignoring bulk state request");
+      return false;
+    }
+  /* Caller records the time once the neighbor is known for sure. */
+  if (ne && ne->last_bulk_state_sent
+      && (dncp_time(o) - ne->last_bulk_state_sent)
+      < DNCP_BULK_STATE_MIN_INTERVAL)
     {
-      n->last_sa6 = *src;
+      L_DEBUG("bulk state sent recently, ignoring bulk state request");
+      return false;
     }
-  return t;
+  dncp_self_flush(o->own_node);
+  dncp_for_each_node(o, n)
+    if (n->last_reachable_prune == o->last_prune)
+      _batch_push_node_state(b, n);
+  o->num_bulk_state_sent++;
+  return true;
+}
+
+/* Find the node whose state is requested, if we are willing to tell
+ * about it. */
+static dncp_node _requested_node(dncp o, dncp_node_id ni)
+{
+  dncp_node n = dncp_find_node_by_node_id(o, ni, false);
+
+  if (!n)
+    {
+      L_DEBUG("got request for node for which we have no data");
+      return NULL;
+    }
+  if (n != o->own_node)
+    {
+      if (o->graph_dirty)
+        {
+          L_DEBUG("prune pending, ignoring node data request");
+          return NULL;
+        }
+
+      if (n->last_reachable_prune != o->last_prune)
+        {
+          L_DEBUG("not reachable request, ignoring");
+          return NULL;
+        }
+    }
+  else
+    dncp_self_flush(o->own_node);
+  return n;
+}
+
+/* Return a, if a TLV fits in entirety before end. */
+static struct tlv_attr *_tlv_within(struct tlv_attr *a, void *end)
+{
+  if ((void *)a + TLV_SIZE > end
+      || tlv_raw_len(a) < TLV_SIZE
+      || (void *)a + tlv_pad_len(a) > end)
+    return NULL;
+  return a;
+}
+
+/* Apply node data delta (sorted removed and added TLVs) to the node
+ * data of n. The new node data is returned within a new buffer (rb),
+ * or NULL, if the delta does not apply. */
+static struct tlv_attr *_node_delta_apply(dncp_node n,
+                                          void *removed, int removed_len,
+                                          void *added, int added_len,
+                                          dncp_rbuf *rb)
+{
+  struct tlv_attr *nd, *op;
+  struct tlv_attr *rp = _tlv_within(removed, removed + removed_len);
+  struct tlv_attr *ap = _tlv_within(added, added + added_len);
+  void *p;
+
+  if (!(*rb = dncp_rbuf_alloc(n->dncp, TLV_SIZE
+                              + tlv_len(n->tlv_container) + added_len)))
+    return NULL;
+  nd = (void *)(*rb)->buf;
+  p = tlv_data(nd);
+  tlv_for_each_attr(op, n->tlv_container)
+    {
+      if (rp && !tlv_attr_cmp(op, rp))
+        {
+          rp = _tlv_within(tlv_next(rp), removed + removed_len);
+          continue;
+        }
+      for (; ap && tlv_attr_cmp(ap, op) < 0 ;
+           ap = _tlv_within(tlv_next(ap), added + added_len))
+        {
+          memcpy(p, ap, tlv_pad_len(ap));
+          p += tlv_pad_len(ap);
+        }
+      memcpy(p, op, tlv_pad_len(op));
+      p += tlv_pad_len(op);
+    }
+  for (; ap ; ap = _tlv_within(tlv_next(ap), added + added_len))
+    {
+      memcpy(p, ap, tlv_pad_len(ap));
+      p += tlv_pad_len(ap);
+    }
+  if (rp)
+    {
+      L_DEBUG("removed TLV missing from node data");
+      dncp_rbuf_unref(n->dncp, *rb);
+      return NULL;
+    }
+  tlv_init(nd, 0, p - (void *)nd);
+  return nd;
 }
 
 /* Handle a single received message. */
@@ -272,7 +897,7 @@ handle_message(dncp_ep_i l,
   dncp_t_ep_id lid = NULL;
   bool seen_lid = false;
   dncp_neighbor ne = NULL;
-  struct tlv_buf tb;
+  dncp_rbuf rb = NULL;
   uint32_t new_update_number;
   bool should_request_network_state = false;
   bool updated_or_requested_state = false;
@@ -282,27 +907,38 @@ handle_message(dncp_ep_i l,
   dncp_node_id ni;
   char fake_lid[DNCP_NI_MAX_LEN + sizeof(*lid)];
   bool is_local = false;
+  bool range_replied = false;
+  bool bulk_replied = false;
+  dncp_node delta_sent = NULL;
+  dncp_batch_s reply_batch, req_batch;
 
   /* Validate that link id exists (if this were TCP, we would keep
    * track of the remote link id on per-stream basis). */
-  if (dst && l->conf.unicast_is_reliable_stream)
+  if (dst && dncp_ep_i_unicast_stream(l))
     {
       /* If and only if this is unicast traffic, and from stream, we
        * may reuse old info. */
       void *buf = fake_lid;
-      dncp_tlv t = _find_local_tlv_by_remote(o, src);
-      dncp_t_neighbor t_ne;
-      if (t && (t_ne = dncp_tlv_neighbor(o, &t->tlv)))
+      dncp_neighbor n_src = dncp_find_neighbor_by_sa6(o, src);
+      if (n_src)
         {
+          dncp_t_neighbor t_ne = dncp_neighbor_get_t(o, n_src);
           memcpy(buf, dncp_tlv_get_node_id(o, t_ne), nilen);
           lid = buf + nilen;
           lid->ep_id = t_ne->neighbor_ep_id;
 
-          dncp_tlv tne = _heard(l, lid, src, multicast);
-          ne = tne ? dncp_tlv_get_extra(tne) : NULL;
+          ne = _heard(l, lid, src, multicast);
         }
     }
 
+  _batch_init(&reply_batch, l, dst, src, "node states");
+  _batch_init(&req_batch, l, dst, src, "node state requests");
+  if (!multicast && l->conf.bulk_initial_sync)
+    bulk_replied = _handle_bulk(l, ne, msg, &reply_batch);
+  if (!multicast && l->conf.hierarchical_network_state && !bulk_replied)
+    _handle_ranges(l, msg, &reply_batch, &req_batch,
+                   &range_replied, &updated_or_requested_state);
+
   tlv_for_each_attr(a, msg)
   {
     L_DEBUG("handling tlv #%d", tlv_id(a));
@@ -318,7 +954,7 @@ handle_message(dncp_ep_i l,
         if (tlv_len(a) != sizeof(*lid) + nilen)
           {
             L_INFO("got invalid sized link id - ignoring");
-            return;
+            goto done;
           }
         lid = tlv_data(a) + nilen;
         is_local = memcmp(dncp_tlv_get_node_id(l->dncp, lid),
@@ -326,8 +962,7 @@ handle_message(dncp_ep_i l,
                           nilen) == 0;
         if (!is_local)
           {
-            dncp_tlv tne = _heard(l, lid, src, multicast);
-            ne = tne ? dncp_tlv_get_extra(tne) : NULL;
+            ne = _heard(l, lid, src, multicast);
 
             if (ne)
               {
@@ -346,6 +981,10 @@ handle_message(dncp_ep_i l,
         /* Ignore if in multicast. */
         if (multicast)
           L_INFO("ignoring req-net-hash in multicast");
+        else if (range_replied)
+          L_DEBUG("req-net-hash covered by req-net-state-range");
+        else if (bulk_replied)
+          L_DEBUG("req-net-hash covered by req-bulk-state");
         else
           dncp_ep_i_send_network_state(l, dst, src, 0, false);
         break;
@@ -363,30 +1002,43 @@ handle_message(dncp_ep_i l,
                     tlv_len(a));
             break;
           }
-        ni = tlv_data(a);
-        n = dncp_find_node_by_node_id(o, ni, false);
-        if (!n)
+        if (!(n = _requested_node(o, tlv_data(a))))
+          break;
+        if (n == delta_sent)
           {
-            L_DEBUG("got request for node for which we have no data");
+            L_DEBUG("node data delta sent instead");
+            delta_sent = NULL;
             break;
           }
-        if (n != o->own_node)
-          {
-            if (o->graph_dirty)
-              {
-                L_DEBUG("prune pending, ignoring node data request");
-                break;
-              }
+        _batch_push_node_state(&reply_batch, n);
+        break;
 
-            if (n->last_reachable_prune != o->last_prune)
-              {
-                L_DEBUG("not reachable request, ignoring");
-                break;
-              }
+      case DNCP_T_REQ_NODE_DELTA:
+        /* Ignore if in multicast. */
+        if (multicast)
+          {
+            L_INFO("ignoring req-node-delta in multicast");
+            break;
           }
-        else
-          dncp_self_flush(o->own_node);
-        dncp_ep_i_send_node_state(l, dst, src, n);
+        if (tlv_len(a) != nilen + sizeof(dncp_t_req_node_delta_s))
+          {
+            L_DEBUG("got invalid length req-node-delta:%d", tlv_len(a));
+            break;
+          }
+        if (!(n = _requested_node(o, tlv_data(a))))
+          break;
+        dncp_t_req_node_delta rd = tlv_data(a) + nilen;
+        /* Otherwise, the full request that follows is answered. */
+        if (!n->node_delta
+            || n->node_delta_base != be32_to_cpu(rd->base_update_number))
+          {
+            L_DEBUG("no node data delta for %s from %d",
+                    DNCP_NODE_REPR(n), (int)be32_to_cpu(rd->base_update_number));
+            break;
+          }
+        /* If it could not be sent, the full node state is. */
+        if (_batch_push_node_delta(&reply_batch, n))
+          delta_sent = n;
         break;
 
       case DNCP_T_NET_STATE:
@@ -407,6 +1059,7 @@ handle_message(dncp_ep_i l,
             l->trickle.c++;
             if (ne)
               {
+                o->network_state_synced = true;
                 ne->trickle.c++;
                 ne->last_contact = dncp_time(l->dncp);
               }
@@ -461,7 +1114,7 @@ handle_message(dncp_ep_i l,
               }
             n = n ? n: dncp_find_node_by_node_id(o, ni, true);
             if (!n)
-              return; /* OOM */
+              goto done; /* OOM */
             if (dncp_node_is_self(n))
               {
                 L_DEBUG("received %d update number from network, own %d",
@@ -474,25 +1127,25 @@ handle_message(dncp_ep_i l,
                     o->republish_tlvs = true;
                     dncp_schedule(o);
                   }
-                return;
+                goto done;
               }
             /* Ok. nd contains more recent TLV data than what we have
-             * already. Woot. */
-            memset(&tb, 0, sizeof(tb));
-            tlv_buf_init(&tb, 0); /* not passed anywhere */
-            if (tlv_put_raw(&tb, nd_data, nd_len))
-              {
-                dncp_node_set(n, new_update_number,
-                              dncp_time(o) - be32_to_cpu(ns->ms_since_origination),
-                              tb.head);
-                memcpy(&n->node_data_hash, h, hlen);
-                n->node_data_hash_dirty = false;
-              }
-            else
-              {
-                L_DEBUG("tlv_put_raw failed");
-                tlv_buf_free(&tb);
-              }
+             * already. Woot. It is used in place within (copy of) the
+             * message; the TLV header of the container overwrites the
+             * end of the node state header within the copy. */
+            if (!rb && !(rb = dncp_rbuf_copy(o, msg)))
+              goto done; /* OOM */
+            struct tlv_attr *nd = (void *)rb->buf
+              + ((void *)nd_data - (void *)msg) - sizeof(struct tlv_attr);
+            tlv_init(nd, 0, nd_len + sizeof(struct tlv_attr));
+            memset((void *)nd + tlv_raw_len(nd), 0,
+                   tlv_pad_len(nd) - tlv_raw_len(nd));
+            rb->refcount++;
+            dncp_node_set_rbuf(n, new_update_number,
+                               dncp_time(o) - be32_to_cpu(ns->ms_since_origination),
+                               nd, rb);
+            memcpy(&n->node_data_hash, h, hlen);
+            n->node_data_hash_dirty = false;
             found_data = true;
           }
         if (!found_data)
@@ -500,8 +1153,76 @@ handle_message(dncp_ep_i l,
             L_DEBUG("node data %s for %s",
                     multicast ? "not acceptable/supplied" : "missing",
                     DNCP_NI_REPR(l->dncp, ni));
-            dncp_ep_i_send_req_node_data(l, dst, src, ns);
+            _batch_push_req_node_data(&req_batch, ni, n);
+          }
+        updated_or_requested_state = true;
+        break;
+
+      case DNCP_T_NODE_DELTA:
+        if (multicast)
+          {
+            L_INFO("ignoring node-delta in multicast");
+            break;
+          }
+        ni = tlv_data(a);
+        dncp_t_node_delta ndelta = tlv_data(a) + nilen;
+        int nd_hdr_len = nilen + sizeof(*ndelta) + hlen;
+        int removed_len = 0, added_len = -1;
+
+        if ((int)tlv_len(a) >= nd_hdr_len)
+          {
+            removed_len = be32_to_cpu(ndelta->removed_length);
+            added_len = tlv_len(a) - nd_hdr_len - removed_len;
+          }
+        if (removed_len < 0 || added_len < 0)
+          {
+            L_INFO("invalid length node delta TLV received - ignoring");
+            break;
+          }
+        n = dncp_find_node_by_node_id(o, ni, false);
+        new_update_number = be32_to_cpu(ndelta->update_number);
+        if (!n || dncp_node_is_self(n)
+            || !dncp_update_number_gt(n->update_number, new_update_number))
+          {
+            L_DEBUG("saw old node delta for %s", DNCP_NI_REPR(o, ni));
+            break;
+          }
+        dncp_hash dh = tlv_data(a) + nilen + sizeof(*ndelta);
+        void *removed = (void *)dh + hlen;
+        struct tlv_attr *data = NULL;
+        dncp_rbuf drb = NULL;
+        dncp_hash_s data_hash;
+
+        if (n->tlv_container
+            && n->update_number == be32_to_cpu(ndelta->base_update_number))
+          data = _node_delta_apply(n, removed, removed_len,
+                                   removed + removed_len, added_len, &drb);
+        if (data)
+          {
+            o->ext->cb.hash(tlv_data(data), tlv_len(data), &data_hash);
+            if (memcmp(&data_hash, dh, hlen))
+              {
+                L_INFO("broken hash after applying node delta");
+                dncp_rbuf_unref(o, drb);
+                data = NULL;
+              }
           }
+        if (!data)
+          {
+            /* Ask for all of it. */
+            _batch_push_req_node_data(&req_batch, ni, NULL);
+            updated_or_requested_state = true;
+            break;
+          }
+        L_DEBUG("applied node delta for %s (%d -> %d)",
+                DNCP_NODE_REPR(n), (int)n->update_number,
+                (int)new_update_number);
+        dncp_node_set_rbuf(n, new_update_number,
+                           dncp_time(o) - be32_to_cpu(ndelta->ms_since_origination),
+                           data, drb);
+        memcpy(&n->node_data_hash, dh, hlen);
+        n->node_data_hash_dirty = false;
+        o->num_node_delta_applied++;
         updated_or_requested_state = true;
         break;
 
@@ -514,84 +1235,134 @@ handle_message(dncp_ep_i l,
 
   /* Now, we can handle whether or not to send a network state request
    * based on the flags we know. */
-  if (!should_request_network_state || updated_or_requested_state || is_local)
-    return;
+  if (should_request_network_state && !updated_or_requested_state && !is_local)
+    {
+      l->last_req_network_state = dncp_time(o);
+      dncp_ep_i_send_req_network_state(l, dst, src);
+    }
 
-  l->last_req_network_state = dncp_time(o);
-  dncp_ep_i_send_req_network_state(l, dst, src);
+ done:
+  if (bulk_replied && ne)
+    ne->last_bulk_state_sent = dncp_time(o);
+  _batch_flush(&reply_batch);
+  _batch_flush(&req_batch);
+  if (rb)
+    dncp_rbuf_unref(o, rb);
 }
 
 
-void dncp_ext_readable(dncp o)
+static void _readable_msg(dncp o, dncp_ep ep,
+                          struct sockaddr_in6 *src,
+                          struct sockaddr_in6 *dst,
+                          int flags,
+                          struct tlv_attr *msg)
 {
-  unsigned char buf[DNCP_MAXIMUM_PAYLOAD_SIZE+sizeof(struct tlv_attr)];
-  struct tlv_attr *msg = (struct tlv_attr *)buf;
-  ssize_t read;
-  struct sockaddr_in6 *src;
-  struct sockaddr_in6 *dst;
   dncp_ep_i l;
-  dncp_ep ep;
   dncp_subscriber s;
-  int flags;
 
-  while ((read = o->ext->cb.recv(o->ext, &ep, &src, &dst, &flags,
-                                 msg->data, DNCP_MAXIMUM_PAYLOAD_SIZE)) > 0)
-    {
-      tlv_init(msg, 0, read + sizeof(struct tlv_attr));
+  l = container_of(ep, dncp_ep_i_s, conf);
 
-      l = container_of(ep, dncp_ep_i_s, conf);
+  /* This is raw */
+  list_for_each_entry(s, &o->subscribers[DNCP_CALLBACK_SOCKET_MSG],
+                      lhs[DNCP_CALLBACK_SOCKET_MSG])
+    s->msg_received_cb(s, ep, src, dst, flags, msg);
 
-      /* This is raw */
-      list_for_each_entry(s, &o->subscribers[DNCP_CALLBACK_SOCKET_MSG],
-                          lhs[DNCP_CALLBACK_SOCKET_MSG])
-        s->msg_received_cb(s, ep, src, dst, flags, msg);
-
-      if (!l->enabled)
-        {
-          L_DEBUG("ignoring packet on non-enabled interface %s",
-                  l->conf.ifname);
-          continue;
-        }
+  if (!l->enabled)
+    {
+      L_DEBUG("ignoring packet on non-enabled interface %s",
+              l->conf.ifname);
+      return;
+    }
 
-      if (dst
-          && !(flags & DNCP_RECV_FLAG_SRC_LINKLOCAL) !=
-          !(flags & DNCP_RECV_FLAG_DST_LINKLOCAL))
-        {
-          L_DEBUG("ignoring linklocal <> non-linklocal traffic");
-          continue;
-        }
+  if (dst
+      && !(flags & DNCP_RECV_FLAG_SRC_LINKLOCAL) !=
+      !(flags & DNCP_RECV_FLAG_DST_LINKLOCAL))
+    {
+      L_DEBUG("ignoring linklocal <> non-linklocal traffic");
+      return;
+    }
 
-      if (!(flags & DNCP_RECV_FLAG_SRC_LINKLOCAL))
+  if (!(flags & DNCP_RECV_FLAG_SRC_LINKLOCAL))
+    {
+      if (flags & DNCP_RECV_FLAG_SECURE)
         {
-          if (flags & DNCP_RECV_FLAG_SECURE)
+          if (!ep->accept_secure_nonlocal_traffic)
             {
-              if (!ep->accept_secure_nonlocal_traffic)
-                {
-                  L_DEBUG("ignoring secure non-local traffic from" SA6_F,
-                          SA6_D(src));
-                  continue;
-                }
+              L_DEBUG("ignoring secure non-local traffic from" SA6_F,
+                      SA6_D(src));
+              return;
             }
-          else
+        }
+      else
+        {
+          if (!ep->accept_insecure_nonlocal_traffic)
             {
-              if (!ep->accept_insecure_nonlocal_traffic)
-                {
-                  L_DEBUG("ignoring insecure non-local traffic from" SA6_F,
-                          SA6_D(src));
-                  continue;
-                }
+              L_DEBUG("ignoring insecure non-local traffic from" SA6_F,
+                      SA6_D(src));
+              return;
             }
         }
+    }
 
-      if (dst
-          && (flags & (DNCP_RECV_FLAG_SECURE | DNCP_RECV_FLAG_SECURE_TRIED))
-          == DNCP_RECV_FLAG_SECURE_TRIED)
-        {
-          L_DEBUG("ignoring insecure unicast from " SA6_F, SA6_D(src));
+  if (dst
+      && (flags & (DNCP_RECV_FLAG_SECURE | DNCP_RECV_FLAG_SECURE_TRIED))
+      == DNCP_RECV_FLAG_SECURE_TRIED)
+    {
+      L_DEBUG("ignoring insecure unicast from " SA6_F, SA6_D(src));
+      return;
+    }
+  handle_message(l, src, dst, msg);
+}
+
+/* Drain the received messages, DNCP_RECV_BATCH at a time. */
+static void _readable_batch(dncp o)
+{
+  dncp_ext_msg_s msgs[DNCP_RECV_BATCH];
+  size_t slot_size = DNCP_MAXIMUM_PAYLOAD_SIZE + sizeof(struct tlv_attr);
+  struct tlv_attr *msg;
+  int i, r;
+
+  /* The buffers are touched only as far as the messages reach, so
+   * allocating the maximum payload size for each is mostly free. */
+  if (!o->recv_bufs && !(o->recv_bufs = malloc(DNCP_RECV_BATCH * slot_size)))
+    return;
+  for (i = 0 ; i < DNCP_RECV_BATCH ; i++)
+    {
+      msgs[i].buf = o->recv_bufs + i * slot_size + sizeof(struct tlv_attr);
+      msgs[i].buf_len = DNCP_MAXIMUM_PAYLOAD_SIZE;
+    }
+  while ((r = o->ext->cb.recv_batch(o->ext, msgs, DNCP_RECV_BATCH)) >= 0)
+    for (i = 0 ; i < r ; i++)
+      {
+        if (msgs[i].len <= 0)
           continue;
-        }
-      handle_message(l, src, dst, msg);
+        msg = (struct tlv_attr *)msgs[i].buf - 1;
+        tlv_init(msg, 0, msgs[i].len + sizeof(struct tlv_attr));
+        _readable_msg(o, msgs[i].ep, msgs[i].src, msgs[i].dst,
+                      msgs[i].flags, msg);
+      }
+}
 
+void dncp_ext_readable(dncp o)
+{
+  unsigned char buf[DNCP_MAXIMUM_PAYLOAD_SIZE+sizeof(struct tlv_attr)];
+  struct tlv_attr *msg = (struct tlv_attr *)buf;
+  ssize_t read;
+  struct sockaddr_in6 *src;
+  struct sockaddr_in6 *dst;
+  dncp_ep ep;
+  int flags;
+
+  if (o->ext->cb.recv_batch)
+    {
+      _readable_batch(o);
+      return;
+    }
+  while ((read = o->ext->cb.recv(o->ext, &ep, &src, &dst, &flags,
+                                 msg->data, DNCP_MAXIMUM_PAYLOAD_SIZE)) > 0)
+    {
+      tlv_init(msg, 0, read + sizeof(struct tlv_attr));
+      _readable_msg(o, ep, src, dst, flags, msg);
     }
 }
 
@@ -608,12 +1379,8 @@ void dncp_ext_ep_peer_state(dncp_ep ep,
       dncp_ep_i_send_network_state(l, local, remote, 0, true);
       return;
     }
-  dncp_tlv t = _find_local_tlv_by_remote(o, remote);
-  dncp_t_neighbor ne;
-  if (t && (ne = dncp_tlv_neighbor(o, &t->tlv)))
-    {
-      dncp_neighbor n = dncp_tlv_get_extra(t);
-      n->last_contact = 0;
-    }
+  dncp_neighbor n = dncp_find_neighbor_by_sa6(o, remote);
+  if (n)
+    n->last_contact = 0;
   dncp_schedule(o);
 }
@@ -33,7 +33,18 @@ enum {
   DNCP_T_FRAGMENT_COUNT = 7, /* not implemented */
   DNCP_T_NEIGHBOR = 8,
   DNCP_T_KEEPALIVE_INTERVAL = 9,
-  DNCP_T_TRUST_VERDICT = 10
+  DNCP_T_TRUST_VERDICT = 10,
+
+  /* Hierarchical network state (experimental, not in the draft) */
+  DNCP_T_REQ_NET_STATE_RANGE = 11,
+  DNCP_T_NET_STATE_RANGE = 12,
+
+  /* Node data deltas (experimental, not in the draft) */
+  DNCP_T_REQ_NODE_DELTA = 13,
+  DNCP_T_NODE_DELTA = 14,
+
+  /* Bulk initial synchronization (experimental, not in the draft) */
+  DNCP_T_REQ_BULK_STATE = 15 /* empty */
 };
 
 #define TLV_SIZE sizeof(struct tlv_attr)
@@ -81,6 +92,37 @@ typedef struct __packed {
   uint32_t interval_in_ms;
 } dncp_t_keepalive_interval_s, *dncp_t_keepalive_interval;
 
+/* DNCP_T_REQ_NET_STATE_RANGE */
+typedef struct __packed {
+  uint8_t prefix_length_bits;
+  /* Node identifier prefix, ROUND_BITS_TO_BYTES(prefix_length_bits). */
+  uint8_t prefix_data[];
+} dncp_t_net_state_range_s, *dncp_t_net_state_range;
+
+/* DNCP_T_NET_STATE_RANGE */
+/* hash of the node state range; variable length, encoded here */
+/* + dncp_t_net_state_range_s */
+
+/* DNCP_T_REQ_BULK_STATE has no content */
+
+/* DNCP_T_REQ_NODE_DELTA */
+typedef struct __packed {
+  /* dncp_node_id_s node_id; variable length, encoded here */
+  uint32_t base_update_number;
+} dncp_t_req_node_delta_s, *dncp_t_req_node_delta;
+
+/* DNCP_T_NODE_DELTA */
+typedef struct __packed {
+  /* dncp_node_id_s node_id; variable length, encoded here */
+  uint32_t update_number;
+  uint32_t ms_since_origination;
+  uint32_t base_update_number;
+  uint32_t removed_length;
+  /* + hash of the whole (new) node data
+   * + removed TLVs (removed_length bytes)
+   * + added TLVs (rest of the TLV) */
+} dncp_t_node_delta_s, *dncp_t_node_delta;
+
 typedef enum {
   DNCP_VERDICT_NONE = -1, /* internal, should not be stored */
   DNCP_VERDICT_NEUTRAL = 0,
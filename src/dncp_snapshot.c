@@ -0,0 +1,294 @@
+/*
+ * $Id: dncp_snapshot.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ */
+
+/*
+ * This module provides a warm-restart snapshot of the DNCP node
+ * database.
+ *
+ * The file consists of a small header, followed by the DNCP_T_NODE_STATE
+ * TLVs (with node data) of every node we have data for, in the same
+ * encoding as on the wire. On startup, the file is mmap()ed and the
+ * peers' node data is restored as-is (it stays unreachable until the
+ * neighbors are seen again, and is pruned after the grace interval if
+ * they are not);
+ * as a result, the first network state exchange only requests the
+ * nodes that actually changed while we were away.
+ *
+ * Our own node data is not restored, as the local modules republish
+ * it anyway; the update number is, however, so that the first
+ * publication after restart supersedes what the peers have cached
+ * instead of being ignored until the collision handling bumps it.
+ */
+
+#include "dncp_snapshot.h"
+#include "dncp_i.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* in milliseconds, how long we have to be quiet before save */
+#define SAVE_INTERVAL 5000
+
+/* version schema; if the header or TLV content changes, change this. */
+#define SAVE_VERSION 1
+
+typedef struct __packed {
+  char magic[4];
+  uint8_t version;
+  uint8_t node_id_length;
+  uint8_t hash_length;
+  uint8_t reserved;
+} dncp_snapshot_header_s, *dncp_snapshot_header;
+
+static const char _magic[4] = { 'D', 'N', 'S', 'S' };
+
+struct dncp_snapshot_struct {
+  dncp dncp;
+
+  /* Store filename */
+  char *filename;
+
+  /* Change notification subscription for the dncp_snapshot module */
+  dncp_subscriber_s subscriber;
+
+  /* Timeout to write changes to disk. */
+  struct uloop_timeout timeout;
+};
+
+static bool _push_node(struct tlv_buf *tb, dncp_node n, hnetd_time_t now)
+{
+  dncp o = n->dncp;
+  int nilen = DNCP_NI_LEN(o);
+  int hlen = DNCP_HASH_LEN(o);
+  int l = tlv_len(n->tlv_container);
+  struct tlv_attr *a;
+  dncp_t_node_state s;
+  void *p;
+
+  dncp_calculate_node_data_hash(n);
+  if (!(a = tlv_new(tb, DNCP_T_NODE_STATE, nilen + sizeof(*s) + hlen + l)))
+    return false;
+  p = tlv_data(a);
+  memcpy(p, &n->node_id, nilen);
+  p += nilen;
+  s = p;
+  s->update_number = cpu_to_be32(n->update_number);
+  s->ms_since_origination = cpu_to_be32(now - n->origination_time);
+  p += sizeof(*s);
+  memcpy(p, &n->node_data_hash, hlen);
+  p += hlen;
+  memcpy(p, tlv_data(n->tlv_container), l);
+  return true;
+}
+
+bool dncp_snapshot_save(dncp o, const char *filename)
+{
+  dncp_snapshot_header_s h = {
+    .version = SAVE_VERSION,
+    .node_id_length = DNCP_NI_LEN(o),
+    .hash_length = DNCP_HASH_LEN(o)
+  };
+  hnetd_time_t now = dncp_time(o);
+  char tmpname[strlen(filename) + 5];
+  struct tlv_buf tb;
+  bool ok = false;
+  dncp_node n;
+  FILE *f;
+
+  memcpy(h.magic, _magic, sizeof(h.magic));
+  memset(&tb, 0, sizeof(tb));
+  if (tlv_buf_init(&tb, 0))
+    return false;
+  dncp_for_each_node_including_unreachable(o, n)
+    if (n->tlv_container && !_push_node(&tb, n, now))
+      {
+        L_ERR("snapshot save - eom");
+        goto done;
+      }
+  sprintf(tmpname, "%s.tmp", filename);
+  if (!(f = fopen(tmpname, "wb")))
+    {
+      L_ERR("snapshot save - error opening %s", tmpname);
+      goto done;
+    }
+  if (fwrite(&h, 1, sizeof(h), f) != sizeof(h)
+      || fwrite(tlv_data(tb.head), 1, tlv_len(tb.head), f)
+      != (size_t)tlv_len(tb.head))
+    {
+      L_ERR("snapshot save - error writing %s", tmpname);
+      fclose(f);
+      unlink(tmpname);
+      goto done;
+    }
+  if (fclose(f) || rename(tmpname, filename))
+    {
+      L_ERR("snapshot save - error replacing %s", filename);
+      unlink(tmpname);
+      goto done;
+    }
+  L_DEBUG("snapshot saved to %s", filename);
+  ok = true;
+ done:
+  tlv_buf_free(&tb);
+  return ok;
+}
+
+static void _load_node(dncp o, struct tlv_attr *a, hnetd_time_t now)
+{
+  int nilen = DNCP_NI_LEN(o);
+  int hlen = DNCP_HASH_LEN(o);
+  int dlen = tlv_len(a) - nilen - sizeof(dncp_t_node_state_s) - hlen;
+  void *p = tlv_data(a);
+  dncp_t_node_state s = p + nilen;
+  uint32_t update_number = be32_to_cpu(s->update_number);
+  struct tlv_attr *nd;
+  dncp_node n;
+
+  if (dlen < 0)
+    return;
+  if (!(n = dncp_find_node_by_node_id(o, p, true)))
+    return;
+  if (n == o->own_node)
+    {
+      if (dncp_update_number_gt(n->update_number, update_number))
+        {
+          L_DEBUG("snapshot own update number %d -> %d",
+                  (int)n->update_number, (int)update_number);
+          n->update_number = update_number;
+          /* republish increments the count too */
+          o->republish_tlvs = true;
+          dncp_schedule(o);
+        }
+      return;
+    }
+  if (n->tlv_container && !dncp_update_number_gt(n->update_number,
+                                                  update_number))
+    return;
+  if (!(nd = calloc(1, TLV_SIZE + dlen + 3)))
+    return;
+  tlv_init(nd, 0, TLV_SIZE + dlen);
+  memcpy(tlv_data(nd), (void *)s + sizeof(*s) + hlen, dlen);
+  dncp_node_set(n, update_number,
+                now - be32_to_cpu(s->ms_since_origination), nd);
+  /* Unreachable, but recently enough that the first prunes (before
+   * the neighbors are heard again) keep it for the grace interval. */
+  n->last_reachable_prune = now == o->last_prune ? now - 1 : now;
+  dncp_calculate_node_data_hash(n);
+  if (memcmp(&n->node_data_hash, (void *)s + sizeof(*s), hlen))
+    L_INFO("snapshot hash mismatch for %s", DNCP_NODE_REPR(n));
+}
+
+bool dncp_snapshot_load(dncp o, const char *filename)
+{
+  int nilen = DNCP_NI_LEN(o);
+  int hlen = DNCP_HASH_LEN(o);
+  hnetd_time_t now = dncp_time(o);
+  dncp_snapshot_header h;
+  struct tlv_attr *a;
+  struct stat st;
+  void *buf;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    {
+      L_INFO("snapshot load - unable to open %s", filename);
+      return false;
+    }
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*h))
+    {
+      L_ERR("snapshot load - %s too short", filename);
+      close(fd);
+      return false;
+    }
+  buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED)
+    {
+      L_ERR("snapshot load - mmap %s failed: %s", filename, strerror(errno));
+      return false;
+    }
+  h = buf;
+  if (memcmp(h->magic, _magic, sizeof(h->magic))
+      || h->version != SAVE_VERSION
+      || h->node_id_length != nilen
+      || h->hash_length != hlen)
+    {
+      L_INFO("snapshot load - %s has wrong format, skipping", filename);
+      munmap(buf, st.st_size);
+      return false;
+    }
+  tlv_for_each_in_buf(a, buf + sizeof(*h), st.st_size - sizeof(*h))
+    if (tlv_id(a) == DNCP_T_NODE_STATE
+        && tlv_len(a) >= nilen + sizeof(dncp_t_node_state_s) + hlen)
+      _load_node(o, a, now);
+  munmap(buf, st.st_size);
+  L_DEBUG("snapshot loaded from %s", filename);
+  return true;
+}
+
+static void _snapshot_write_cb(struct uloop_timeout *to)
+{
+  dncp_snapshot s = container_of(to, dncp_snapshot_s, timeout);
+
+  dncp_snapshot_save(s->dncp, s->filename);
+}
+
+static void _snapshot_changed(dncp_snapshot s)
+{
+  if (!s->timeout.pending)
+    uloop_timeout_set(&s->timeout, SAVE_INTERVAL);
+}
+
+static void _tlv_cb(dncp_subscriber sub,
+                    dncp_node n __unused,
+                    struct tlv_attr *tlv __unused,
+                    bool add __unused)
+{
+  _snapshot_changed(container_of(sub, dncp_snapshot_s, subscriber));
+}
+
+static void _node_cb(dncp_subscriber sub,
+                     dncp_node n __unused,
+                     bool add __unused)
+{
+  _snapshot_changed(container_of(sub, dncp_snapshot_s, subscriber));
+}
+
+dncp_snapshot dncp_snapshot_create(dncp o, const char *filename)
+{
+  dncp_snapshot s = calloc(1, sizeof(*s));
+
+  if (!s)
+    return NULL;
+  if (!(s->filename = strdup(filename)))
+    {
+      free(s);
+      return NULL;
+    }
+  s->dncp = o;
+  s->timeout.cb = _snapshot_write_cb;
+  s->subscriber.tlv_change_cb = _tlv_cb;
+  s->subscriber.node_change_cb = _node_cb;
+  dncp_snapshot_load(o, filename);
+  dncp_subscribe(o, &s->subscriber);
+  return s;
+}
+
+void dncp_snapshot_destroy(dncp_snapshot s)
+{
+  dncp o = s->dncp;
+
+  /* Save the data if and only if it has changed (reduce writes..) */
+  if (s->timeout.pending)
+    dncp_snapshot_save(o, s->filename);
+  dncp_unsubscribe(o, &s->subscriber);
+  uloop_timeout_cancel(&s->timeout);
+  free(s->filename);
+  free(s);
+}
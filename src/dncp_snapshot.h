@@ -0,0 +1,25 @@
+/*
+ * $Id: dncp_snapshot.h $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ */
+
+#pragma once
+
+#include "dncp.h"
+
+typedef struct dncp_snapshot_struct dncp_snapshot_s, *dncp_snapshot;
+
+/*
+ * Create the snapshot module; the node database stored in filename
+ * (if any) is loaded immediately, and the file is rewritten
+ * (atomically) whenever the node database has been quiet for a while
+ * after a change, as well as on destroy.
+ */
+dncp_snapshot dncp_snapshot_create(dncp o, const char *filename);
+void dncp_snapshot_destroy(dncp_snapshot s);
+
+/* Low-level save/load of the node database; return true on success. */
+bool dncp_snapshot_save(dncp o, const char *filename);
+bool dncp_snapshot_load(dncp o, const char *filename);
@@ -69,7 +69,7 @@ static void trickle_send_nocheck(dncp_trickle t, dncp_ep_i l, dncp_neighbor ne)
 static void trickle_send(dncp_trickle t, dncp_ep_i l, dncp_neighbor ne)
 {
   if (t->c < l->conf.trickle_k
-      && (!l->conf.unicast_is_reliable_stream ||
+      && (!dncp_ep_i_unicast_stream(l) ||
           t->i == l->conf.trickle_imin))
     trickle_send_nocheck(t, l, ne);
   else
@@ -77,7 +77,8 @@ static void trickle_send(dncp_trickle t, dncp_ep_i l, dncp_neighbor ne)
   t->send_time = 0;
 }
 
-static void _node_set_reachable(dncp_node n, bool value)
+/* Stamp is the new last_reachable_prune (if non-zero). */
+static void _node_set_reachable(dncp_node n, bool value, hnetd_time_t stamp)
 {
   dncp o = n->dncp;
   bool is_reachable = o->last_prune == n->last_reachable_prune;
@@ -85,24 +86,35 @@ static void _node_set_reachable(dncp_node n, bool value)
   if (is_reachable != value)
     {
       o->network_hash_dirty = true;
+      o->network_hash_layout_dirty = true;
 
       if (!value)
-        dncp_notify_subscribers_tlvs_changed(n, n->tlv_container_valid, NULL);
+        {
+          n->going_away = true;
+          dncp_notify_subscribers_tlvs_changed(n, n->tlv_container_valid, NULL);
+          n->going_away = false;
+        }
 
       dncp_notify_subscribers_node_changed(n, value);
 
       if (value)
         dncp_notify_subscribers_tlvs_changed(n, NULL, n->tlv_container_valid);
     }
-  if (value)
-    n->last_reachable_prune = dncp_time(o);
+  if (stamp)
+    n->last_reachable_prune = stamp;
 }
 
-static void _prune_rec(dncp_node n)
+static void _node_set_prune_parent(dncp_node n, dncp_node parent)
 {
-  struct tlv_attr *a;
-  dncp_t_neighbor ne;
-  dncp_node n2;
+  list_del_init(&n->in_prune_children);
+  n->prune_parent = parent;
+  if (parent)
+    list_add(&n->in_prune_children, &parent->prune_children);
+}
+
+static void _prune_rec(dncp_node n, dncp_node parent)
+{
+  dncp_node_adj adj;
 
   if (!n)
     return;
@@ -117,18 +129,18 @@ static void _prune_rec(dncp_node n)
     return;
 
   L_DEBUG("_prune_rec %s / %p", DNCP_NODE_REPR(n), n);
+  n->dncp->num_prune_visits++;
 
   /* Refresh the entry - we clearly did reach it. */
   vlist_add(&n->dncp->nodes, &n->in_nodes, n);
-  _node_set_reachable(n, true);
+  _node_set_reachable(n, true, dncp_time(n->dncp));
+  _node_set_prune_parent(n, parent);
 
   /* Look at it's neighbors. */
   /* Ignore if it's not _bidirectional_ neighbor. Unidirectional
    * ones lead to graph not settling down. */
-  dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_NEIGHBOR, false)
-    if ((ne = dncp_tlv_neighbor(n->dncp, a)))
-      if ((n2 = dncp_node_find_neigh_bidir(n, ne)))
-        _prune_rec(n2);
+  dncp_node_for_each_adj(n, adj)
+    _prune_rec(adj->node, n);
 }
 
 static void dncp_prune(dncp o)
@@ -141,14 +153,27 @@ static void dncp_prune(dncp o)
   assert(now != o->last_prune);
 
   L_DEBUG("dncp_prune %p", o);
+  o->num_prune_full++;
+
+  /* The reachability tree is rebuilt from scratch, and whatever
+   * changed since the last update is covered by the flood fill. */
+  dncp_node n, n2;
+  vlist_for_each_element(&o->nodes, n, in_nodes)
+    {
+      list_del_init(&n->in_prune_children);
+      INIT_LIST_HEAD(&n->prune_children);
+      n->prune_parent = NULL;
+    }
+  list_for_each_entry_safe(n, n2, &o->graph_dirty_nodes, in_graph_dirty)
+    list_del_init(&n->in_graph_dirty);
+  o->graph_full_dirty = false;
 
   /* Prune the node graph. IOW, start at own node, flood fill, and zap
    * anything that didn't seem appropriate. */
   vlist_update(&o->nodes);
 
-  _prune_rec(o->own_node);
+  _prune_rec(o->own_node, NULL);
 
-  dncp_node n;
   hnetd_time_t next_time = 0;
   vlist_for_each_element(&o->nodes, n, in_nodes)
     {
@@ -163,11 +188,164 @@ static void dncp_prune(dncp o)
       next_time = TMIN(next_time,
                        n->last_reachable_prune + grace_interval + 1);
       vlist_add(&o->nodes, &n->in_nodes, n);
-      _node_set_reachable(n, false);
+      _node_set_reachable(n, false, 0);
     }
+  if (o->ext->conf.full_prune_interval)
+    next_time = TMIN(next_time, now + o->ext->conf.full_prune_interval);
   o->next_prune = next_time;
   vlist_flush(&o->nodes);
   o->last_prune = now;
+  o->last_graph_update = now;
+}
+
+/* Are the two nodes bidirectional neighbors? */
+static bool _node_is_neigh_bidir(dncp_node n, dncp_node n2)
+{
+  dncp_node_adj adj;
+
+  dncp_node_for_each_adj(n, adj)
+    if (adj->node == n2)
+      return true;
+  return false;
+}
+
+static bool _node_is_reachable(dncp_node n)
+{
+  return n->last_reachable_prune == n->dncp->last_prune && !n->prune_orphan;
+}
+
+/* Detach the subtree rooted at n from the reachability tree, and put
+ * its nodes on the orphans list. */
+static void _prune_cut(dncp_node n, struct list_head *orphans)
+{
+  dncp_node c, c2;
+
+  if (n->prune_orphan)
+    return;
+  n->dncp->num_prune_visits++;
+  _node_set_prune_parent(n, NULL);
+  n->prune_orphan = true;
+  list_add_tail(&n->in_prune_work, orphans);
+  list_for_each_entry_safe(c, c2, &n->prune_children, in_prune_children)
+    _prune_cut(c, orphans);
+}
+
+/* Attach (orphaned or so far unreachable) n below parent, and queue it
+ * so that its neighbors are looked at too. */
+static void _prune_attach(dncp_node n, dncp_node parent,
+                          struct list_head *queue)
+{
+  n->dncp->num_prune_visits++;
+  _node_set_prune_parent(n, parent);
+  if (n->prune_orphan)
+    {
+      n->prune_orphan = false;
+      list_del(&n->in_prune_work);
+    }
+  else
+    {
+      _node_set_reachable(n, true, n->dncp->last_prune);
+      n->dncp->next_prune = TMIN(n->dncp->next_prune, n->expiration_time);
+    }
+  list_add_tail(&n->in_prune_work, queue);
+}
+
+/* Find reachable bidirectional neighbor of (unreachable) n, if any. */
+static dncp_node _prune_find_parent(dncp_node n)
+{
+  dncp_node_adj adj;
+
+  dncp_node_for_each_adj(n, adj)
+    if (_node_is_reachable(adj->node))
+      return adj->node;
+  return NULL;
+}
+
+/*
+ * Incremental version of dncp_prune. Only the nodes whose data has
+ * changed since the last update (and the part of the reachability
+ * tree below them) are looked at:
+ *
+ * - tree edges that are no longer bidirectional are cut, and the
+ * subtrees below them orphaned,
+ *
+ * - the orphans and unreachable changed nodes are attached to
+ * reachable neighbors, if any, and
+ *
+ * - the reachable changed and re-attached nodes' neighbors are
+ * flood filled.
+ *
+ * Remaining orphans become unreachable. Their removal is left to the
+ * next full prune (scheduled based on the grace interval).
+ */
+static void dncp_prune_incremental(dncp o)
+{
+  hnetd_time_t now = dncp_time(o);
+  hnetd_time_t unreachable_stamp = now == o->last_prune ? now - 1 : now;
+  struct list_head orphans, queue;
+  dncp_node n, n2, c, c2;
+  dncp_node_adj adj;
+
+  L_DEBUG("dncp_prune_incremental %p", o);
+  o->num_prune_incremental++;
+  INIT_LIST_HEAD(&orphans);
+  INIT_LIST_HEAD(&queue);
+
+  /* Cut the tree edges that are no longer valid. */
+  list_for_each_entry(n, &o->graph_dirty_nodes, in_graph_dirty)
+    {
+      o->num_prune_visits++;
+      if (!_node_is_reachable(n))
+        continue;
+      if (n->prune_parent && !_node_is_neigh_bidir(n->prune_parent, n))
+        _prune_cut(n, &orphans);
+      list_for_each_entry_safe(c, c2, &n->prune_children, in_prune_children)
+        if (!_node_is_neigh_bidir(n, c))
+          _prune_cut(c, &orphans);
+    }
+
+  /* Attach what can be attached directly to the (still) reachable
+   * part of the tree. */
+  list_for_each_entry_safe(n, n2, &orphans, in_prune_work)
+    if (dncp_time(o) < n->expiration_time && (c = _prune_find_parent(n)))
+      _prune_attach(n, c, &queue);
+  list_for_each_entry(n, &o->graph_dirty_nodes, in_graph_dirty)
+    {
+      if (_node_is_reachable(n))
+        {
+          if (list_empty(&n->in_prune_work))
+            list_add_tail(&n->in_prune_work, &queue);
+          o->next_prune = TMIN(o->next_prune, n->expiration_time);
+        }
+      else if (!n->prune_orphan && dncp_time(o) < n->expiration_time
+               && (c = _prune_find_parent(n)))
+        _prune_attach(n, c, &queue);
+    }
+
+  /* Flood fill from the queued nodes. */
+  while (!list_empty(&queue))
+    {
+      n = list_first_entry(&queue, dncp_node_s, in_prune_work);
+      list_del_init(&n->in_prune_work);
+      dncp_node_for_each_adj(n, adj)
+        if (!_node_is_reachable(adj->node)
+            && dncp_time(o) < adj->node->expiration_time)
+          _prune_attach(adj->node, n, &queue);
+    }
+
+  /* Whatever is left in orphans is no longer reachable. */
+  list_for_each_entry_safe(n, n2, &orphans, in_prune_work)
+    {
+      list_del_init(&n->in_prune_work);
+      n->prune_orphan = false;
+      _node_set_reachable(n, false, unreachable_stamp);
+      o->next_prune = TMIN(o->next_prune, unreachable_stamp
+                           + o->ext->conf.grace_interval + 1);
+    }
+
+  list_for_each_entry_safe(n, n2, &o->graph_dirty_nodes, in_graph_dirty)
+    list_del_init(&n->in_graph_dirty);
+  o->last_graph_update = now;
 }
 
 #if L_LEVEL >= 8
@@ -198,7 +376,7 @@ static void dncp_prune(dncp o)
 #endif /* L_LEVEL >= 8 */
 
 static hnetd_time_t
-_neighbor_interval(dncp o, dncp_t_neighbor neigh)
+_neighbor_interval_calculate(dncp o, dncp_t_neighbor neigh)
 {
   dncp_node_id ni = dncp_tlv_get_node_id(o, neigh);
   dncp_node n = dncp_find_node_by_node_id(o, ni, false);
@@ -231,6 +409,18 @@ _neighbor_interval(dncp o, dncp_t_neighbor neigh)
   return value;
 }
 
+static hnetd_time_t
+_neighbor_interval(dncp o, dncp_neighbor n)
+{
+  if (!n->keepalive_interval_valid)
+    {
+      n->keepalive_interval =
+        _neighbor_interval_calculate(o, dncp_neighbor_get_t(o, n));
+      n->keepalive_interval_valid = true;
+    }
+  return n->keepalive_interval;
+}
+
 static hnetd_time_t handle_trickle_and_ka(dncp_trickle t,
                                           dncp_ep_i l,
                                           dncp_neighbor ne)
@@ -268,7 +458,6 @@ void dncp_ext_timeout(dncp o)
   hnetd_time_t next = 0;
   hnetd_time_t now = o->ext->cb.get_time(o->ext);
   dncp_ep ep;
-  dncp_tlv t, t2;
 
   /* Assumption: We're within RTC step here -> can use same timestamp
    * all the way. */
@@ -295,14 +484,31 @@ void dncp_ext_timeout(dncp o)
 
   if (!o->disable_prune)
     {
+      hnetd_time_t next_update = 0;
+
       if (o->graph_dirty)
-        o->next_prune = o->ext->conf.minimum_prune_interval + o->last_prune;
+        {
+          next_update =
+            o->ext->conf.minimum_prune_interval + o->last_graph_update;
+          if (!o->ext->conf.full_prune_interval || o->graph_full_dirty)
+            o->next_prune = next_update;
+        }
 
       if (o->next_prune && o->next_prune <= now)
         {
           o->graph_dirty = false;
           dncp_prune(o);
         }
+      else if (o->graph_dirty)
+        {
+          if (next_update <= now)
+            {
+              o->graph_dirty = false;
+              dncp_prune_incremental(o);
+            }
+          else
+            SET_NEXT(next_update, "next_update");
+        }
 
       /* next_prune may be set _by_ dncp_prune, therefore redundant
        * looking check */
@@ -318,12 +524,16 @@ void dncp_ext_timeout(dncp o)
   /* Recalculate network hash if necessary. */
   dncp_calculate_network_hash(o);
 
+  /* Network state messages due on all endpoints and to all peers are
+   * sent together at the end. */
+  o->queue_sends = true;
+
   dncp_for_each_enabled_ep(o, ep)
     {
       /* Update the 'active' link's published keepalive interval, if need be */
       dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
 
-      ep_i_set_keepalive_interval(l, ep->keepalive_interval);
+      ep_i_set_keepalive_interval(l, dncp_ep_i_keepalive_interval(l));
 
       if (ep->unicast_only)
         continue;
@@ -333,47 +543,48 @@ void dncp_ext_timeout(dncp o)
     }
 
   /* Look at neighbors we should be worried about.. */
-  /* vlist_for_each_element(&l->neighbors, n, in_neighbors) */
-  dncp_t_neighbor ne;
-  dncp_for_each_tlv_safe(o, t, t2)
-    if ((ne = dncp_tlv_neighbor(o, &t->tlv)))
-      {
-        dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
-        dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
-        dncp_neighbor n = dncp_tlv_get_extra(t);
-        hnetd_time_t interval = _neighbor_interval(o, ne);
-
-        if (ep->unicast_only)
-          {
-            hnetd_time_t next_time = handle_trickle_and_ka(&n->trickle, l, n);
-            SET_NEXT(next_time, "n-trickle-ka");
-          }
-
-        /* Zero interval is valid only on unicast stream connection
-         * (=~TCP/TLS/..). In that case, we can ignore keepalive
-         * handling here. */
-        if (!interval && ep->unicast_is_reliable_stream)
-          continue;
+  dncp_neighbor n, n2;
+  dncp_for_each_neighbor_safe(o, n, n2)
+    {
+      dncp_t_neighbor ne = dncp_neighbor_get_t(o, n);
+      dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
+      dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+      hnetd_time_t interval = _neighbor_interval(o, n);
+
+      if (ep->unicast_only)
+        {
+          hnetd_time_t next_time = handle_trickle_and_ka(&n->trickle, l, n);
+          SET_NEXT(next_time, "n-trickle-ka");
+        }
 
-        hnetd_time_t next_time = n->last_contact
-          + interval * o->ext->conf.keepalive_multiplier_percent / 100;
+      /* Zero interval is valid only on unicast stream connection
+       * (=~TCP/TLS/..). In that case, we can ignore keepalive
+       * handling here. */
+      if (!interval && dncp_ep_i_unicast_stream(l))
+        continue;
+
+      hnetd_time_t next_time = n->last_contact
+        + interval * o->ext->conf.keepalive_multiplier_percent / 100;
 
-        /* No cause to do anything right now. */
-        if (next_time > now)
-          {
-            SET_NEXT(next_time, "neighbor validity");
-            continue;
-          }
+      /* No cause to do anything right now. */
+      if (next_time > now)
+        {
+          SET_NEXT(next_time, "neighbor validity");
+          continue;
+        }
 
-        /* Zap the neighbor */
+      /* Zap the neighbor */
 #if L_LEVEL >= 7
-        L_DEBUG("Neighbor %s gone on " DNCP_LINK_F " - nothing in %d ms",
-                DNCP_NI_REPR(o, dncp_tlv_get_node_id(o, ne)),
-                DNCP_LINK_D(l), (int) (now - n->last_contact));
+      L_DEBUG("Neighbor %s gone on " DNCP_LINK_F " - nothing in %d ms",
+              DNCP_NI_REPR(o, dncp_tlv_get_node_id(o, ne)),
+              DNCP_LINK_D(l), (int) (now - n->last_contact));
 #endif /* L_LEVEL >= 7 */
-        dncp_remove_tlv(o, t);
-        o->num_neighbor_dropped++;
-      }
+      dncp_remove_tlv(o, n->tlv);
+      o->num_neighbor_dropped++;
+    }
+
+  o->queue_sends = false;
+  dncp_flush_sends(o);
 
   if (next && !o->immediate_scheduled)
     {
@@ -406,17 +617,14 @@ void dncp_trickle_reset(dncp o)
     }
 
   /* Per-peer */
-  dncp_t_neighbor ne;
-  dncp_tlv t;
-  dncp_for_each_tlv(o, t)
-    if ((ne = dncp_tlv_neighbor(o, &t->tlv)))
-      {
-        dncp_neighbor n = dncp_tlv_get_extra(t);
-        dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
-        dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
-
-        trickle_set_i(&n->trickle, l, ep->trickle_imin);
-      }
+  dncp_neighbor n;
+  dncp_for_each_neighbor(o, n)
+    {
+      dncp_ep ep = dncp_find_ep_by_id(o, dncp_neighbor_get_t(o, n)->ep_id);
+      dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+
+      trickle_set_i(&n->trickle, l, ep->trickle_imin);
+    }
 }
 
 void dncp_ext_ep_ready(dncp_ep ep, bool enabled)
@@ -437,13 +645,11 @@ void dncp_ext_ep_ready(dncp_ep ep, bool enabled)
   else
     {
       dncp o = l->dncp;
-      dncp_tlv t, t2;
-      dncp_t_neighbor ne;
+      dncp_neighbor n, n2;
 
-      dncp_for_each_tlv_safe(o, t, t2)
-        if ((ne = dncp_tlv_neighbor(o, &t->tlv)))
-          if (ne->ep_id == l->ep_id)
-            dncp_remove_tlv(o, t);
+      dncp_for_each_neighbor_safe(o, n, n2)
+        if (dncp_neighbor_get_t(o, n)->ep_id == l->ep_id)
+          dncp_remove_tlv(o, n->tlv);
 
       /* kill TLV, if any */
       ep_i_set_keepalive_interval(l, DNCP_KEEPALIVE_INTERVAL(o));
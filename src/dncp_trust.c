@@ -410,6 +410,8 @@ static bool _trust_set(dncp_trust t, const dncp_sha256 h,
 }
 
 
+static const uint16_t _tlv_types[] = { DNCP_T_TRUST_VERDICT, 0 };
+
 static void _tlv_cb(dncp_subscriber s,
                     dncp_node n, struct tlv_attr *tlv, bool add __unused)
 {
@@ -631,6 +633,7 @@ dncp_trust dncp_trust_create(dncp o, const char *filename)
   t->tree.keep_old = true;
   t->timeout.cb = _trust_write_cb;
   t->subscriber.tlv_change_cb = _tlv_cb;
+  t->subscriber.tlv_types = _tlv_types;
   if (filename)
     t->filename = strdup(filename);
   _trust_load(t);
@@ -170,6 +170,7 @@ bool hncp_init(hncp o)
         .trickle_k = HNCP_TRICKLE_K,
         .keepalive_interval = HNCP_KEEPALIVE_INTERVAL,
         .maximum_multicast_size = HNCP_MAXIMUM_MULTICAST_SIZE,
+        .maximum_unicast_size = HNCP_MAXIMUM_UNICAST_SIZE,
 
         /* TBD - should this be true or not? hmm. if so, we would have
          * to turn it off _for every link_ when dtls is enabled. */
@@ -180,6 +181,7 @@ bool hncp_init(hncp o)
       .keepalive_multiplier_percent = HNCP_KEEPALIVE_MULTIPLIER * 100,
       .grace_interval = HNCP_PRUNE_GRACE_PERIOD,
       .minimum_prune_interval = HNCP_MINIMUM_PRUNE_INTERVAL,
+      .full_prune_interval = HNCP_FULL_PRUNE_INTERVAL,
       .ext_node_data_size = sizeof(hncp_node_s),
       .ext_ep_data_size = sizeof(hncp_ep_s)
     },
@@ -216,11 +218,13 @@ void hncp_uninit(hncp h)
     {
       hep = dncp_ep_get_ext_data(ep);
       uloop_timeout_cancel(&hep->join_timeout);
+      hncp_io_ep_uninit(h, ep);
     }
+  /* dncp teardown may still schedule a timeout; hncp_io_uninit
+   * cancels it, so it has to be done last. */
+  if (h->dncp)
+    dncp_destroy(h->dncp);
   hncp_io_uninit(h);
-  if (!h->dncp)
-    return;
-  dncp_destroy(h->dncp);
 }
 
 dncp hncp_get_dncp(hncp o)
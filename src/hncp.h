@@ -57,6 +57,10 @@
  * self. */
 #define HNCP_MINIMUM_PRUNE_INTERVAL (HNETD_TIME_PER_SECOND / 50)
 
+/* In between, reachability is updated incrementally; full prune is
+ * still done this often as a consistency check. */
+#define HNCP_FULL_PRUNE_INTERVAL (60 * HNETD_TIME_PER_SECOND)
+
 
 /****************************************** Other implementation definitions */
 
@@ -81,6 +85,10 @@
  * here) should work.  */
 #define HNCP_MAXIMUM_MULTICAST_SIZE (1280-40-8)
 
+/* Batched unicast requests and replies are packed up to this size;
+ * same reasoning as above. */
+#define HNCP_MAXIMUM_UNICAST_SIZE (1280-40-8)
+
 /*********************************************************************** API */
 
 typedef struct hncp_struct hncp_s, *hncp;
@@ -112,6 +120,13 @@ struct in6_addr *hncp_get_ipv6_address(hncp o, const char *ifname);
 void hncp_set_dtls(hncp o, dtls d);
 #endif /* DTLS */
 
+/**
+ * Use a separate socket, bound to the device and joined only to its
+ * multicast group, for each endpoint enabled from now on. The kernel
+ * then drops traffic of disabled interfaces and other groups.
+ */
+void hncp_set_per_ep_sockets(hncp o, bool enabled);
+
 /**
  * Fork+run an utility script, and return the PID.
  */
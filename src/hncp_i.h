@@ -84,6 +84,17 @@ struct hncp_struct {
   /* Timeout for doing 'something' in dncp_io. */
   struct uloop_timeout timeout;
 
+  /* Stream (TCP) listener, opened when the first endpoint with
+   * unicast_is_reliable_stream is enabled, and the streams (both
+   * accepted and connected ones). */
+  struct uloop_fd stream_listen;
+  struct list_head streams;
+
+  /* Should each enabled endpoint get its own (device bound) socket,
+   * and the endpoints whose socket is readable. */
+  bool per_ep_sockets;
+  struct list_head readable_eps;
+
 #ifdef DTLS
   /* DTLS 'socket' abstraction, which actually hides two UDP sockets
    * (client and server) and N OpenSSL contexts tied to each of
@@ -96,6 +107,42 @@ struct hncp_struct {
 };
 
 
+/* A single stream connection (to one remote address on one
+ * endpoint). Messages are framed with 32-bit length prefix. */
+typedef struct hncp_stream_struct hncp_stream_s, *hncp_stream;
+
+struct hncp_stream_struct {
+  /* hncp->streams entry */
+  struct list_head lh;
+
+  /* Backpointer to hncp */
+  hncp h;
+
+  struct uloop_fd ufd;
+  dncp_ep ep;
+  struct sockaddr_in6 local;
+  struct sockaddr_in6 remote;
+
+  /* Has the connection been established (and peer state reported)? */
+  bool connected;
+
+  /* Received data not yet consumed (partial frames) */
+  unsigned char *rbuf;
+  size_t rbuf_len, rbuf_size;
+
+  /* Data not yet written to the socket */
+  unsigned char *wbuf;
+  size_t wbuf_len, wbuf_size;
+};
+
+/* Maximum size of a single received frame (same as the largest
+ * message dncp is willing to receive). */
+#define HNCP_STREAM_FRAME_MAX 65536
+
+/* Maximum amount of unwritten data per stream; slower peers get
+ * disconnected. */
+#define HNCP_STREAM_WBUF_MAX (1024 * 1024)
+
 struct hncp_bfs_head {
   /* List head for implementing BFS */
   struct list_head head;
@@ -116,6 +163,16 @@ struct hncp_ep_struct {
 
   /* Timeout used when joining.. */
   struct uloop_timeout join_timeout;
+
+  /* Socket of the endpoint (if per-endpoint sockets are used), and
+   * hncp->readable_eps entry (if it is readable) */
+  udp46 u46;
+  bool readable;
+  struct list_head in_readable;
+
+  /* Backpointers for the socket readable callback */
+  hncp h;
+  dncp_ep ep;
 };
 
 typedef struct hncp_node_struct hncp_node_s, *hncp_node;
@@ -85,10 +85,480 @@ static void _timeout(struct uloop_timeout *t)
   dncp_ext_timeout(h->dncp);
 }
 
+/*************************************************** Stream (TCP) transport */
+
+/* Endpoints with unicast_is_reliable_stream send their unicast
+ * traffic over TCP connections instead of UDP. Each message is
+ * framed with a 32-bit (network byte order) length. Connections are
+ * opened on demand when there is something to send to a remote
+ * address, and accepted on the same port number as the UDP one. */
+
+static void _stream_cb(struct uloop_fd *fd, unsigned int events);
+
+/* Streams are not authenticated, so with DTLS they are not used at
+ * all (disable_unicast_streams); unicast of stream endpoints goes
+ * through DTLS instead. */
+static bool _stream_used(hncp h, dncp_ep ep)
+{
+  return ep->unicast_is_reliable_stream
+    && !h->ext.conf.disable_unicast_streams;
+}
+
+static bool _sa6_equal(const struct sockaddr_in6 *a,
+                       const struct sockaddr_in6 *b)
+{
+  /* Scope matters only for link-local addresses; accepted non-local
+   * remotes have none. */
+  return a->sin6_port == b->sin6_port
+    && (!IN6_IS_ADDR_LINKLOCAL(&a->sin6_addr)
+        || a->sin6_scope_id == b->sin6_scope_id)
+    && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+}
+
+static bool _set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+static void _stream_update_events(hncp_stream s)
+{
+  unsigned int events = ULOOP_READ;
+
+  if (!s->connected || s->wbuf_len)
+    events |= ULOOP_WRITE;
+  uloop_fd_add(&s->ufd, events);
+}
+
+static void _stream_close(hncp_stream s)
+{
+  L_DEBUG("_stream_close " SA6_F "%%%s", SA6_D(&s->remote), s->ep->ifname);
+  uloop_fd_delete(&s->ufd);
+  close(s->ufd.fd);
+  list_del(&s->lh);
+  if (s->connected)
+    dncp_ext_ep_peer_state(s->ep, &s->local, &s->remote, false);
+  free(s->rbuf);
+  free(s->wbuf);
+  free(s);
+}
+
+static hncp_stream _stream_create(hncp h, dncp_ep ep, int fd,
+                                  const struct sockaddr_in6 *remote)
+{
+  hncp_stream s = calloc(1, sizeof(*s));
+
+  if (!s)
+    {
+      close(fd);
+      return NULL;
+    }
+  s->h = h;
+  s->ep = ep;
+  s->remote = *remote;
+  s->ufd.fd = fd;
+  s->ufd.cb = _stream_cb;
+  list_add(&s->lh, &h->streams);
+  return s;
+}
+
+static void _stream_set_connected(hncp_stream s)
+{
+  socklen_t len = sizeof(s->local);
+
+  if (getsockname(s->ufd.fd, (struct sockaddr *)&s->local, &len) < 0)
+    memset(&s->local, 0, sizeof(s->local));
+  s->connected = true;
+  _stream_update_events(s);
+  L_DEBUG("_stream_set_connected " SA6_F "->" SA6_F "%%%s",
+          SA6_D(&s->local), SA6_D(&s->remote), s->ep->ifname);
+  dncp_ext_ep_peer_state(s->ep, &s->local, &s->remote, true);
+}
+
+static bool _stream_flush(hncp_stream s)
+{
+  ssize_t r;
+
+  while (s->wbuf_len)
+    {
+      r = send(s->ufd.fd, s->wbuf, s->wbuf_len, MSG_NOSIGNAL);
+      if (r < 0)
+        {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            break;
+          L_DEBUG("_stream_flush failed: %s", strerror(errno));
+          return false;
+        }
+      s->wbuf_len -= r;
+      memmove(s->wbuf, s->wbuf + r, s->wbuf_len);
+    }
+  _stream_update_events(s);
+  return true;
+}
+
+/* Queue a framed message; it is written right away if possible. */
+static bool _stream_write(hncp_stream s, struct iovec *iov, int iov_len)
+{
+  uint32_t hdr;
+  size_t len = 0, need;
+  int i;
+
+  for (i = 0 ; i < iov_len ; i++)
+    len += iov[i].iov_len;
+  need = s->wbuf_len + sizeof(hdr) + len;
+  if (need > HNCP_STREAM_WBUF_MAX)
+    {
+      L_INFO("stream to " SA6_F " too far behind, disconnecting",
+             SA6_D(&s->remote));
+      return false;
+    }
+  if (need > s->wbuf_size)
+    {
+      size_t size = s->wbuf_size ? s->wbuf_size : 4096;
+      unsigned char *b;
+
+      while (size < need)
+        size *= 2;
+      if (!(b = realloc(s->wbuf, size)))
+        return false;
+      s->wbuf = b;
+      s->wbuf_size = size;
+    }
+  hdr = cpu_to_be32(len);
+  memcpy(s->wbuf + s->wbuf_len, &hdr, sizeof(hdr));
+  s->wbuf_len += sizeof(hdr);
+  for (i = 0 ; i < iov_len ; i++)
+    {
+      memcpy(s->wbuf + s->wbuf_len, iov[i].iov_base, iov[i].iov_len);
+      s->wbuf_len += iov[i].iov_len;
+    }
+  return !s->connected || _stream_flush(s);
+}
+
+static hncp_stream _stream_connect(hncp h, dncp_ep ep,
+                                   const struct sockaddr_in6 *remote)
+{
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  hncp_stream s;
+
+  if (fd < 0)
+    return NULL;
+  if (!_set_nonblocking(fd)
+      || (connect(fd, (struct sockaddr *)remote, sizeof(*remote)) < 0
+          && errno != EINPROGRESS))
+    {
+      L_DEBUG("unable to connect to " SA6_F ": %s",
+              SA6_D(remote), strerror(errno));
+      close(fd);
+      return NULL;
+    }
+  if (!(s = _stream_create(h, ep, fd, remote)))
+    return NULL;
+  /* Connection completion is signalled by writability. */
+  _stream_update_events(s);
+  return s;
+}
+
+static bool _stream_send(hncp h, dncp_ep ep,
+                         const struct sockaddr_in6 *remote,
+                         struct iovec *iov, int iov_len)
+{
+  hncp_stream s;
+
+  list_for_each_entry(s, &h->streams, lh)
+    if (s->ep == ep && _sa6_equal(&s->remote, remote))
+      goto found;
+  if (!(s = _stream_connect(h, ep, remote)))
+    return false;
+ found:
+  if (_stream_write(s, iov, iov_len))
+    return true;
+  _stream_close(s);
+  return false;
+}
+
+/* Length of the first complete frame in the receive buffer (or -1). */
+static ssize_t _stream_frame_len(hncp_stream s)
+{
+  uint32_t hdr;
+
+  if (s->rbuf_len < sizeof(hdr))
+    return -1;
+  memcpy(&hdr, s->rbuf, sizeof(hdr));
+  hdr = be32_to_cpu(hdr);
+  return s->rbuf_len - sizeof(hdr) >= hdr ? (ssize_t)hdr : -1;
+}
+
+static bool _stream_read(hncp_stream s)
+{
+  size_t max = sizeof(uint32_t) + HNCP_STREAM_FRAME_MAX;
+  uint32_t hdr;
+  ssize_t r;
+
+  while (1)
+    {
+      if (s->rbuf_len >= sizeof(hdr))
+        {
+          memcpy(&hdr, s->rbuf, sizeof(hdr));
+          if (be32_to_cpu(hdr) > HNCP_STREAM_FRAME_MAX)
+            {
+              L_INFO("too large frame from " SA6_F, SA6_D(&s->remote));
+              return false;
+            }
+        }
+      if (s->rbuf_len == s->rbuf_size)
+        {
+          size_t size = s->rbuf_size ? s->rbuf_size * 2 : 4096;
+          unsigned char *b;
+
+          /* Full buffer starts with a complete frame; the rest is
+           * read once dncp has consumed it. */
+          if (s->rbuf_size >= max)
+            break;
+          if (size > max)
+            size = max;
+          if (!(b = realloc(s->rbuf, size)))
+            return false;
+          s->rbuf = b;
+          s->rbuf_size = size;
+        }
+      r = recv(s->ufd.fd, s->rbuf + s->rbuf_len,
+               s->rbuf_size - s->rbuf_len, 0);
+      if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        break;
+      if (r <= 0)
+        return false;
+      s->rbuf_len += r;
+    }
+  if (_stream_frame_len(s) >= 0)
+    dncp_ext_readable(s->h->dncp);
+  return true;
+}
+
+static void _stream_cb(struct uloop_fd *fd, unsigned int events)
+{
+  hncp_stream s = container_of(fd, hncp_stream_s, ufd);
+
+  if (!s->connected && (events & ULOOP_WRITE))
+    {
+      int err = 0;
+      socklen_t len = sizeof(err);
+
+      if (getsockopt(fd->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+        {
+          L_DEBUG("unable to connect to " SA6_F ": %s",
+                  SA6_D(&s->remote), strerror(err));
+          _stream_close(s);
+          return;
+        }
+      _stream_set_connected(s);
+    }
+  if ((events & ULOOP_WRITE) && s->connected && !_stream_flush(s))
+    {
+      _stream_close(s);
+      return;
+    }
+  if ((events & ULOOP_READ) && !_stream_read(s))
+    _stream_close(s);
+}
+
+/* Endpoint of an accepted connection: the one the (link-local)
+ * remote address is scoped to, or the first enabled stream endpoint
+ * that accepts non-local traffic. */
+static dncp_ep _stream_accept_ep(hncp h, const struct sockaddr_in6 *remote)
+{
+  dncp_ep ep;
+
+  if (remote->sin6_scope_id)
+    {
+      ep = dncp_find_ep_by_ifindex(h->dncp, remote->sin6_scope_id);
+      return ep && _stream_used(h, ep) ? ep : NULL;
+    }
+  dncp_for_each_enabled_ep(h->dncp, ep)
+    if (_stream_used(h, ep) && ep->accept_insecure_nonlocal_traffic)
+      return ep;
+  return NULL;
+}
+
+static void _stream_listen_cb(struct uloop_fd *fd,
+                              unsigned int events __unused)
+{
+  hncp h = container_of(fd, hncp_s, stream_listen);
+  struct sockaddr_in6 remote;
+  socklen_t len;
+  hncp_stream s;
+  dncp_ep ep;
+  int nfd;
+
+  while (1)
+    {
+      len = sizeof(remote);
+      if ((nfd = accept(fd->fd, (struct sockaddr *)&remote, &len)) < 0)
+        break;
+      if (!(ep = _stream_accept_ep(h, &remote)) || !_set_nonblocking(nfd))
+        {
+          L_DEBUG("rejecting stream from " SA6_F, SA6_D(&remote));
+          close(nfd);
+          continue;
+        }
+      if ((s = _stream_create(h, ep, nfd, &remote)))
+        _stream_set_connected(s);
+    }
+}
+
+static bool _stream_listen(hncp h)
+{
+  struct sockaddr_in6 addr;
+  int fd, on = 1;
+
+  if (h->stream_listen.registered)
+    return true;
+  sockaddr_in6_set(&addr, NULL, h->udp_port);
+  if ((fd = socket(AF_INET6, SOCK_STREAM, 0)) < 0)
+    return false;
+  (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (!_set_nonblocking(fd)
+      || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(fd, 8) < 0)
+    {
+      L_ERR("unable to listen for streams: %s", strerror(errno));
+      close(fd);
+      return false;
+    }
+  h->stream_listen.fd = fd;
+  h->stream_listen.cb = _stream_listen_cb;
+  uloop_fd_add(&h->stream_listen, ULOOP_READ);
+  return true;
+}
+
+static void _stream_close_ep(hncp h, dncp_ep ep)
+{
+  hncp_stream s, s2;
+
+  list_for_each_entry_safe(s, s2, &h->streams, lh)
+    if (!ep || s->ep == ep)
+      _stream_close(s);
+}
+
+/* Take the first complete frame received on any stream. */
+static ssize_t _stream_recv(hncp h, dncp_ep *ep,
+                            struct sockaddr_in6 *src,
+                            struct sockaddr_in6 *dst,
+                            int *flags,
+                            void *buf, size_t len)
+{
+  hncp_stream s;
+  ssize_t l;
+
+  list_for_each_entry(s, &h->streams, lh)
+    while ((l = _stream_frame_len(s)) >= 0)
+      {
+        size_t consumed = sizeof(uint32_t) + l;
+        bool fits = (size_t)l <= len;
+
+        if (fits)
+          {
+            memcpy(buf, s->rbuf + sizeof(uint32_t), l);
+            *ep = s->ep;
+            *src = s->remote;
+            *dst = s->local;
+            *flags = 0;
+            if (IN6_IS_ADDR_LINKLOCAL(&src->sin6_addr))
+              *flags |= DNCP_RECV_FLAG_SRC_LINKLOCAL;
+            if (IN6_IS_ADDR_LINKLOCAL(&dst->sin6_addr))
+              *flags |= DNCP_RECV_FLAG_DST_LINKLOCAL;
+          }
+        s->rbuf_len -= consumed;
+        memmove(s->rbuf, s->rbuf + consumed, s->rbuf_len);
+        if (fits)
+          return l;
+      }
+  return -1;
+}
+
+/*************************************************** Per-endpoint sockets */
+
+/* Optionally, each enabled endpoint gets its own socket, bound to the
+ * device and joined only to the multicast group on it. The kernel
+ * then drops traffic we are not interested in, and the endpoint of
+ * received packets is known without looking it up. Endpoints whose
+ * socket cannot be set up use the shared server socket. */
+
+void hncp_set_per_ep_sockets(hncp h, bool enabled)
+{
+  h->per_ep_sockets = enabled;
+  /* The shared socket should not get the per-endpoint multicast. */
+  if (!udp46_set_multicast_all(h->u46_server, !enabled))
+    L_INFO("unable to restrict multicast on the shared socket");
+}
+
+static void _ep_readable_cb(udp46 s __unused, void *context)
+{
+  hncp_ep hep = context;
+
+  if (!hep->readable)
+    {
+      list_add_tail(&hep->in_readable, &hep->h->readable_eps);
+      hep->readable = true;
+    }
+  dncp_ext_readable(hep->h->dncp);
+}
+
+static void _ep_socket_close(hncp_ep hep)
+{
+  if (hep->readable)
+    {
+      list_del(&hep->in_readable);
+      hep->readable = false;
+    }
+  udp46_destroy(hep->u46);
+  hep->u46 = NULL;
+}
+
+static bool _ep_socket_open(hncp h, dncp_ep ep, hncp_ep hep)
+{
+  udp46 s = udp46_create(h->udp_port);
+
+  if (!s)
+    return false;
+  if (!udp46_bind_to_device(s, ep->ifname)
+      || !udp46_set_multicast_all(s, false))
+    {
+      L_INFO("no per-endpoint socket on %s, using the shared one",
+             ep->ifname);
+      udp46_destroy(s);
+      return false;
+    }
+  hep->h = h;
+  hep->ep = ep;
+  hep->u46 = s;
+  udp46_set_readable_cb(s, _ep_readable_cb, hep);
+  return true;
+}
+
+static udp46 _ep_socket(hncp h, dncp_ep ep)
+{
+  hncp_ep hep = h->per_ep_sockets ? dncp_ep_get_ext_data(ep) : NULL;
+
+  return hep && hep->u46 ? hep->u46 : h->u46_server;
+}
+
+void hncp_io_ep_uninit(hncp h, dncp_ep ep)
+{
+  hncp_ep hep = dncp_ep_get_ext_data(ep);
+
+  if (hep->u46)
+    _ep_socket_close(hep);
+  _stream_close_ep(h, ep);
+}
+
 bool
 hncp_io_set_ifname_enabled(hncp h, const char *ifname, bool enabled)
 {
   struct ipv6_mreq val;
+  dncp_ep ep = dncp_find_ep_by_name(h->dncp, ifname);
+  hncp_ep hep = ep && h->per_ep_sockets ? dncp_ep_get_ext_data(ep) : NULL;
 
   val.ipv6mr_multiaddr = h->multicast_address;
   L_DEBUG("_set_ifname_enabled %s %s",
@@ -101,17 +571,40 @@ hncp_io_set_ifname_enabled(hncp h, const char *ifname, bool enabled)
       return false;
     }
   val.ipv6mr_interface = ifindex;
-  int fd6;
-  udp46_get_fds(h->u46_server, NULL, &fd6);
-  if (setsockopt(fd6, IPPROTO_IPV6,
-                 enabled ? IPV6_ADD_MEMBERSHIP : IPV6_DROP_MEMBERSHIP,
-                 (char *) &val, sizeof(val)) < 0)
+  if (!enabled && hep && hep->u46)
     {
-      L_ERR("unable to enable on %s - setsockopt:%s", ifname, strerror(errno));
-      return false;
+      /* Group membership goes away with the socket. */
+      _ep_socket_close(hep);
+    }
+  else
+    {
+      int fd6;
+
+      if (enabled && hep && !hep->u46)
+        (void)_ep_socket_open(h, ep, hep);
+      udp46_get_fds(hep && hep->u46 ? hep->u46 : h->u46_server, NULL, &fd6);
+      if (setsockopt(fd6, IPPROTO_IPV6,
+                     enabled ? IPV6_ADD_MEMBERSHIP : IPV6_DROP_MEMBERSHIP,
+                     (char *) &val, sizeof(val)) < 0)
+        {
+          L_ERR("unable to enable on %s - setsockopt:%s", ifname, strerror(errno));
+          if (hep && hep->u46)
+            _ep_socket_close(hep);
+          return false;
+        }
     }
   /* Yay. It succeeded(?). */
-  dncp_ext_ep_ready(dncp_find_ep_by_name(h->dncp, ifname), enabled);
+  if (ep)
+    {
+      dncp_ep_set_ifindex(ep, ifindex);
+      if (enabled && _stream_used(h, ep))
+        (void)_stream_listen(h);
+      else if (enabled && ep->unicast_is_reliable_stream)
+        L_ERR("unicast stream on %s not used with DTLS", ifname);
+      if (!enabled)
+        _stream_close_ep(h, ep);
+    }
+  dncp_ext_ep_ready(ep, enabled);
   return true;
 }
 
@@ -127,6 +620,73 @@ static void _schedule_timeout(dncp_ext ext, int msecs)
   uloop_timeout_set(&h->timeout, msecs);
 }
 
+/* Determine the flags of a received packet whose endpoint is known.
+ * dst is set to NULL for (our) multicast traffic. */
+static bool
+_recv_classify_addrs(hncp h,
+                     struct sockaddr_in6 *src,
+                     struct sockaddr_in6 **dst,
+                     int *flags)
+{
+  if (IN6_IS_ADDR_LINKLOCAL(&src->sin6_addr))
+    *flags |= DNCP_RECV_FLAG_SRC_LINKLOCAL;
+
+  if (IN6_IS_ADDR_LINKLOCAL(&(*dst)->sin6_addr))
+    *flags |= DNCP_RECV_FLAG_DST_LINKLOCAL;
+
+  /* 'NULL' = multicast from dncp point of view. */
+  if (IN6_IS_ADDR_MULTICAST(&(*dst)->sin6_addr))
+    {
+      if (memcmp(&(*dst)->sin6_addr, &h->multicast_address,
+                 sizeof(h->multicast_address)))
+        {
+          L_DEBUG("hncp_io_recv: got wrong multicast address traffic?");
+          return false;
+        }
+      *dst = NULL;
+    }
+  return true;
+}
+
+/* Determine the endpoint and the flags of a received packet. False is
+ * returned if the packet should be ignored. */
+static bool
+_recv_classify(hncp h,
+               struct sockaddr_in6 *src,
+               struct sockaddr_in6 **dst,
+               dncp_ep *ep,
+               int *flags)
+{
+  char ifname[IFNAMSIZ];
+
+  if (!*dst)
+    {
+      L_DEBUG("no dst..?");
+      return false;
+    }
+  if (!(*dst)->sin6_scope_id)
+    {
+      L_DEBUG("no scope id..?");
+      return false;
+    }
+  if (!(*ep = dncp_find_ep_by_ifindex(h->dncp, (*dst)->sin6_scope_id)))
+    {
+      /* Not (yet) seen interface; look it up by name once. */
+      if (!if_indextoname((*dst)->sin6_scope_id, ifname))
+        {
+          L_ERR("unable to receive - if_indextoname:%s", strerror(errno));
+          return false;
+        }
+
+      *ep = dncp_find_ep_by_name(h->dncp, ifname);
+
+      if (!*ep)
+        return false;
+      dncp_ep_set_ifindex(*ep, (*dst)->sin6_scope_id);
+    }
+  return _recv_classify_addrs(h, src, dst, flags);
+}
+
 static ssize_t
 _recv(dncp_ext ext,
       dncp_ep *ep,
@@ -137,12 +697,23 @@ _recv(dncp_ext ext,
 {
   hncp h = container_of(ext, hncp_s, ext);
   ssize_t r = -1;
-  char ifname[IFNAMSIZ];
   struct sockaddr_in6 *src, *dst;
   int f;
 
+  static struct sockaddr_in6 stream_src, stream_dst;
+  if ((r = _stream_recv(h, ep, &stream_src, &stream_dst, flags,
+                        buf, len)) >= 0)
+    {
+      *src_store = &stream_src;
+      *dst_store = &stream_dst;
+      return r;
+    }
   while (1)
     {
+      static struct sockaddr_in6 src_udp, dst_udp;
+      hncp_ep hep = NULL;
+
+      r = -1;
       f = 0;
 #ifdef DTLS
       if (h->d)
@@ -153,59 +724,187 @@ _recv(dncp_ext ext,
             f |= DNCP_RECV_FLAG_SECURE;
         }
 #endif /* DTLS */
+      while (r < 0 && !list_empty(&h->readable_eps))
+        {
+          hep = list_first_entry(&h->readable_eps, hncp_ep_s, in_readable);
+          r = udp46_recv(hep->u46, &src_udp, &dst_udp, buf, len);
+          if (r < 0)
+            {
+              /* Drained; wait for the next readable callback. */
+              list_del(&hep->in_readable);
+              hep->readable = false;
+              hep = NULL;
+            }
+          else
+            {
+              src = &src_udp;
+              dst = &dst_udp;
+            }
+        }
       if (r < 0)
         {
-          static struct sockaddr_in6 src_store, dst_store;
-          r = udp46_recv(h->u46_server, &src_store, &dst_store, buf, len);
+          r = udp46_recv(h->u46_server, &src_udp, &dst_udp, buf, len);
           if (r < 0)
             break;
-          src = &src_store;
-          dst = &dst_store;
+          src = &src_udp;
+          dst = &dst_udp;
         }
-      if (!dst)
+      if (hep)
         {
-          L_DEBUG("no dst..?");
-          continue;
+          *ep = hep->ep;
+          if (!_recv_classify_addrs(h, src, &dst, &f))
+            continue;
         }
-      if (!dst->sin6_scope_id)
+      else if (!_recv_classify(h, src, &dst, ep, &f))
+        continue;
+      *src_store = src;
+      *dst_store = dst;
+      *flags = f;
+      break;
+    }
+  return r;
+}
+
+/* Read up to count - *got packets from s to the end of msgs, with
+ * initial flags f0. If ep is given, the socket is bound to it.
+ * Returns the number of packets udp46_recv_batch returned, including
+ * the ones ignored here but not those it dropped for lacking a
+ * destination address (0 if there was nothing to read). */
+static int
+_recv_batch_udp46(hncp h, udp46 s, dncp_ep ep, int f0,
+                  dncp_ext_msg msgs, int count, int *got)
+{
+  udp46_msg_s umsgs[UDP46_RECV_BATCH_MAX];
+  int i, base = *got, r;
+  dncp_ext_msg m;
+
+  for (i = base ; i < count ; i++)
+    {
+      umsgs[i - base].buf = msgs[i].buf;
+      umsgs[i - base].buf_size = msgs[i].buf_len;
+    }
+  r = udp46_recv_batch(s, umsgs, count - base);
+  /* udp46 may have reordered the buffers; take them all back. */
+  for (i = base ; i < count ; i++)
+    msgs[i].buf = umsgs[i - base].buf;
+  for (i = 0 ; i < r ; i++)
+    {
+      udp46_msg u = &umsgs[i];
+
+      m = &msgs[*got];
+      if (*got != base + i)
         {
-          L_DEBUG("no scope id..?");
-          continue;
+          /* Some were dropped; move the buffer down to this slot. */
+          msgs[base + i].buf = m->buf;
+          m->buf = u->buf;
         }
-      if (!if_indextoname(dst->sin6_scope_id, ifname))
+      m->src_store = u->src;
+      m->dst_store = u->dst;
+      m->src = &m->src_store;
+      m->dst = &m->dst_store;
+      m->flags = f0;
+      if (ep)
         {
-          L_ERR("unable to receive - if_indextoname:%s", strerror(errno));
-          continue;
+          m->ep = ep;
+          if (!_recv_classify_addrs(h, m->src, &m->dst, &m->flags))
+            continue;
         }
-
-      *ep = dncp_find_ep_by_name(h->dncp, ifname);
-
-      if (!*ep)
+      else if (!_recv_classify(h, m->src, &m->dst, &m->ep, &m->flags))
         continue;
+      m->len = u->len;
+      (*got)++;
+    }
+  return r;
+}
 
-      if (IN6_IS_ADDR_LINKLOCAL(&src->sin6_addr))
-        f |= DNCP_RECV_FLAG_SRC_LINKLOCAL;
+static int
+_recv_batch(dncp_ext ext, dncp_ext_msg msgs, int count)
+{
+  hncp h = container_of(ext, hncp_s, ext);
+  hncp_ep hep, hep2;
+  int got = 0, f0 = 0;
+  bool received = false;
+  dncp_ext_msg m;
 
-      if (IN6_IS_ADDR_LINKLOCAL(&dst->sin6_addr))
-        f |= DNCP_RECV_FLAG_DST_LINKLOCAL;
+  if (count > UDP46_RECV_BATCH_MAX)
+    count = UDP46_RECV_BATCH_MAX;
+  while (got < count)
+    {
+      m = &msgs[got];
+      if ((m->len = _stream_recv(h, &m->ep, &m->src_store, &m->dst_store,
+                                 &m->flags, m->buf, m->buf_len)) < 0)
+        break;
+      received = true;
+      m->src = &m->src_store;
+      m->dst = &m->dst_store;
+      got++;
+    }
+#ifdef DTLS
+  if (h->d)
+    {
+      struct sockaddr_in6 *src, *dst;
+      ssize_t l;
 
-      /* 'NULL' = multicast from dncp point of view. */
-      if (IN6_IS_ADDR_MULTICAST(&dst->sin6_addr))
+      /* DTLS packets come through their own queue, one at a time. */
+      f0 |= DNCP_RECV_FLAG_SECURE_TRIED;
+      while (got < count)
         {
-          if (memcmp(&dst->sin6_addr, &h->multicast_address,
-                     sizeof(h->multicast_address)))
+          m = &msgs[got];
+          if ((l = dtls_recv(h->d, &src, &dst, m->buf, m->buf_len)) < 0)
+            break;
+          received = true;
+          m->flags = f0;
+          if (l > 0)
+            m->flags |= DNCP_RECV_FLAG_SECURE;
+          if (!_recv_classify(h, src, &dst, &m->ep, &m->flags))
+            continue;
+          m->src_store = *src;
+          m->src = &m->src_store;
+          if (dst)
             {
-              L_DEBUG("hncp_io_recv: got wrong multicast address traffic?");
-              continue;
+              m->dst_store = *dst;
+              dst = &m->dst_store;
             }
-          dst = NULL;
+          m->dst = dst;
+          m->len = l;
+          got++;
         }
-      *src_store = src;
-      *dst_store = dst;
-      *flags = f;
-      break;
     }
-  return r;
+#endif /* DTLS */
+  list_for_each_entry_safe(hep, hep2, &h->readable_eps, in_readable)
+    {
+      if (got == count)
+        break;
+      if (_recv_batch_udp46(h, hep->u46, hep->ep, f0, msgs, count, &got) > 0)
+        {
+          received = true;
+          continue;
+        }
+      /* Drained; wait for the next readable callback. */
+      list_del(&hep->in_readable);
+      hep->readable = false;
+    }
+  if (got < count && _recv_batch_udp46(h, h->u46_server, NULL, f0,
+                                       msgs, count, &got) > 0)
+    received = true;
+  return received ? got : -1;
+}
+
+/* Fill in the real destination (multicast address if dst is NULL,
+ * and the interface index). */
+static void _send_dst(hncp h, dncp_ep ep,
+                      struct sockaddr_in6 *dst,
+                      struct sockaddr_in6 *rdst)
+{
+  if (!dst)
+    sockaddr_in6_set(rdst, &h->multicast_address, HNCP_PORT);
+  else
+    *rdst = *dst;
+  if (!(rdst->sin6_scope_id = dncp_ep_get_ifindex(ep)))
+    {
+      rdst->sin6_scope_id = if_nametoindex(ep->ifname);
+      dncp_ep_set_ifindex(ep, rdst->sin6_scope_id);
+    }
 }
 
 static void
@@ -218,11 +917,16 @@ _send(dncp_ext ext, dncp_ep ep,
   struct sockaddr_in6 rdst;
   ssize_t r;
 
-  if (!dst)
-    sockaddr_in6_set(&rdst, &h->multicast_address, HNCP_PORT);
-  else
-    rdst = *dst;
-  rdst.sin6_scope_id = if_nametoindex(ep->ifname);
+  _send_dst(h, ep, dst, &rdst);
+  if (dst && _stream_used(h, ep))
+    {
+      struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+      if (!_stream_send(h, ep, &rdst, &iov, 1))
+        L_DEBUG("_stream_send failed for %d bytes ->" SA6_F,
+                (int)len, SA6_D(&rdst));
+      return;
+    }
 #ifdef DTLS
   if (h->d && !IN6_IS_ADDR_MULTICAST(&rdst.sin6_addr))
     {
@@ -241,7 +945,7 @@ _send(dncp_ext ext, dncp_ep ep,
   else
 #endif /* DTLS */
     {
-      r = udp46_send(h->u46_server, src, &rdst, buf, len);
+      r = udp46_send(_ep_socket(h, ep), src, &rdst, buf, len);
       if (r >= 0 && (size_t) r != len)
         L_ERR("short udp46_send?!?");
       else if (r < 0)
@@ -250,6 +954,64 @@ _send(dncp_ext ext, dncp_ep ep,
     }
 }
 
+static void
+_send_batch(dncp_ext ext, dncp_ext_send msgs, int count)
+{
+  hncp h = container_of(ext, hncp_s, ext);
+  udp46_send_msg_s umsgs[UDP46_SEND_BATCH_MAX];
+  struct sockaddr_in6 rdsts[UDP46_SEND_BATCH_MAX];
+  udp46 s = NULL, ms;
+  int i, n = 0, r;
+
+  for (i = 0 ; i < count ; i++)
+    {
+      dncp_ext_send m = &msgs[i];
+
+      if (m->dst && _stream_used(h, m->ep))
+        {
+          struct sockaddr_in6 rdst;
+
+          _send_dst(h, m->ep, m->dst, &rdst);
+          if (!_stream_send(h, m->ep, &rdst, m->iov, m->iov_len))
+            L_DEBUG("_stream_send failed ->" SA6_F, SA6_D(&rdst));
+          continue;
+        }
+#ifdef DTLS
+      /* DTLS unicast goes through the DTLS module, one at a time. */
+      if (h->d && m->dst && !IN6_IS_ADDR_MULTICAST(&m->dst->sin6_addr))
+        {
+          size_t len = m->iov[0].iov_len + m->iov[1].iov_len;
+          unsigned char *buf = malloc(len);
+
+          if (!buf)
+            continue;
+          memcpy(buf, m->iov[0].iov_base, m->iov[0].iov_len);
+          memcpy(buf + m->iov[0].iov_len,
+                 m->iov[1].iov_base, m->iov[1].iov_len);
+          _send(ext, m->ep, m->src, m->dst, buf, len);
+          free(buf);
+          continue;
+        }
+#endif /* DTLS */
+      ms = _ep_socket(h, m->ep);
+      if (n == UDP46_SEND_BATCH_MAX || (n && ms != s))
+        {
+          if ((r = udp46_send_batch(s, umsgs, n)) != n)
+            L_DEBUG("udp46_send_batch sent only %d/%d", r, n);
+          n = 0;
+        }
+      s = ms;
+      _send_dst(h, m->ep, m->dst, &rdsts[n]);
+      umsgs[n].src = m->src;
+      umsgs[n].dst = &rdsts[n];
+      umsgs[n].iov = m->iov;
+      umsgs[n].iov_len = m->iov_len;
+      n++;
+    }
+  if (n && (r = udp46_send_batch(s, umsgs, n)) != n)
+    L_DEBUG("udp46_send_batch sent only %d/%d", r, n);
+}
+
 static hnetd_time_t _get_time(dncp_ext ext __unused)
 {
   return hnetd_time();
@@ -267,8 +1029,18 @@ static void _dtls_readable_cb(dtls d __unused, void *context)
 
 void hncp_set_dtls(hncp h, dtls d)
 {
+  dncp_ep ep;
+
   h->d = d;
   dtls_set_readable_cb(d, _dtls_readable_cb, h);
+  /* Also dncp stops treating the endpoints (including the already
+   * enabled ones) as streams; their configuration is left as is. */
+  h->ext.conf.disable_unicast_streams = true;
+  dncp_for_each_enabled_ep(h->dncp, ep)
+    if (ep->unicast_is_reliable_stream)
+      L_ERR("unicast stream on %s not used with DTLS", ep->ifname);
+  _stream_close_ep(h, NULL);
+  _schedule_timeout(&h->ext, 0);
 }
 
 #endif /* DTLS */
@@ -300,8 +1072,12 @@ bool hncp_io_init(hncp h)
   if (!(h->u46_server = udp46_create(h->udp_port)))
     return false;
   h->timeout.cb = _timeout;
+  INIT_LIST_HEAD(&h->streams);
+  INIT_LIST_HEAD(&h->readable_eps);
   h->ext.cb.recv = _recv;
+  h->ext.cb.recv_batch = _recv_batch;
   h->ext.cb.send = _send;
+  h->ext.cb.send_batch = _send_batch;
   h->ext.cb.get_hwaddrs = _get_hwaddrs;
   h->ext.cb.get_time = _get_time;
   h->ext.cb.schedule_timeout = _schedule_timeout;
@@ -311,6 +1087,12 @@ bool hncp_io_init(hncp h)
 
 void hncp_io_uninit(hncp h)
 {
+  _stream_close_ep(h, NULL);
+  if (h->stream_listen.registered)
+    {
+      uloop_fd_delete(&h->stream_listen);
+      close(h->stream_listen.fd);
+    }
   if (h->u46_server)
     udp46_destroy(h->u46_server);
   /* clear the timer from uloop. */
@@ -20,3 +20,6 @@ bool hncp_io_init(hncp h);
 void hncp_io_uninit(hncp h);
 
 bool hncp_io_set_ifname_enabled(hncp h, const char *ifname, bool enabled);
+
+/* Release the I/O state (socket, streams) of an endpoint. */
+void hncp_io_ep_uninit(hncp h, dncp_ep ep);
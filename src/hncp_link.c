@@ -200,6 +200,8 @@ static void cb_intaddr(struct iface_user *u, const char *ifname,
 	cb_intiface(u, ifname, iface && iface->internal);
 }
 
+static const uint16_t cb_tlv_types[] = {DNCP_T_NEIGHBOR, 0};
+
 static void cb_tlv(dncp_subscriber s, dncp_node n,
 		struct tlv_attr *tlv, bool add __unused)
 {
@@ -232,6 +234,7 @@ struct hncp_link* hncp_link_create(dncp dncp, const struct hncp_link_config *con
 		INIT_LIST_HEAD(&l->users);
 
 		l->subscr.tlv_change_cb = cb_tlv;
+		l->subscr.tlv_types = cb_tlv_types;
 		dncp_subscribe(dncp, &l->subscr);
 
 		l->iface.cb_intiface = cb_intiface;
@@ -372,6 +372,10 @@ static void hm_iface_clean_maybe(hm hm, hm_iface i) {
 		hm_iface_destroy(hm, i);
 }
 
+static const uint16_t _tlv_types[] = {
+	HNCP_T_PIM_BORDER_PROXY, HNCP_T_PIM_RPA_CANDIDATE, 0
+};
+
 static void _tlv_cb(dncp_subscriber s,
 		dncp_node n, struct tlv_attr *tlv, bool add)
 {
@@ -453,6 +457,7 @@ hncp_multicast hncp_multicast_create(hncp h, hncp_multicast_params p)
 	INIT_LIST_HEAD(&m->tasks);
 
 	m->subscriber.tlv_change_cb = _tlv_cb;
+	m->subscriber.tlv_types = _tlv_types;
 	dncp_subscribe(m->dncp, &m->subscriber);
 
 	m->iface.cb_intiface = _cb_intiface;
@@ -125,7 +125,7 @@ static hpa_conf hpa_conf_get_by_type(hpa_iface i, unsigned int type)
 	return NULL;
 }
 
-static pa_plen hpa_get_biggest(uint16_t prefix_count[PA_RAND_MAX_PLEN + 1])
+static pa_plen hpa_get_biggest(uint32_t prefix_count[PA_RAND_MAX_PLEN + 1])
 {
 	int i;
 	for(i=0; i<=PA_RAND_MAX_PLEN; i++)
@@ -176,7 +176,7 @@ static void hpa_aa_get_plen_range(__unused struct pa_rule *rule,
 
 static pa_plen hpa_desired_plen_cb(struct pa_rule *rule,
 		struct pa_ldp *ldp,
-		uint16_t prefix_count[PA_RAND_MAX_PLEN + 1])
+		uint32_t prefix_count[PA_RAND_MAX_PLEN + 1])
 {
 	pa_plen biggest = hpa_get_biggest(prefix_count);
 	if(biggest > 128)
@@ -205,7 +205,7 @@ static int hpa_aa_subprefix_cb(__unused struct pa_rule *rule,
 static pa_plen hpa_desired_plen_override_cb(
 		__unused struct pa_rule *rule,
 		struct pa_ldp *ldp,
-		__unused uint16_t prefix_count[PA_RAND_MAX_PLEN + 1])
+		__unused uint32_t prefix_count[PA_RAND_MAX_PLEN + 1])
 {
 	hpa_dp dp = container_of(ldp->dp, hpa_dp_s, pa);
 	if(prefix_is_ipv4(&dp->dp.prefix)) {
@@ -217,7 +217,7 @@ static pa_plen hpa_desired_plen_override_cb(
 
 static pa_plen hpa_return_128(__unused struct pa_rule *r,
 		__unused struct pa_ldp *ldp,
-		__unused uint16_t prefix_count[PA_RAND_MAX_PLEN + 1])
+		__unused uint32_t prefix_count[PA_RAND_MAX_PLEN + 1])
 {
 	return 128;
 }
@@ -614,7 +614,11 @@ static void hpa_dp_set_enabled(hncp_pa hpa, hpa_dp dp, bool enabled)
 	//Add or remove from PA.
 	//This will synchronously call callbacks for present prefixes
 	if(dp->dp.enabled) {
-		pa_dp_add(&hpa->pa, &dp->pa);
+		if(pa_dp_add(&hpa->pa, &dp->pa)) {
+			//Not in PA, so it must not be removed from it later
+			dp->dp.enabled = 0;
+			return;
+		}
 	} else {
 		pa_dp_del(&dp->pa);
 	}
@@ -921,7 +925,7 @@ static void hpa_link_link_cb(struct hncp_link_user *u, const char *ifname,
 	}
 
 	hpa_advp hap;
-	list_for_each_entry(hap, &hpa->aps, le) {
+	avl_for_each_element(&hpa->aps, hap, te) {
 		if(hap->advp.link == &i->pal || !hap->advp.link) {
 			hpa_iface i2 = hpa_get_adjacent_iface(hpa, &hap->ep_id);
 			struct pa_link *pal = i2?&i2->pal:NULL;
@@ -1195,25 +1199,36 @@ static void hpa_iface_intaddr_cb(struct iface_user *u, const char *ifname,
 
 /******** DNCP Stuff *******/
 
-static hpa_advp hpa_get_hpa_advp(struct pa_core *core, dncp_node n,
+static hpa_advp hpa_get_hpa_advp(struct avl_tree *tree, dncp_node n,
 		struct in6_addr *addr, uint8_t plen, uint32_t ep_id,
 		uint8_t flags)
 {
-	struct pa_advp *ap;
+	hpa_advp_s key = {.advp = {.plen = plen, .prefix = *addr},
+			.ep_id = {.ep_id = ep_id}, .ap_flags = flags};
 	hpa_advp hap;
-	hncp_ep_id_s id = {.ep_id = ep_id};
-
-	DNCP_NODE_TO_PA(n, &id.node_id);
-	pa_for_each_advp(core, ap, addr, plen) {
-		hap = container_of(ap, hpa_advp_s, advp);
-		//We must compare every field of the TLV in case it was modified
-		if(!hap->fake &&
-				!memcmp(&id, &hap->ep_id, sizeof(id)) &&
-				hap->ap_flags == flags) {
-			return hap;
-		}
+
+	//We must compare every field of the TLV in case it was modified
+	DNCP_NODE_TO_PA(n, &key.ep_id.node_id);
+	return avl_find_element(tree, &key, hap, te);
+}
+
+/* Withdraws all the entries of tree advertised by a given node at once. */
+static void hpa_withdraw_node(struct pa_core *core, struct avl_tree *tree,
+		dncp_node n)
+{
+	hpa_advp_s key = {.advp = {.plen = 0}};
+	hpa_advp hap, hap2;
+
+	DNCP_NODE_TO_PA(n, &key.ep_id.node_id);
+	hap = avl_find_ge_element(tree, &key, hap, te);
+	while(hap && !memcmp(&hap->ep_id.node_id, &key.ep_id.node_id,
+			sizeof(key.ep_id.node_id))) {
+		hap2 = avl_is_last(tree, &hap->te)?NULL:avl_next_element(hap, te);
+		pa_advp_del(core, &hap->advp);
+		avl_delete(tree, &hap->te);
+		free(hap);
+		hap = hap2;
 	}
-	return NULL;
 }
 
 static void hpa_update_ap_tlv(hncp_pa hpa, dncp_node n,
@@ -1230,12 +1245,12 @@ static void hpa_update_ap_tlv(hncp_pa hpa, dncp_node n,
 
 	hpa_advp hap;
 	if(!add) {
-		if((hap = hpa_get_hpa_advp(&hpa->pa, n, &p.prefix,
+		if((hap = hpa_get_hpa_advp(&hpa->aps, n, &p.prefix,
 				p.plen, ah->ep_id, ah->flags))) {
 			L_DEBUG("hpa_update_ap_tlv: deleting assigned prefix from %s",
 									HEX_REPR(tlv_data(tlv), tlv_len(tlv)));
 			pa_advp_del(&hpa->pa, &hap->advp);
-			list_del(&hap->le);
+			avl_delete(&hpa->aps, &hap->te);
 			free(hap);
 		} else {
 			L_INFO("hpa_update_ap_tlv: could not find assigned prefix from %s",
@@ -1256,10 +1271,11 @@ static void hpa_update_ap_tlv(hncp_pa hpa, dncp_node n,
 		DNCP_NODE_TO_PA(n, &hap->advp.node_id);
 		pa_advp_add(&hpa->pa, &hap->advp);
 
-		list_add(&hap->le, &hpa->aps);
 		hap->fake = 0;
 		hap->ep_id = id;
 		hap->ap_flags = ah->flags;
+		hap->te.key = hap;
+		avl_insert(&hpa->aps, &hap->te);
 	}
 }
 
@@ -1272,11 +1288,12 @@ static void hpa_update_ra_tlv(hncp_pa hpa, dncp_node n,
 
 	hpa_advp hap;
 	if(!add) {
-		if((hap = hpa_get_hpa_advp(&hpa->aa, n,
+		if((hap = hpa_get_hpa_advp(&hpa->ras, n,
 				&ra->address, 128, ra->ep_id, 0))) {
 			L_DEBUG("hpa_update_ra_tlv removing router address from %s",
 					HEX_REPR(tlv_data(tlv), tlv_len(tlv)));
 			pa_advp_del(&hpa->aa, &hap->advp);
+			avl_delete(&hpa->ras, &hap->te);
 			free(hap);
 		} else {
 			L_INFO("hpa_update_ra_tlv could not find router address from %s",
@@ -1294,9 +1311,12 @@ static void hpa_update_ra_tlv(hncp_pa hpa, dncp_node n,
 		DNCP_NODE_TO_PA(n, &hap->advp.node_id);
 		pa_advp_add(&hpa->aa, &hap->advp);
 
+		hap->fake = 0;
 		DNCP_NODE_TO_PA(n, &hap->ep_id.node_id);
 		hap->ep_id.ep_id = ra->ep_id;
 		hap->ap_flags = 0;
+		hap->te.key = hap;
+		avl_insert(&hpa->ras, &hap->te);
 	}
 }
 
@@ -1421,6 +1441,10 @@ static void hpa_dncp_republish_cb(dncp_subscriber r)
 	hpa_refresh_ec(container_of(r, hncp_pa_s, dncp_user), true);
 }
 
+static const uint16_t hpa_dncp_tlv_types[] = {
+	HNCP_T_EXTERNAL_CONNECTION, HNCP_T_ASSIGNED_PREFIX, HNCP_T_ROUTER_ADDRESS, 0
+};
+
 static void hpa_dncp_tlv_change_cb(dncp_subscriber s,
 		dncp_node n, struct tlv_attr *tlv, bool add)
 {
@@ -1452,10 +1476,13 @@ static void hpa_dncp_tlv_change_cb(dncp_subscriber s,
 		hpa_refresh_ec(hpa, false);
 		break;
 	case HNCP_T_ASSIGNED_PREFIX:
-		hpa_update_ap_tlv(hpa, n, tlv, add);
+		//Departing node's prefixes are withdrawn at once in node change cb
+		if (add || !dncp_node_is_going_away(n))
+			hpa_update_ap_tlv(hpa, n, tlv, add);
 		break;
 	case HNCP_T_ROUTER_ADDRESS:
-		hpa_update_ra_tlv(hpa, n, tlv, add);
+		if (add || !dncp_node_is_going_away(n))
+			hpa_update_ra_tlv(hpa, n, tlv, add);
 		break;
 	default:
 		break;
@@ -1469,6 +1496,14 @@ static void hpa_dncp_node_change_cb(dncp_subscriber s,
 	hncp_pa hpa = container_of(s, hncp_pa_s, dncp_user);
 	dncp o = hpa->dncp;
 
+	/* A departing node's prefixes and addresses are withdrawn at once
+	 * (their TLV removals were skipped). */
+	if (!add && !dncp_node_is_self(n)) {
+		hpa_withdraw_node(&hpa->pa, &hpa->aps, n);
+		hpa_withdraw_node(&hpa->aa, &hpa->ras, n);
+		return;
+	}
+
 	/* We're only interested about own node change. That's same as
 	 * router ID changing, and notable thing then is that own_node is
 	 * NULL and operation of interest is add.. */
@@ -1654,6 +1689,16 @@ struct list_head *__hpa_get_dps(hncp_pa hp)
 	return &hp->dps;
 }
 
+struct avl_tree *__hpa_get_aps(hncp_pa hp)
+{
+	return &hp->aps;
+}
+
+struct avl_tree *__hpa_get_ras(hncp_pa hp)
+{
+	return &hp->ras;
+}
+
 /******* Prefix delegation ******/
 
 static int hpa_pd_filter_accept(__unused struct pa_rule *rule, struct pa_ldp *ldp,
@@ -1671,7 +1716,7 @@ static int hpa_pd_filter_accept(__unused struct pa_rule *rule, struct pa_ldp *ld
 
 pa_plen hpa_lease_desired_plen_cb(struct pa_rule *rule,
 		__unused struct pa_ldp *ldp,
-		uint16_t prefix_count[PA_RAND_MAX_PLEN + 1])
+		uint32_t prefix_count[PA_RAND_MAX_PLEN + 1])
 {
 	hpa_lease l = container_of(rule, hpa_lease_s, rule_rand.rule);
 	pa_plen min_plen, des_plen;
@@ -1976,6 +2021,20 @@ static int hpa_adj_avl_tree_comp(const void *k1, const void *k2,
 	return memcmp(k1, k2, sizeof(hncp_ep_id_s));
 }
 
+static int hpa_advp_avl_tree_comp(const void *k1, const void *k2,
+		__unused void *ptr)
+{
+	const hpa_advp_s *a = k1, *b = k2;
+	int i;
+	if((i = memcmp(&a->ep_id, &b->ep_id, sizeof(hncp_ep_id_s))))
+		return i;
+	if(a->ap_flags != b->ap_flags)
+		return a->ap_flags - b->ap_flags;
+	if(a->advp.plen != b->advp.plen)
+		return a->advp.plen - b->advp.plen;
+	return memcmp(&a->advp.prefix, &b->advp.prefix, sizeof(a->advp.prefix));
+}
+
 int hncp_pa_storage_set(hncp_pa hpa, const char *path)
 {
 	pa_store_load(&hpa->store, path);
@@ -2002,7 +2061,8 @@ hncp_pa hncp_pa_create(hncp hncp, struct hncp_link *hncp_link)
 
 	//Initialize main PA structures
 	INIT_LIST_HEAD(&hp->dps);
-	INIT_LIST_HEAD(&hp->aps);
+	avl_init(&hp->aps, hpa_advp_avl_tree_comp, true, NULL);
+	avl_init(&hp->ras, hpa_advp_avl_tree_comp, true, NULL);
 	INIT_LIST_HEAD(&hp->ifaces);
 	INIT_LIST_HEAD(&hp->leases);
 	avl_init(&hp->adjacencies, hpa_adj_avl_tree_comp, false, NULL);
@@ -2078,6 +2138,7 @@ hncp_pa hncp_pa_create(hncp hncp, struct hncp_link *hncp_link)
 	hp->dncp_user.node_change_cb = hpa_dncp_node_change_cb;
 	hp->dncp_user.republish_cb = hpa_dncp_republish_cb;
 	hp->dncp_user.tlv_change_cb = hpa_dncp_tlv_change_cb;
+	hp->dncp_user.tlv_types = hpa_dncp_tlv_types;
 	dncp_subscribe(hp->dncp, &hp->dncp_user);
 
 	//Subscribe to HNCP Link
@@ -182,5 +182,7 @@ void hpa_pd_del_lease(hncp_pa hp, hpa_lease l);
  ********************************/
 
 struct list_head *__hpa_get_dps(hncp_pa hpa);
+struct avl_tree *__hpa_get_aps(hncp_pa hpa);
+struct avl_tree *__hpa_get_ras(hncp_pa hpa);
 
 #endif /* HNCP_PA_H_ */
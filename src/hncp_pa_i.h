@@ -34,7 +34,7 @@ typedef struct hpa_adjacency_struct {
 
 typedef struct hpa_advp_struct {
 	struct pa_advp advp;
-	struct list_head le; //APs are linked in main struct
+	struct avl_node te; //Indexed in main struct (ordered by node id first)
 	hncp_ep_id_s ep_id;
 	uint8_t ap_flags;
 	bool fake; //This is not a real advertised prefix, but rather a trick to fool PA.
@@ -239,8 +239,11 @@ struct hncp_pa_struct {
 	/* List of all available dps */
 	struct list_head dps;
 
-	/* All APs are linked here for fast iteration */
-	struct list_head aps;
+	/* All APs and Router Addresses, indexed by node id, ep id,
+	 * flags and prefix, such that all entries from a given node are
+	 * contiguous. */
+	struct avl_tree aps;
+	struct avl_tree ras;
 
 	/* List of ifaces known to hncp_pa */
 	struct list_head ifaces;
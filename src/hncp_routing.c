@@ -93,14 +93,16 @@ static void hncp_routing_intaddr(struct iface_user *u, __unused const char *ifna
 		uloop_timeout_set(&bfs->t, 0);
 }
 
+static const uint16_t hncp_routing_tlv_types[] = {
+	HNCP_T_ASSIGNED_PREFIX, HNCP_T_DELEGATED_PREFIX, DNCP_T_NEIGHBOR,
+	HNCP_T_EXTERNAL_CONNECTION, HNCP_T_ROUTER_ADDRESS, 0
+};
+
 static void hncp_routing_cb(dncp_subscriber s, __unused dncp_node n,
-		struct tlv_attr *tlv, __unused bool add)
+		__unused struct tlv_attr *tlv, __unused bool add)
 {
 	hncp_bfs bfs = container_of(s, hncp_bfs_s, subscr);
-	if (tlv_id(tlv) == HNCP_T_ASSIGNED_PREFIX || tlv_id(tlv) == HNCP_T_DELEGATED_PREFIX ||
-			tlv_id(tlv) == DNCP_T_NEIGHBOR || tlv_id(tlv) == HNCP_T_EXTERNAL_CONNECTION ||
-			tlv_id(tlv) == HNCP_T_ROUTER_ADDRESS)
-		uloop_timeout_set(&bfs->t, 0);
+	uloop_timeout_set(&bfs->t, 0);
 }
 
 static void hncp_routing_exec(struct uloop_process *p, __unused int ret)
@@ -141,53 +143,57 @@ static void hncp_routing_exec(struct uloop_process *p, __unused int ret)
 		argv[4] = (char*)hc->bfs.ifname;
 		L_WARN("Router %s", DNCP_NODE_REPR(c));
 
-		struct tlv_attr *a, *a2;
-		dncp_node_for_each_tlv(c, a) {
-			hncp_t_assigned_prefix_header ap;
-			dncp_t_neighbor ne;
-			if ((ne = dncp_tlv_neighbor(dncp, a))) {
-				if (!(n = dncp_node_find_neigh_bidir(c, ne)))
-					continue; // Connection not mutual
+		dncp_node_adj adj;
+		dncp_node_for_each_adj(c, adj) { // Mutual connections only
+			dncp_t_neighbor ne = adj->ne;
+			if (!dncp_node_get_tlvs(c))
+				break; // Node data not valid
+			n = adj->node;
 
-				hncp_node hn = dncp_node_get_ext_data(n);
-				if (hn->bfs.next_hop || n == dncp->own_node)
-					continue; // Already visited
+			hncp_node hn = dncp_node_get_ext_data(n);
+			if (hn->bfs.next_hop || n == dncp->own_node)
+				continue; // Already visited
 
 
-				if (c == dncp->own_node) { // We are at the start, lookup neighbor
-					dncp_ep ep = dncp_find_ep_by_id(dncp, ne->ep_id);
-					if (!ep)
-						continue;
-					dncp_tlv tlv = dncp_find_tlv(dncp, DNCP_T_NEIGHBOR, tlv_data(a), tlv_len(a));
-					dncp_neighbor neigh = tlv ? dncp_tlv_get_extra(tlv) : NULL;
-					if (neigh) {
-						hn->bfs.next_hop = &neigh->last_sa6.sin6_addr;
-						hn->bfs.ifname = ep->ifname;
-					}
+			if (c == dncp->own_node) { // We are at the start, lookup neighbor
+				dncp_ep ep = dncp_find_ep_by_id(dncp, ne->ep_id);
+				if (!ep)
+					continue;
+				dncp_tlv tlv = dncp_find_tlv(dncp, DNCP_T_NEIGHBOR, tlv_data(adj->tlv), tlv_len(adj->tlv));
+				dncp_neighbor neigh = tlv ? dncp_tlv_get_extra(tlv) : NULL;
+				if (neigh) {
+					hn->bfs.next_hop = &neigh->last_sa6.sin6_addr;
+					hn->bfs.ifname = ep->ifname;
+				}
 
-					struct tlv_attr *na;
-					hncp_t_router_address ra;
-					dncp_node_for_each_tlv_with_type(n, na, HNCP_T_ROUTER_ADDRESS) {
-						if ((ra = hncp_tlv_ra(na))) {
-							if (ra->ep_id == ne->neighbor_ep_id &&
-							    IN6_IS_ADDR_V4MAPPED(&ra->address)) {
-								hn->bfs.next_hop4 = &ra->address;
-								break;
-							}
+				struct tlv_attr *na;
+				hncp_t_router_address ra;
+				dncp_node_for_each_tlv_with_type(n, na, HNCP_T_ROUTER_ADDRESS) {
+					if ((ra = hncp_tlv_ra(na))) {
+						if (ra->ep_id == ne->neighbor_ep_id &&
+						    IN6_IS_ADDR_V4MAPPED(&ra->address)) {
+							hn->bfs.next_hop4 = &ra->address;
+							break;
 						}
 					}
-				} else { // Inherit next-hop from predecessor
-					hn->bfs.next_hop = hc->bfs.next_hop;
-					hn->bfs.next_hop4 = hc->bfs.next_hop4;
-					hn->bfs.ifname = hc->bfs.ifname;
 				}
+			} else { // Inherit next-hop from predecessor
+				hn->bfs.next_hop = hc->bfs.next_hop;
+				hn->bfs.next_hop4 = hc->bfs.next_hop4;
+				hn->bfs.ifname = hc->bfs.ifname;
+			}
 
-				if (!hn->bfs.next_hop || !hn->bfs.ifname)
-					continue;
+			if (!hn->bfs.next_hop || !hn->bfs.ifname)
+				continue;
 
-				hn->bfs.hopcount = hc->bfs.hopcount + 1;
-				list_add_tail(&hn->bfs.head, &queue);
-			} else if (tlv_id(a) == HNCP_T_EXTERNAL_CONNECTION) {
+			hn->bfs.hopcount = hc->bfs.hopcount + 1;
+			list_add_tail(&hn->bfs.head, &queue);
+		}
+
+		struct tlv_attr *a, *a2;
+		dncp_node_for_each_tlv(c, a) {
+			hncp_t_assigned_prefix_header ap;
+			if (tlv_id(a) == HNCP_T_EXTERNAL_CONNECTION) {
 				hncp_t_delegated_prefix_header dp;
 				tlv_for_each_attr(a2, a)
 					if ((dp = hncp_tlv_dp(a2))) {
@@ -311,6 +317,7 @@ hncp_bfs hncp_routing_create(hncp hncp, const char *script, bool incremental)
 		bfs->t.cb = hncp_routing_schedule;
 		bfs->iface.cb_intaddr = hncp_routing_intaddr;
 		bfs->subscr.tlv_change_cb = hncp_routing_cb;
+		bfs->subscr.tlv_types = hncp_routing_tlv_types;
 		dncp_subscribe(bfs->dncp, &bfs->subscr);
 	}
 
@@ -739,6 +739,12 @@ static void _refresh_rname(hncp_sd sd)
   _set_router_name(sd);
 }
 
+static const uint16_t _tlv_types[] = {
+  HNCP_T_DNS_ROUTER_NAME, HNCP_T_DNS_DELEGATED_ZONE,
+  HNCP_T_DNS_DOMAIN_NAME, HNCP_T_ROUTER_ADDRESS,
+  HNCP_T_EXTERNAL_CONNECTION, 0
+};
+
 static void _tlv_cb(dncp_subscriber s,
                     dncp_node n, struct tlv_attr *tlv, bool add)
 {
@@ -927,6 +933,7 @@ hncp_sd hncp_sd_create(hncp h, hncp_sd_params p, struct hncp_link *l)
   /* Set up the hncp subscriber */
   sd->subscriber.local_tlv_change_cb = _local_tlv_cb;
   sd->subscriber.tlv_change_cb = _tlv_cb;
+  sd->subscriber.tlv_types = _tlv_types;
   sd->subscriber.republish_cb = _republish_cb;
   sd->subscriber.ep_change_cb = _force_republish_cb;
   dncp_subscribe(o, &sd->subscriber);
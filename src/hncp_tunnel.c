@@ -211,11 +211,9 @@ static void hncp_tunnel_discover(struct uloop_timeout *timer)
 	struct hncp_tunnel_l2tpv3 *s, *n;
 	list_for_each_entry_safe(s, n, &t->l2tpv3, head) {
 		if (s->epid) {
-			struct tlv_attr *a;
-			dncp_node_for_each_tlv_with_type(t->dncp->own_node, a, DNCP_T_NEIGHBOR) {
-				dncp_t_neighbor ne = dncp_tlv_neighbor(t->dncp, a);
-				if (ne->ep_id == s->epid &&
-						dncp_node_find_neigh_bidir(t->dncp->own_node, ne)) {
+			dncp_node_adj adj;
+			dncp_node_for_each_adj(t->dncp->own_node, adj) {
+				if (adj->ne->ep_id == s->epid) {
 					s->active = now;
 					break;
 				}
@@ -30,6 +30,7 @@
 #include "platform.h"
 #include "pd.h"
 #include "dncp_trust.h"
+#include "dncp_snapshot.h"
 
 #ifdef HNCP_MULTICAST
 #include "hncp_multicast.h"
@@ -90,6 +91,8 @@ int usage() {
 	 "\t--ulaprefix v:x:y:z::/prefix\n"
 	 "\t--ulamode [on,off,ifnov6]\n"
 	 "\t--loglevel [0-9]\n"
+	 "\t--per-ep-sockets (separate device-bound socket per interface)\n"
+	 "\t--snapshot <path to node database snapshot file>\n"
 	 "\t--password <DTLS password for auth>\n"
 	 "\t--certificate <(DTLS) path to local certificate>\n"
 	 "\t--privatekey <(DTLS) path to local private key>\n"
@@ -164,6 +167,9 @@ int main(__unused int argc, char *argv[])
 	const char *dtls_dir = NULL;
 	const char *pidfile = NULL;
 	bool strict = false;
+	bool per_ep_sockets = false;
+	const char *snapshot_file = NULL;
+	dncp_snapshot snapshot = NULL;
 
 	enum {
 		GOL_IPPREFIX = 1000,
@@ -176,6 +182,8 @@ int main(__unused int argc, char *argv[])
 		GOL_TRUST, /* DTLS trust cache filename */
 		GOL_DIR, /* DTLS trusted cert dir */
 		GOL_PATH, /* DTLS trusted cert file path */
+		GOL_PER_EP_SOCKETS,
+		GOL_SNAPSHOT,
 	};
 
 	struct option longopts[] = {
@@ -190,6 +198,8 @@ int main(__unused int argc, char *argv[])
 			{ "privatekey",    required_argument,      NULL,           GOL_KEY },
 			{ "verifydir",    required_argument,      NULL,           GOL_DIR },
 			{ "verifypath",    required_argument,      NULL,           GOL_PATH },
+			{ "per-ep-sockets",    no_argument,      NULL,           GOL_PER_EP_SOCKETS },
+			{ "snapshot",    required_argument,      NULL,           GOL_SNAPSHOT },
 			{ "help",	 no_argument,		 NULL,           '?' },
 			{ NULL,          0,                      NULL,           0 }
 	};
@@ -261,6 +271,12 @@ int main(__unused int argc, char *argv[])
 		case GOL_PATH:
 			dtls_path = optarg;
 			break;
+		case GOL_PER_EP_SOCKETS:
+			per_ep_sockets = true;
+			break;
+		case GOL_SNAPSHOT:
+			snapshot_file = optarg;
+			break;
 		case GOL_KEY:
 #ifdef DTLS
 			dtls_key = optarg;
@@ -286,6 +302,17 @@ int main(__unused int argc, char *argv[])
 		return 42;
 	}
 
+	if (per_ep_sockets)
+		hncp_set_per_ep_sockets(h, true);
+
+	if (snapshot_file) {
+		snapshot = dncp_snapshot_create(hncp_get_dncp(h), snapshot_file);
+		if (!snapshot) {
+			L_ERR("Unable to create dncp snapshot module");
+			return 13;
+		}
+	}
+
 	hd_init(hncp_get_dncp(h));
 
 	if (sd_params.dnsmasq_script && sd_params.dnsmasq_bonus_file && sd_params.ohp_script)
@@ -442,6 +469,8 @@ int main(__unused int argc, char *argv[])
 
 	uloop_run();
 
+	if (snapshot)
+		dncp_snapshot_destroy(snapshot);
 	if (pidfile)
 		unlink(pidfile);
 	return 0;
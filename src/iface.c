@@ -218,10 +218,21 @@ static void iface_link_event(struct uloop_fd *fd, __unused unsigned events)
 						resp.hdr.nlmsg_type != RTM_DELLINK))
 			continue;
 
+		/* Keep the endpoint interface index cache up to date */
+		dncp_ep ep;
+		if (dncp_p && resp.hdr.nlmsg_type == RTM_DELLINK &&
+				(ep = dncp_find_ep_by_ifindex(dncp_p, resp.msg.ifi_index)))
+			dncp_ep_set_ifindex(ep, 0);
+
 		char namebuf[IF_NAMESIZE];
 		if (!if_indextoname(resp.msg.ifi_index, namebuf))
 			continue;
 
+		if (dncp_p && resp.hdr.nlmsg_type == RTM_NEWLINK)
+			dncp_for_each_ep(dncp_p, ep)
+				if (!strcmp(ep->ifname, namebuf))
+					dncp_ep_set_ifindex(ep, resp.msg.ifi_index);
+
 		struct iface *c = iface_get(namebuf);
 		if (!c)
 			continue;
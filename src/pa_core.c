@@ -48,9 +48,14 @@ const char *pa_hex_dump(uint8_t *ptr, size_t len, char *s) {
 		} \
 	} while(0)
 
+/* Scheduled routines are all run by a single core timer, such that a burst
+ * of changes results in a single routine execution per pair. */
 #define pa_routine_schedule(ldp) do { \
-	if(!(ldp)->routine_to.pending) \
-		uloop_timeout_set(&(ldp)->routine_to, PA_RUN_DELAY); }while(0)
+	if(!pa_ldp_routine_pending(ldp)) { \
+		list_add_tail(&(ldp)->in_dirty, &(ldp)->core->dirty_ldps); \
+		if(!(ldp)->core->routine_to.pending) \
+			uloop_timeout_set(&(ldp)->core->routine_to, PA_RUN_DELAY); \
+	} }while(0)
 
 #define PA_ADOPT_DELAY_r(ldp) (pa_rand() % (ldp)->core->adopt_delay)
 #define PA_BACKOFF_DELAY_r(ldp) ((ldp)->core->adopt_delay + pa_rand() % ((ldp)->core->backoff_delay - (ldp)->core->adopt_delay))
@@ -285,35 +290,11 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 	 * 3. Execute rules. *
 	 *********************/
 
-	struct pa_rule *rule, *r2;
+	struct pa_rule *rule, *r2, *next;
 	struct list_head rules, *insert;
 	INIT_LIST_HEAD(&rules);
 	ldp->backoff = backoff?1:0;
 
-	/* First, sort the rules with their max priority. */
-	list_for_each_entry(rule, &ldp->core->rules, le) {
-		/* Apply rule filter */
-		if(rule->filter_accept && !rule->filter_accept(rule, ldp, rule->filter_private))
-			continue;
-
-		/* Get priority */
-		rule->_max_priority = rule->get_max_priority?
-				rule->get_max_priority(rule, ldp):rule->max_priority;
-
-		if(!rule->_max_priority)
-			continue;
-
-		/* Insert the rule in descending order. */
-		insert = &rules;
-		list_for_each_entry(r2, &rules, _le) {
-			if(r2->_max_priority < rule->_max_priority)
-				break;
-			insert = &r2->_le;
-		}
-		list_add(&rule->_le, insert);
-	}
-
-	/* Now get the best rule result. */
 	enum pa_rule_target target,
 				best_target = PA_RULE_NO_MATCH;
 	pa_rule_priority best_prio;
@@ -323,7 +304,44 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 	//Get existing rule priority
 	best_prio = (ldp->published || ldp->adopting)?ldp->rule_priority:0;
 
-	list_for_each_entry(rule, &rules, _le) {
+	/* Core rules are sorted by priority bound. They are only filtered and
+	 * sorted by their actual max priority when they may beat both the
+	 * current best priority and the best pending rule. */
+	next = list_first_entry(&ldp->core->rules, struct pa_rule, le);
+	while(1) {
+		while(&next->le != &ldp->core->rules &&
+				(next->_unbounded || (next->_bound > best_prio &&
+				(list_empty(&rules) || next->_bound >
+				list_first_entry(&rules, struct pa_rule, _le)->_max_priority)))) {
+			rule = next;
+			next = list_entry(next->le.next, struct pa_rule, le);
+
+			/* Apply rule filter */
+			if(rule->filter_accept && !rule->filter_accept(rule, ldp, rule->filter_private))
+				continue;
+
+			/* Get priority */
+			rule->_max_priority = rule->get_max_priority?
+					rule->get_max_priority(rule, ldp):rule->max_priority;
+
+			if(rule->_max_priority <= best_prio)
+				continue;
+
+			/* Insert the rule in descending order. */
+			insert = &rules;
+			list_for_each_entry(r2, &rules, _le) {
+				if(r2->_max_priority < rule->_max_priority)
+					break;
+				insert = &r2->_le;
+			}
+			list_add(&rule->_le, insert);
+		}
+
+		if(list_empty(&rules))
+			break;
+
+		rule = list_first_entry(&rules, struct pa_rule, _le);
+		list_del(&rule->_le);
 		if(rule->_max_priority <= best_prio)
 			break; //Stop here as it is a sorted list
 
@@ -449,8 +467,20 @@ static void pa_backoff_to(struct uloop_timeout *to)
 
 static void pa_routine_to(struct uloop_timeout *to)
 {
-	struct pa_ldp *ldp = container_of(to, struct pa_ldp, routine_to);
-	pa_routine(ldp, false);
+	struct pa_core *core = container_of(to, struct pa_core, routine_to);
+	struct pa_ldp *ldp;
+	struct list_head dirty;
+
+	/* Pairs scheduled while running the routines go to the next round.
+	 * A pair may be destroyed by a user callback while in the local list,
+	 * so entries are popped one at a time. */
+	list_add(&dirty, &core->dirty_ldps);
+	list_del_init(&core->dirty_ldps);
+	while(!list_empty(&dirty)) {
+		ldp = list_first_entry(&dirty, struct pa_ldp, in_dirty);
+		list_del_init(&ldp->in_dirty);
+		pa_routine(ldp, false);
+	}
 }
 
 /*
@@ -465,7 +495,7 @@ static int pa_ldp_create(struct pa_core *core, struct pa_link *link, struct pa_d
 	}
 
 	ldp->backoff_to.cb = pa_backoff_to;
-	ldp->routine_to.cb = pa_routine_to;
+	INIT_LIST_HEAD(&ldp->in_dirty);
 	ldp->in_core.type = PAT_ASSIGNED;
 	ldp->core = core;
 	ldp->link = link;
@@ -486,7 +516,9 @@ static void pa_ldp_destroy(struct pa_ldp *ldp)
 	list_del(&ldp->in_link);
 	list_del(&ldp->in_dp);
 	uloop_timeout_cancel(&ldp->backoff_to);
-	uloop_timeout_cancel(&ldp->routine_to);
+	list_del(&ldp->in_dirty);
+	if(list_empty(&ldp->core->dirty_ldps))
+		uloop_timeout_cancel(&ldp->core->routine_to);
 	free(ldp);
 }
 
@@ -501,6 +533,7 @@ static void _pa_dp_del(struct pa_dp *dp)
 	pa_for_each_ldp_in_dp_safe(dp, ldp, ldp2)
 		pa_ldp_destroy(ldp);
 	list_del(&dp->le);
+	btrie_remove(&dp->be);
 }
 
 void pa_dp_del(struct pa_dp *dp)
@@ -513,6 +546,10 @@ int pa_dp_add(struct pa_core *core, struct pa_dp *dp)
 {
 	PA_INFO("Adding Delegated Prefix "PA_DP_P, PA_DP_PA(dp));
 	INIT_LIST_HEAD(&dp->ldps);
+	if(btrie_add(&core->dp_prefixes, &dp->be, (btrie_key_t *)&dp->prefix, dp->plen)) {
+		PA_WARNING("FAILED to add Delegated Prefix "PA_DP_P, PA_DP_PA(dp));
+		return -1;
+	}
 	list_add_tail(&dp->le, &core->dps);
 	struct pa_link *link;
 	pa_for_each_link(core, link) {
@@ -602,13 +639,11 @@ static void _pa_advp_update(struct pa_core *core, struct pa_advp *advp)
 {
 	struct pa_dp *dp;
 	struct pa_ldp *ldp;
-	pa_for_each_dp(core, dp) {
-		/* Schedule all for dps overlapping with the advp. */
-		//TODO: Maybe not necessary to schedule if we have Current and advp is not overlapping with it.
-		if(pa_prefix_overlap(&dp->prefix, dp->plen, &advp->prefix, advp->plen)) {
-			pa_for_each_ldp_in_dp(dp, ldp)
-					pa_routine_schedule(ldp);
-		}
+	/* Schedule all for dps overlapping with the advp. */
+	//TODO: Maybe not necessary to schedule if we have Current and advp is not overlapping with it.
+	btrie_for_each_updown_entry(dp, &core->dp_prefixes, (btrie_key_t *)&advp->prefix, advp->plen, be) {
+		pa_for_each_ldp_in_dp(dp, ldp)
+				pa_routine_schedule(ldp);
 	}
 }
 
@@ -644,7 +679,24 @@ void pa_advp_del(struct pa_core *core, struct pa_advp *advp)
 void pa_rule_add(struct pa_core *core, struct pa_rule *rule)
 {
 	PA_DEBUG("Adding rule "PA_RULE_P, PA_RULE_PA(rule));
-	list_add_tail(&rule->le, &core->rules);
+	struct pa_rule *r2;
+	struct list_head *insert;
+	rule->_unbounded = rule->get_max_priority && !rule->get_priority_bound;
+	rule->_bound = rule->get_priority_bound?rule->get_priority_bound(rule):
+			rule->max_priority;
+
+	/* Unbounded rules first, then in descending bound order. */
+	insert = &core->rules;
+	list_for_each_entry(r2, &core->rules, le) {
+		if(rule->_unbounded) {
+			if(!r2->_unbounded)
+				break;
+		} else if(!r2->_unbounded && r2->_bound < rule->_bound) {
+			break;
+		}
+		insert = &r2->le;
+	}
+	list_add(&rule->le, insert);
 	/* Schedule all routines */
 	struct pa_link *link;
 	struct pa_ldp *ldp;
@@ -709,7 +761,11 @@ void pa_core_init(struct pa_core *core)
 	INIT_LIST_HEAD(&core->links);
 	INIT_LIST_HEAD(&core->users);
 	INIT_LIST_HEAD(&core->rules);
+	INIT_LIST_HEAD(&core->dirty_ldps);
 	btrie_init(&core->prefixes);
+	btrie_init(&core->dp_prefixes);
+	core->routine_to.cb = pa_routine_to;
+	core->routine_to.pending = 0;
 	memset(core->node_id, 0, PA_NODE_ID_LEN *sizeof(PA_NODE_ID_TYPE));
 	core->flooding_delay = PA_DEFAULT_FLOODING_DELAY;
 	core->adopt_delay = PA_ADOPT_DELAY_DEFAULT;
@@ -801,7 +857,8 @@ static void pa_ha_dp_add(struct pa_core *core, struct pa_ldp *ldp)
 #endif
 
 	/* Add the dp to the child PA structure */
-	pa_dp_add(core, dp);
+	if(pa_dp_add(core, dp))
+		free(dp);
 }
 
 static void pa_ha_assigned_cb(struct pa_user *user, struct pa_ldp *ldp)
@@ -172,6 +172,16 @@ struct pa_core {
 	/* List of all delegated prefixes. */
 	struct list_head dps;
 
+	/* btrie containing all delegated prefixes, used to find the ones
+	 * overlapping with a given Advertised Prefix. */
+	struct btrie dp_prefixes;
+
+	/* Link/Delegated Prefix pairs waiting for their routine to be run. */
+	struct list_head dirty_ldps;
+
+	/* Timer used to run the routine of all pairs in dirty_ldps at once. */
+	struct uloop_timeout routine_to;
+
 	/* List of all PA rules. */
 	struct list_head rules;
 
@@ -299,6 +309,9 @@ struct pa_dp {
 	/* Linked in pa_core. */
 	struct list_head le;
 
+	/* Linked in pa_core dp_prefixes btrie. */
+	struct btrie_element be;
+
 	/* List of Link/Delegated Prefixes pairs associated with this
 	 * Delegated Prefix. */
 	struct list_head ldps;
@@ -332,6 +345,8 @@ void pa_dp_init(struct pa_dp *dp, pa_prefix *prefix, pa_plen plen);
 
 /**
  * Adds a Delegated Prefix for prefix assignment.
+ * Returns 0 on success, or -1 on failure. On failure, the Delegated
+ * Prefix is not added and must not be removed.
  */
 int pa_dp_add(struct pa_core *, struct pa_dp *);
 
@@ -430,8 +445,8 @@ struct pa_ldp {
 	 * The rule used to publish or adopt this prefix. */
 	struct pa_rule *rule;
 
-	/* Timer used to schedule the routine. */
-	struct uloop_timeout routine_to;
+	/* (if routine is scheduled) Linked in pa_core dirty_ldps. */
+	struct list_head in_dirty;
 
 	/* Timer used to backoff prefix generation, adoption or apply. */
 	struct uloop_timeout backoff_to;
@@ -453,6 +468,9 @@ struct pa_ldp {
 		((pa_ldp)->published)?"Published":"-", \
 		((pa_ldp)->applied)?"Applied":"-", ((pa_ldp)->adopting)?"Adopting":"-"
 
+/* Whether the routine is scheduled for the given Link/Delegated Prefix. */
+#define pa_ldp_routine_pending(pa_ldp) (!list_empty(&(pa_ldp)->in_dirty))
+
 /*
  * A prefix Advertised Prefix by someone else.
  */
@@ -628,6 +646,19 @@ struct pa_rule {
 	/* If get_max_priority is NULL, this value is used instead. */
 	pa_rule_priority max_priority;
 
+	/**
+	 * Must return an upper bound of the values get_max_priority may return,
+	 * whatever the ldp. It is called when the rule is added, and the
+	 * returned value must stay valid until the rule is removed.
+	 *
+	 * Rules are sorted by this bound when added, such that the routine
+	 * does not even filter rules which could not beat the current best
+	 * rule priority.
+	 * If NULL, max_priority is used as bound when get_max_priority is NULL,
+	 * and the rule is always considered otherwise.
+	 */
+	pa_rule_priority (*get_priority_bound)(struct pa_rule *);
+
 	/**
 	 * Must return the target specified by the rule.
 	 *
@@ -646,6 +677,8 @@ struct pa_rule {
 
 	 /* PRIVATE - Used by pa_core. */
 	 pa_rule_priority _max_priority;
+	 pa_rule_priority _bound;
+	 uint8_t _unbounded;
 	 struct list_head _le;
 };
 
@@ -15,8 +15,9 @@
 #define __unused __attribute__ ((unused))
 #endif
 
-#define pa_rule_init(rule, get_prio, max_prio, match_f, name) do{ \
+#define pa_rule_init(rule, get_prio, get_bound, max_prio, match_f, name) do{ \
 	(rule)->get_max_priority = get_prio; \
+	(rule)->get_priority_bound = get_bound; \
 	(rule)->max_priority = max_prio; \
 	(rule)->match = match_f; \
 	(rule)->filter_accept = NULL; \
@@ -37,23 +38,13 @@ void pa_rule_prefix_nth(pa_prefix *dst, pa_prefix *container, pa_plen container_
 
 void pa_rule_prefix_count(struct pa_core *core,
 		pa_prefix *subprefix, pa_plen subplen,
-		uint16_t *count, pa_plen max_plen) {
-	pa_prefix p;
-	pa_plen plen;
-	struct btrie *n;
-
-	for(plen = 0; plen <= max_plen; plen++)
-		count[plen] = 0;
-
-	btrie_for_each_available(&core->prefixes, n, (btrie_key_t *)&p, (btrie_plen_t *)&plen, (btrie_key_t *)subprefix, subplen) {
-		if(count[plen] != UINT16_MAX)
-			count[plen]++;
-	}
+		uint32_t *count, pa_plen max_plen) {
+	btrie_available_count(&core->prefixes, (btrie_key_t *)subprefix, subplen, count, max_plen);
 }
 
 /* Computes the candidate subset. */
 uint32_t pa_rule_candidate_subset( //Returns the number of found prefixes
-		const uint16_t *count,    //The prefix count returned by pa_rule_prefix_count
+		const uint32_t *count,    //The prefix count returned by pa_rule_prefix_count
 		pa_plen desired_plen,     //The desired prefix length
 		uint32_t desired_set_size,//Number of desired prefixes in the set
 		pa_plen *min_plen,        //The minimal prefix length of containing available prefixes
@@ -85,24 +76,18 @@ uint32_t pa_rule_candidate_subset( //Returns the number of found prefixes
 int pa_rule_candidate_pick(struct pa_core *core, pa_prefix *subprefix, pa_plen subplen,
 		uint32_t n, pa_prefix *p, pa_plen plen, pa_plen min_plen, pa_plen max_plen)
 {
-	struct btrie *node;
 	pa_plen i;
 	pa_prefix iter;
-	int pass = 0;
-	do{
-		btrie_for_each_available(&core->prefixes, node, (btrie_key_t *)&iter, (btrie_plen_t *)&i,
-				(btrie_key_t *)subprefix, subplen) {
-			if((pass && i == min_plen) || (!pass && i > min_plen && i <= max_plen)) {
-				if((plen - i >= 32) || (n < (((uint32_t)1) << (plen - i)))) {
-					//The nth prefix is in this available prefix
-					pa_rule_prefix_nth(p, &iter, i, n, plen);
-					return 0;
-				}
-				n -= 1 << (plen - i);
-			}
-		}
-	} while(!(pass++));
-	return -1;
+	uint64_t nth = n;
+	if(btrie_available_nth(&core->prefixes, (btrie_key_t *)&iter, (btrie_plen_t *)&i,
+			(btrie_key_t *)subprefix, subplen, min_plen + 1, max_plen, plen, &nth) &&
+			btrie_available_nth(&core->prefixes, (btrie_key_t *)&iter, (btrie_plen_t *)&i,
+			(btrie_key_t *)subprefix, subplen, min_plen, min_plen, plen, &nth))
+		return -1;
+
+	//The nth prefix is in this available prefix
+	pa_rule_prefix_nth(p, &iter, i, (uint32_t)nth, plen);
+	return 0;
 }
 
 void pa_rule_prefix_prandom(const uint8_t *seed, size_t seedlen, uint32_t ctr,
@@ -133,6 +118,11 @@ void pa_rule_prefix_prandom(const uint8_t *seed, size_t seedlen, uint32_t ctr,
 
 /***** Adopt rule ****/
 
+pa_rule_priority pa_rule_adopt_get_priority_bound(struct pa_rule *rule)
+{
+	return container_of(rule, struct pa_rule_adopt, rule)->rule_priority;
+}
+
 pa_rule_priority pa_rule_adopt_get_max_priority(struct pa_rule *rule, struct pa_ldp *ldp)
 {
 	if(!ldp->assigned || ldp->best_assignment || ldp->published) //No override
@@ -155,6 +145,7 @@ void pa_rule_adopt_init(struct pa_rule_adopt *r, const char *name,
 		pa_rule_priority rule_priority, pa_priority priority)
 {
 	pa_rule_init(&(r)->rule, pa_rule_adopt_get_max_priority,
+			pa_rule_adopt_get_priority_bound,
 			0, pa_rule_adopt_match, name);
 	r->rule_priority = rule_priority;
 	r->priority = priority;
@@ -163,6 +154,11 @@ void pa_rule_adopt_init(struct pa_rule_adopt *r, const char *name,
 
 /**** Random rule ****/
 
+pa_rule_priority pa_rule_random_get_priority_bound(struct pa_rule *rule)
+{
+	return container_of(rule, struct pa_rule_random, rule)->rule_priority;
+}
+
 pa_rule_priority pa_rule_random_get_max_priority(struct pa_rule *rule, struct pa_ldp *ldp)
 {
 	struct pa_rule_random *rule_r = container_of(rule, struct pa_rule_random, rule);
@@ -280,7 +276,7 @@ enum pa_rule_target pa_rule_random_match(struct pa_rule *rule, struct pa_ldp *ld
 		PA_DEBUG("Non-default assignment prefix pool will be used: %s", pa_prefix_repr(subprefix, subplen));
 	}
 
-	uint16_t prefix_count[PA_RAND_MAX_PLEN + 1];
+	uint32_t prefix_count[PA_RAND_MAX_PLEN + 1];
 	pa_rule_prefix_count(ldp->core, subprefix, subplen, prefix_count, PA_RAND_MAX_PLEN);
 
 	pa_plen desired_plen = rule_r->desired_plen_cb(&rule_r->rule, ldp, prefix_count);
@@ -363,6 +359,7 @@ void pa_rule_random_init(struct pa_rule_random *r, const char *name,
 		uint16_t random_set_size)
 {
 	pa_rule_init(&r->rule, pa_rule_random_get_max_priority,
+			pa_rule_random_get_priority_bound,
 			0, pa_rule_random_match, name);
 	r->rule_priority = rule_priority;
 	r->priority = priority;
@@ -410,7 +407,7 @@ enum pa_rule_target pa_rule_hamming_match(struct pa_rule *rule, struct pa_ldp *l
 		PA_DEBUG("Non-default assignment prefix pool will be used: %s", pa_prefix_repr(subprefix, subplen));
 	}
 
-	uint16_t prefix_count[PA_RAND_MAX_PLEN + 1];
+	uint32_t prefix_count[PA_RAND_MAX_PLEN + 1];
 	pa_rule_prefix_count(ldp->core, subprefix, subplen, prefix_count, PA_RAND_MAX_PLEN);
 
 	pa_plen desired_plen = rule_r->desired_plen_cb(&rule_r->rule, ldp, prefix_count);
@@ -482,6 +479,11 @@ enum pa_rule_target pa_rule_hamming_match(struct pa_rule *rule, struct pa_ldp *l
 	return PA_RULE_PUBLISH;
 }
 
+pa_rule_priority pa_rule_hamming_get_priority_bound(struct pa_rule *rule)
+{
+	return container_of(rule, struct pa_rule_hamming, rule)->rule_priority;
+}
+
 pa_rule_priority pa_rule_hamming_get_max_priority(struct pa_rule *rule, struct pa_ldp *ldp)
 {
 	struct pa_rule_hamming *rule_h = container_of(rule, struct pa_rule_hamming, rule);
@@ -498,6 +500,7 @@ void pa_rule_hamming_init(struct pa_rule_hamming *r, const char *name,
 		uint8_t *seed, size_t seedlen)
 {
 	pa_rule_init(&r->rule, pa_rule_hamming_get_max_priority,
+				pa_rule_hamming_get_priority_bound,
 				0, pa_rule_hamming_match, name);
 		r->rule_priority = rule_priority;
 		r->priority = priority;
@@ -510,6 +513,11 @@ void pa_rule_hamming_init(struct pa_rule_hamming *r, const char *name,
 
 /**** Static rule ****/
 
+pa_rule_priority pa_rule_static_get_priority_bound(struct pa_rule *rule)
+{
+	return container_of(rule, struct pa_rule_static, rule)->rule_priority;
+}
+
 pa_rule_priority pa_rule_static_get_max_priority(struct pa_rule *rule, struct pa_ldp *ldp)
 {
 	struct pa_rule_static *srule = container_of(rule, struct pa_rule_static, rule);
@@ -541,6 +549,7 @@ void pa_rule_static_init(struct pa_rule_static *r, const char *name,
 		pa_rule_priority rule_priority, pa_priority priority)
 {
 	pa_rule_init(&(r)->rule, pa_rule_static_get_max_priority,
+			pa_rule_static_get_priority_bound,
 			0, pa_rule_static_match, name);
 	r->get_prefix = get_prefix;
 	r->rule_priority = rule_priority;
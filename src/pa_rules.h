@@ -40,7 +40,7 @@ void pa_rule_adopt_init(struct pa_rule_adopt *r, const char *name,
 
 struct pa_rule_random;
 typedef pa_plen (*pa_rule_desired_plen_cb)(struct pa_rule *, struct pa_ldp *,
-			uint16_t prefix_count[PA_RAND_MAX_PLEN + 1]);
+			uint32_t prefix_count[PA_RAND_MAX_PLEN + 1]);
 typedef int (*pa_rule_subprefix_cb)(struct pa_rule *, struct pa_ldp *, pa_prefix *prefix, pa_plen *plen);
 typedef int (*pa_rule_accept_proposed_cb)(struct pa_rule *, struct pa_ldp *,
 		pa_prefix *prefix, pa_plen plen);
@@ -422,6 +422,11 @@ void pa_store_unbind(struct pa_store_bound *bound)
 	pa_user_unregister(&bound->user);
 }
 
+pa_rule_priority pa_store_get_priority_bound(struct pa_rule *rule)
+{
+	return container_of(rule, struct pa_store_rule, rule)->rule_priority;
+}
+
 pa_rule_priority pa_store_get_max_priority(struct pa_rule *rule, struct pa_ldp *ldp)
 {
 	if(ldp->best_assignment || ldp->published) //No override
@@ -484,6 +489,7 @@ void pa_store_rule_init(struct pa_store_rule *rule, struct pa_store *store)
 	rule->store = store;
 	rule->rule.filter_accept = NULL;
 	rule->rule.get_max_priority = pa_store_get_max_priority;
+	rule->rule.get_priority_bound = pa_store_get_priority_bound;
 	rule->rule.match = pa_store_match;
 	rule->get_plen_range = NULL;
 }
@@ -490,6 +490,7 @@ enum ipc_option {
 	OPT_KEEPALIVE_INTERVAL,
 	OPT_TRICKLE_K,
 	OPT_DNSNAME,
+	OPT_UNICAST_STREAM,
 	OPT_MAX
 };
 
@@ -513,6 +514,7 @@ struct blobmsg_policy ipc_policy[] = {
 	[OPT_KEEPALIVE_INTERVAL] = { .name = "keepalive_interval", .type = BLOBMSG_TYPE_INT32 },
 	[OPT_TRICKLE_K] = { .name = "trickle_k", .type = BLOBMSG_TYPE_INT32 },
 	[OPT_DNSNAME] = { .name = "dnsname", .type = BLOBMSG_TYPE_STRING},
+	[OPT_UNICAST_STREAM] = { .name = "unicast_stream", .type = BLOBMSG_TYPE_BOOL },
 };
 
 enum ipc_prefix_option {
@@ -549,7 +551,7 @@ int ipc_ifupdown(const char *method, int argc, char *const argv[])
 	char *entry;
 
 	int c, i;
-	while ((c = getopt(argc, argv, "c:dp:l:i:m:n:uk:P:4:6:D:L")) > 0) {
+	while ((c = getopt(argc, argv, "c:dp:l:i:m:n:uk:P:S4:6:D:L")) > 0) {
 		switch(c) {
 		case 'c':
 			blobmsg_add_string(&b, "mode", optarg);
@@ -600,6 +602,9 @@ int ipc_ifupdown(const char *method, int argc, char *const argv[])
 			if(sscanf(optarg, "%d", &i) == 1)
 				blobmsg_add_u32(&b, "keepalive_interval", i);
 			break;
+		case 'S':
+			blobmsg_add_u8(&b, "unicast_stream", 1);
+			break;
 
 		case '4':
 			blobmsg_add_string(&b, "ipv4source", optarg);
@@ -884,6 +889,13 @@ static void ipc_handle(struct uloop_fd *fd, __unused unsigned int events)
 			hncp_pa_conf_iface_flush(hncp_pa_p, iface->ifname); //Stop HNCP_PA UPDATE
 
 			dncp_ep conf;
+			/* Unicast over stream needs no keepalives (unless explicitly configured) */
+			if(iface && tb[OPT_UNICAST_STREAM] && (conf = dncp_find_ep_by_name(dncp_p, iface->ifname))) {
+				conf->unicast_is_reliable_stream = blobmsg_get_bool(tb[OPT_UNICAST_STREAM]);
+				if (conf->unicast_is_reliable_stream && !tb[OPT_KEEPALIVE_INTERVAL])
+					conf->keepalive_interval = 0;
+			}
+
 			if(iface && tb[OPT_KEEPALIVE_INTERVAL] && (conf = dncp_find_ep_by_name(dncp_p, iface->ifname))) {
 				conf->keepalive_interval = (((hnetd_time_t) blobmsg_get_u32(tb[OPT_KEEPALIVE_INTERVAL])) * HNETD_TIME_PER_SECOND) / 1000;
 			}
@@ -396,6 +396,7 @@ enum {
 	DATA_ATTR_KEEPALIVE_INTERVAL,
 	DATA_ATTR_TRICKLE_K,
 	DATA_ATTR_DNSNAME,
+	DATA_ATTR_UNICAST_STREAM,
 	DATA_ATTR_IP4UPLINKLIMIT,
 	DATA_ATTR_REQADDRESS,
 	DATA_ATTR_REQPREFIX,
@@ -437,6 +438,7 @@ static const struct blobmsg_policy data_attrs[DATA_ATTR_MAX] = {
 	[DATA_ATTR_KEEPALIVE_INTERVAL] = { .name = "keepalive_interval", .type = BLOBMSG_TYPE_INT32 },
 	[DATA_ATTR_TRICKLE_K] = { .name = "trickle_k", .type = BLOBMSG_TYPE_INT32 },
 	[DATA_ATTR_DNSNAME] = { .name = "dnsname", .type = BLOBMSG_TYPE_STRING },
+	[DATA_ATTR_UNICAST_STREAM] = { .name = "unicast_stream", .type = BLOBMSG_TYPE_BOOL },
 	[DATA_ATTR_CREATED] = { .name = "created", .type = BLOBMSG_TYPE_INT32 },
 	[DATA_ATTR_IP4UPLINKLIMIT] = { .name = "ip4uplinklimit", .type = BLOBMSG_TYPE_BOOL },
 	[DATA_ATTR_REQADDRESS] = { .name = "reqaddress", .type = BLOBMSG_TYPE_STRING },
@@ -1155,6 +1157,13 @@ static void platform_update(void *data, size_t len)
 		hncp_pa_conf_iface_flush(hncp_pa_p, c->ifname); //Stop HNCP_PA UPDATE
 
 		dncp_ep conf;
+		/* Unicast over stream needs no keepalives (unless explicitly configured) */
+		if(dtb[DATA_ATTR_UNICAST_STREAM] && (conf = dncp_find_ep_by_name(p_dncp, c->ifname))) {
+			conf->unicast_is_reliable_stream = blobmsg_get_bool(dtb[DATA_ATTR_UNICAST_STREAM]);
+			if (conf->unicast_is_reliable_stream && !dtb[DATA_ATTR_KEEPALIVE_INTERVAL])
+				conf->keepalive_interval = 0;
+		}
+
 		if(dtb[DATA_ATTR_KEEPALIVE_INTERVAL] && (conf = dncp_find_ep_by_name(p_dncp, c->ifname)))
 			conf->keepalive_interval = (hnetd_time_t) blobmsg_get_u32(dtb[DATA_ATTR_KEEPALIVE_INTERVAL]);
 
@@ -140,6 +140,45 @@ udp46 udp46_create(uint16_t port)
   return NULL;
 }
 
+bool udp46_bind_to_device(udp46 s, const char *ifname)
+{
+#ifdef SO_BINDTODEVICE
+  socklen_t len = strlen(ifname) + 1;
+
+  if (setsockopt(s->s4, SOL_SOCKET, SO_BINDTODEVICE, ifname, len) < 0
+      || setsockopt(s->s6, SOL_SOCKET, SO_BINDTODEVICE, ifname, len) < 0)
+    {
+      DEBUG("udp46_bind_to_device %s failed: %s", ifname, strerror(errno));
+      return false;
+    }
+  return true;
+#else
+  return false;
+#endif /* SO_BINDTODEVICE */
+}
+
+#if defined(__linux__) && !defined(IPV6_MULTICAST_ALL)
+#define IPV6_MULTICAST_ALL 29
+#endif /* __linux__ && !IPV6_MULTICAST_ALL */
+
+bool udp46_set_multicast_all(udp46 s, bool enabled)
+{
+#if defined(IP_MULTICAST_ALL) && defined(IPV6_MULTICAST_ALL)
+  int val = enabled;
+
+  if (setsockopt(s->s4, IPPROTO_IP, IP_MULTICAST_ALL, &val, sizeof(val)) < 0
+      || setsockopt(s->s6, IPPROTO_IPV6, IPV6_MULTICAST_ALL,
+                    &val, sizeof(val)) < 0)
+    {
+      DEBUG("udp46_set_multicast_all failed: %s", strerror(errno));
+      return false;
+    }
+  return true;
+#else
+  return enabled;
+#endif /* IP_MULTICAST_ALL && IPV6_MULTICAST_ALL */
+}
+
 void udp46_get_fds(udp46 s, int *fd1, int *fd2)
 {
   if (fd1)
@@ -148,32 +187,13 @@ void udp46_get_fds(udp46 s, int *fd1, int *fd2)
     *fd2 = s->s6;
 }
 
-ssize_t udp46_recv(udp46 s,
-                   struct sockaddr_in6 *src,
-                   struct sockaddr_in6 *dst,
-                   void *buf, size_t buf_size)
+/* Convert the source address to IPv6 (if it already isn't), and find
+ * the destination address from the control messages. False is
+ * returned if the destination address cannot be determined. */
+static bool _recv_addrs(udp46 s, struct msghdr *msg,
+                        struct sockaddr_in6 *src,
+                        struct sockaddr_in6 *dst)
 {
-  struct iovec iov[1] = {
-    {.iov_base = buf,
-     .iov_len = buf_size },
-  };
-  uint8_t c[1000];
-  struct msghdr msg = {
-    .msg_iov = iov,
-    .msg_iovlen = sizeof(iov) / sizeof(*iov),
-    .msg_name = src,
-    .msg_namelen = src ? sizeof(*src) : 0,
-    .msg_flags = 0,
-    .msg_control = c,
-    .msg_controllen = sizeof(c)
-  };
-  ssize_t l;
-
-  /* If we can't find a packet on IPv4 or IPv6 socket, return -1. */
-  if ((l = recvmsg(s->s6, &msg, 0)) < 0)
-    if ((l = recvmsg(s->s4, &msg, 0)) < 0)
-      return -1;
-
   /* Convert source address to IPv6 if it already isn't */
   if (src && src->sin6_family != AF_INET6)
     {
@@ -187,7 +207,7 @@ ssize_t udp46_recv(udp46 s,
 
   /* If we don't care about destination address, we're already done */
   if (!dst)
-    return l;
+    return true;
 
   sockaddr_in6_set(dst, NULL, s->port);
 
@@ -195,15 +215,15 @@ ssize_t udp46_recv(udp46 s,
   /* Iterate through the message headers looking for destination
    * address, and if finding it, return it (in dst, as V4 mapped if
    * need be). */
-  for (h = CMSG_FIRSTHDR(&msg); h;
-       h = CMSG_NXTHDR(&msg, h))
+  for (h = CMSG_FIRSTHDR(msg); h;
+       h = CMSG_NXTHDR(msg, h))
     if (h->cmsg_level == IPPROTO_IPV6
         && h->cmsg_type == IPV6_PKTINFO)
       {
         struct in6_pktinfo *ipi6 = (struct in6_pktinfo *)CMSG_DATA(h);
         dst->sin6_addr = ipi6->ipi6_addr;
         dst->sin6_scope_id = ipi6->ipi6_ifindex;
-        return l;
+        return true;
       }
 #ifdef IP_REVCDSTADDR
     else if (h->cmsg_level == IPPROTO_IP
@@ -211,7 +231,7 @@ ssize_t udp46_recv(udp46 s,
       {
         struct in_addr *a = (struct in_addr *)CMSG_DATA(h);
         IN_ADDR_TO_MAPPED_IN6_ADDR(a, &dst->sin6_addr);
-        return l;
+        return true;
       }
 #endif /* IP_REVCDSTADDR */
 #ifdef IP_PKTINFO
@@ -221,18 +241,125 @@ ssize_t udp46_recv(udp46 s,
         struct in_pktinfo *ipi = (struct in_pktinfo *) CMSG_DATA(h);
         IN_ADDR_TO_MAPPED_IN6_ADDR(&ipi->ipi_addr, &dst->sin6_addr);
         dst->sin6_scope_id = ipi->ipi_ifindex;
-        return l;
+        return true;
       }
 #endif /* IP_PKTINFO */
   /* By default, nothing happens if the option is AWOL. */
   DEBUG("unknown destination");
-  return -1;
+  return false;
 }
 
-int udp46_send_iovec(udp46 s,
-                     const struct sockaddr_in6 *src,
-                     const struct sockaddr_in6 *dst,
-                     struct iovec *iov, int iov_len)
+ssize_t udp46_recv(udp46 s,
+                   struct sockaddr_in6 *src,
+                   struct sockaddr_in6 *dst,
+                   void *buf, size_t buf_size)
+{
+  struct iovec iov[1] = {
+    {.iov_base = buf,
+     .iov_len = buf_size },
+  };
+  uint8_t c[1000];
+  struct msghdr msg = {
+    .msg_iov = iov,
+    .msg_iovlen = sizeof(iov) / sizeof(*iov),
+    .msg_name = src,
+    .msg_namelen = src ? sizeof(*src) : 0,
+    .msg_flags = 0,
+    .msg_control = c,
+    .msg_controllen = sizeof(c)
+  };
+  ssize_t l;
+
+  /* If we can't find a packet on IPv4 or IPv6 socket, return -1. */
+  if ((l = recvmsg(s->s6, &msg, 0)) < 0)
+    if ((l = recvmsg(s->s4, &msg, 0)) < 0)
+      return -1;
+
+  if (!_recv_addrs(s, &msg, src, dst))
+    return -1;
+  return l;
+}
+
+/* Enough for either IPv6 or IPv4 packet information. */
+#define UDP46_CMSG_SIZE                                 \
+  CMSG_SPACE(sizeof(struct in6_pktinfo) + sizeof(struct in_pktinfo))
+
+/* recvmmsg() and sendmmsg() are available (Linux). */
+#ifdef MSG_WAITFORONE
+
+static int _recv_batch_fd(udp46 s, int fd, udp46_msg msgs, int count)
+{
+  struct mmsghdr mmsg[UDP46_RECV_BATCH_MAX];
+  struct iovec iov[UDP46_RECV_BATCH_MAX];
+  uint8_t c[UDP46_RECV_BATCH_MAX][UDP46_CMSG_SIZE];
+  int i, r, got = 0;
+
+  for (i = 0 ; i < count ; i++)
+    {
+      iov[i].iov_base = msgs[i].buf;
+      iov[i].iov_len = msgs[i].buf_size;
+      memset(&mmsg[i], 0, sizeof(mmsg[i]));
+      mmsg[i].msg_hdr.msg_iov = &iov[i];
+      mmsg[i].msg_hdr.msg_iovlen = 1;
+      mmsg[i].msg_hdr.msg_name = &msgs[i].src;
+      mmsg[i].msg_hdr.msg_namelen = sizeof(msgs[i].src);
+      mmsg[i].msg_hdr.msg_control = c[i];
+      mmsg[i].msg_hdr.msg_controllen = sizeof(c[i]);
+    }
+  if ((r = recvmmsg(fd, mmsg, count, MSG_WAITFORONE, NULL)) <= 0)
+    return 0;
+
+  /* Drop the packets without known destination, and pack the rest
+   * at the start of msgs. The buffers are swapped, not copied. */
+  for (i = 0 ; i < r ; i++)
+    {
+      if (!_recv_addrs(s, &mmsg[i].msg_hdr, &msgs[i].src, &msgs[i].dst))
+        continue;
+      msgs[i].len = mmsg[i].msg_len;
+      if (got != i)
+        {
+          udp46_msg_s tmp = msgs[got];
+          msgs[got] = msgs[i];
+          msgs[i] = tmp;
+        }
+      got++;
+    }
+  return got;
+}
+
+#endif /* MSG_WAITFORONE */
+
+int udp46_recv_batch(udp46 s, udp46_msg msgs, int count)
+{
+  int got = 0;
+
+  if (count > UDP46_RECV_BATCH_MAX)
+    count = UDP46_RECV_BATCH_MAX;
+#ifdef MSG_WAITFORONE
+  got = _recv_batch_fd(s, s->s6, msgs, count);
+  if (got < count)
+    got += _recv_batch_fd(s, s->s4, msgs + got, count - got);
+#else
+  /* No recvmmsg(); fall back to one recvmsg() at a time. */
+  for ( ; got < count ; got++)
+    if ((msgs[got].len = udp46_recv(s, &msgs[got].src, &msgs[got].dst,
+                                    msgs[got].buf,
+                                    msgs[got].buf_size)) < 0)
+      break;
+#endif /* MSG_WAITFORONE */
+  return got;
+}
+
+/* Fill in msg (using sin and c, of UDP46_CMSG_SIZE bytes, as storage)
+ * for sending iov from src to dst. The socket to send it with is
+ * returned, or -1 if the addresses are not valid. */
+static int _send_prepare(udp46 s,
+                         const struct sockaddr_in6 *src,
+                         const struct sockaddr_in6 *dst,
+                         struct iovec *iov, int iov_len,
+                         struct msghdr *msg,
+                         struct sockaddr_in *sin,
+                         uint8_t *c)
 {
   if (src && src->sin6_family != AF_INET6)
     {
@@ -250,34 +377,30 @@ int udp46_send_iovec(udp46 s,
       DEBUG("IPv4 <> IPv6 traffic not allowed");
       return -1;
     }
-  uint8_t c[1000];
-  struct msghdr msg = {
-    .msg_iov = iov,
-    .msg_iovlen = iov_len,
-    .msg_flags = 0,
-    .msg_control = c,
-    .msg_controllen = sizeof(c)
-  };
-  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
-  struct sockaddr_in sin;
+  memset(msg, 0, sizeof(*msg));
+  msg->msg_iov = iov;
+  msg->msg_iovlen = iov_len;
+  msg->msg_control = c;
+  msg->msg_controllen = UDP46_CMSG_SIZE;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
   int sock = -1;
 
   if (IN6_IS_ADDR_V4MAPPED(&dst->sin6_addr))
     {
       /* Convert the destination address */
-      memset(&sin, 0, sizeof(sin));
-      MAPPED_IN6_ADDR_TO_IN_ADDR(&dst->sin6_addr, &sin.sin_addr);
-      sin.sin_family = AF_INET;
-      sin.sin_port = dst->sin6_port;
-      msg.msg_name = (void *)&sin;
-      msg.msg_namelen = sizeof(sin);
+      memset(sin, 0, sizeof(*sin));
+      MAPPED_IN6_ADDR_TO_IN_ADDR(&dst->sin6_addr, &sin->sin_addr);
+      sin->sin_family = AF_INET;
+      sin->sin_port = dst->sin6_port;
+      msg->msg_name = (void *)sin;
+      msg->msg_namelen = sizeof(*sin);
       sock = s->s4;
     }
   else
     {
       /* Use destination address as-is */
-      msg.msg_name = (void *)dst;
-      msg.msg_namelen = sizeof(*dst);
+      msg->msg_name = (void *)dst;
+      msg->msg_namelen = sizeof(*dst);
       sock = s->s6;
     }
   /* Deal with source address */
@@ -317,10 +440,83 @@ int udp46_send_iovec(udp46 s,
           cmsg->cmsg_len = CMSG_LEN(sizeof(*ipi6));
         }
     }
-  msg.msg_controllen = cmsg->cmsg_len;
+  msg->msg_controllen = cmsg->cmsg_len;
+  return sock;
+}
+
+int udp46_send_iovec(udp46 s,
+                     const struct sockaddr_in6 *src,
+                     const struct sockaddr_in6 *dst,
+                     struct iovec *iov, int iov_len)
+{
+  uint8_t c[UDP46_CMSG_SIZE];
+  struct msghdr msg;
+  struct sockaddr_in sin;
+  int sock = _send_prepare(s, src, dst, iov, iov_len, &msg, &sin, c);
+
+  if (sock < 0)
+    return -1;
   return sendmsg(sock, &msg, 0);
 }
 
+#ifdef MSG_WAITFORONE
+
+/* Send all of mm, skipping the messages that fail. The number of
+ * messages sent is returned. */
+static int _send_batch_fd(int fd, struct mmsghdr *mm, int count)
+{
+  int i = 0, sent = 0, r;
+
+  while (i < count)
+    {
+      if ((r = sendmmsg(fd, mm + i, count - i, 0)) <= 0)
+        {
+          DEBUG("sendmmsg failed: %s", strerror(errno));
+          i++;
+          continue;
+        }
+      i += r;
+      sent += r;
+    }
+  return sent;
+}
+
+#endif /* MSG_WAITFORONE */
+
+int udp46_send_batch(udp46 s, udp46_send_msg msgs, int count)
+{
+  int i, sent = 0;
+#ifdef MSG_WAITFORONE
+  struct mmsghdr mm[2][UDP46_SEND_BATCH_MAX];
+  struct sockaddr_in sin[UDP46_SEND_BATCH_MAX];
+  uint8_t c[UDP46_SEND_BATCH_MAX][UDP46_CMSG_SIZE];
+  int n[2] = { 0, 0 }, sock, f;
+
+  if (count > UDP46_SEND_BATCH_MAX)
+    count = UDP46_SEND_BATCH_MAX;
+  for (i = 0 ; i < count ; i++)
+    {
+      struct msghdr msg;
+
+      if ((sock = _send_prepare(s, msgs[i].src, msgs[i].dst,
+                                msgs[i].iov, msgs[i].iov_len,
+                                &msg, &sin[i], c[i])) < 0)
+        continue;
+      f = sock == s->s6;
+      memset(&mm[f][n[f]], 0, sizeof(mm[f][n[f]]));
+      mm[f][n[f]++].msg_hdr = msg;
+    }
+  sent += _send_batch_fd(s->s4, mm[0], n[0]);
+  sent += _send_batch_fd(s->s6, mm[1], n[1]);
+#else
+  /* No sendmmsg(); fall back to one sendmsg() at a time. */
+  for (i = 0 ; i < count ; i++)
+    if (udp46_send_iovec(s, msgs[i].src, msgs[i].dst,
+                         msgs[i].iov, msgs[i].iov_len) >= 0)
+      sent++;
+#endif /* MSG_WAITFORONE */
+  return sent;
+}
 
 void udp46_destroy(udp46 s)
 {
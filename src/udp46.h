@@ -15,6 +15,7 @@
 #define UDP46_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
@@ -67,6 +68,31 @@ ssize_t udp46_recv(udp46 s,
                    struct sockaddr_in6 *dst,
                    void *buf, size_t buf_size);
 
+typedef struct udp46_msg_struct {
+  /* Set by the caller */
+  void *buf;
+  size_t buf_size;
+
+  /* Set by udp46_recv_batch */
+  struct sockaddr_in6 src;
+  struct sockaddr_in6 dst;
+  ssize_t len;
+} udp46_msg_s, *udp46_msg;
+
+/* Maximum number of packets received with one udp46_recv_batch call. */
+#define UDP46_RECV_BATCH_MAX 32
+
+/**
+ * Receive a batch of packets.
+ *
+ * Same as udp46_recv, except that up to count (at most
+ * UDP46_RECV_BATCH_MAX) packets are received at once, using one
+ * recvmmsg() per underlying socket where available. Packets without
+ * known destination address are dropped. The number of packets
+ * stored in msgs is returned (0 if none were available).
+ */
+int udp46_recv_batch(udp46 s, udp46_msg msgs, int count);
+
 /**
  * Send a packet.
  *
@@ -83,6 +109,40 @@ int udp46_send(udp46 s,
                const struct sockaddr_in6 *dst,
                void *buf, size_t buf_size);
 
+typedef struct udp46_send_msg_struct {
+  const struct sockaddr_in6 *src;
+  const struct sockaddr_in6 *dst;
+  struct iovec *iov;
+  int iov_len;
+} udp46_send_msg_s, *udp46_send_msg;
+
+/* Maximum number of packets sent with one udp46_send_batch call. */
+#define UDP46_SEND_BATCH_MAX 32
+
+/**
+ * Send a batch of packets.
+ *
+ * Same as udp46_send_iovec for each of the count (at most
+ * UDP46_SEND_BATCH_MAX) packets, but using one sendmmsg() per
+ * underlying socket where available. Packets that cannot be sent are
+ * skipped. The number of packets sent is returned.
+ */
+int udp46_send_batch(udp46 s, udp46_send_msg msgs, int count);
+
+/**
+ * Bind the socket to a network device (SO_BINDTODEVICE), so that
+ * only traffic received on (and sent to) that device is handled by
+ * it. False is returned if the platform does not support it.
+ */
+bool udp46_bind_to_device(udp46 s, const char *ifname);
+
+/**
+ * Control whether the socket receives also multicast traffic for
+ * groups joined only by other sockets (which is the default on
+ * Linux). False is returned if the platform does not support it.
+ */
+bool udp46_set_multicast_all(udp46 s, bool enabled);
+
 /**
  * Destroy/close a socket.
  */
@@ -146,6 +146,8 @@ typedef struct net_sim_t {
   hnetd_time_t start;
 
   int sent_unicast;
+  size_t sent_unicast_bytes;
+  size_t max_sent_unicast_len;
   hnetd_time_t last_unicast_sent;
   int sent_multicast;
 
@@ -159,6 +161,19 @@ typedef struct net_sim_t {
 
   bool fake_unicast;
   bool fake_unicast_is_reliable_stream;
+  bool fake_hierarchical_network_state;
+  bool fake_node_data_delta;
+  bool fake_bulk_initial_sync;
+  bool disable_incremental_prune;
+  bool check_reachability;
+
+  int num_prune_full;
+  int num_prune_incremental;
+  int num_prune_visits;
+  int num_reachability_checks;
+
+  int num_node_delta_applied;
+  int num_bulk_state_sent;
 
 } net_sim_s, *net_sim;
 
@@ -341,6 +356,14 @@ hncp net_sim_find_hncp(net_sim s, const char *name)
     n->h.ext.conf.per_ep.unicast_only = true;
   if (s->fake_unicast_is_reliable_stream)
     n->h.ext.conf.per_ep.unicast_is_reliable_stream = true;
+  if (s->fake_hierarchical_network_state)
+    n->h.ext.conf.per_ep.hierarchical_network_state = true;
+  if (s->fake_node_data_delta)
+    n->h.ext.conf.per_ep.node_data_delta = true;
+  if (s->fake_bulk_initial_sync)
+    n->h.ext.conf.per_ep.bulk_initial_sync = true;
+  if (s->disable_incremental_prune)
+    n->h.ext.conf.full_prune_interval = 0;
   n->d = hncp_get_dncp(&n->h);
   sput_fail_unless(r, "hncp_init");
 
@@ -511,6 +534,12 @@ void net_sim_remove_node(net_sim s, net_node node)
   dncp o = node->d;
   net_neigh n, nn;
 
+  s->num_prune_full += o->num_prune_full;
+  s->num_prune_incremental += o->num_prune_incremental;
+  s->num_prune_visits += o->num_prune_visits;
+  s->num_node_delta_applied += o->num_node_delta_applied;
+  s->num_bulk_state_sent += o->num_bulk_state_sent;
+
   /* Remove from neighbors */
   list_for_each_entry_safe(n, nn, &s->neighs, lh)
     {
@@ -542,7 +571,7 @@ void net_sim_remove_node(net_sim s, net_node node)
 
 #ifndef DISABLE_HNCP_PA
   /* Kill glue (has to be done _after_ hncp_uninit). */
-  if (!s->disable_pa)
+  if (node->pa)
     hncp_pa_destroy(node->pa);
 #endif /* !DISABLE_HNCP_PA */
 #if defined(HNCP_MULTICAST) && !defined(DISABLE_HNCP_MULTICAST)
@@ -577,6 +606,7 @@ void net_sim_uninit(net_sim s)
 {
   struct list_head *p, *pn;
   int c = 0;
+  int prunes;
 
   s->del_neighbor_is_error = false;
   list_for_each_safe(p, pn, &s->nodes)
@@ -585,10 +615,19 @@ void net_sim_uninit(net_sim s)
       net_sim_remove_node(s, node);
       c++;
     }
-  L_NOTICE("#nodes:%d elapsed:%.2fs unicasts:%d multicasts:%d",
+  L_NOTICE("#nodes:%d elapsed:%.2fs unicasts:%d (%zu bytes) multicasts:%d",
            c,
            (float)(hnetd_time() - s->start) / HNETD_TIME_PER_SECOND,
-           s->sent_unicast, s->sent_multicast);
+           s->sent_unicast, s->sent_unicast_bytes, s->sent_multicast);
+  prunes = s->num_prune_full + s->num_prune_incremental;
+  L_NOTICE("prunes full:%d incremental:%d visited nodes/prune:%.2f",
+           s->num_prune_full, s->num_prune_incremental,
+           prunes ? (float)s->num_prune_visits / prunes : 0.0);
+  if (s->check_reachability)
+    L_NOTICE("reachability checks against full flood fill:%d",
+             s->num_reachability_checks);
+  L_NOTICE("node data deltas applied:%d bulk states sent:%d",
+           s->num_node_delta_applied, s->num_bulk_state_sent);
   sput_fail_unless(list_empty(&s->neighs), "no neighs");
   sput_fail_unless(list_empty(&s->messages), "no messages");
 }
@@ -636,6 +675,50 @@ net_node net_sim_node_from_dncp(dncp d)
   return container_of(h, net_node_s, h);
 }
 
+/* Flood fill from our own node the way full dncp_prune does, and make
+ * sure the (possibly incrementally maintained) reachability of every
+ * node matches it. The in_prune_work list heads, which are not used
+ * outside prune, serve as the visited markers. */
+bool net_sim_dncp_reachability_ok(dncp o)
+{
+  hnetd_time_t now = o->last_graph_update;
+  struct list_head queue, visited;
+  dncp_node n, n2;
+  dncp_node_adj adj;
+  bool ok = true;
+
+  /* Only up to date state can be compared. */
+  if (o->graph_dirty || o->graph_full_dirty
+      || !list_empty(&o->graph_dirty_nodes))
+    return true;
+  INIT_LIST_HEAD(&queue);
+  INIT_LIST_HEAD(&visited);
+  list_add_tail(&o->own_node->in_prune_work, &queue);
+  while (!list_empty(&queue))
+    {
+      n = list_first_entry(&queue, dncp_node_s, in_prune_work);
+      list_move_tail(&n->in_prune_work, &visited);
+      dncp_node_for_each_adj(n, adj)
+        if (list_empty(&adj->node->in_prune_work)
+            && now < adj->node->expiration_time)
+          list_add_tail(&adj->node->in_prune_work, &queue);
+    }
+  dncp_for_each_node_including_unreachable(o, n)
+    {
+      bool reachable = n->last_reachable_prune == o->last_prune;
+
+      if (reachable == list_empty(&n->in_prune_work))
+        {
+          L_ERR("reachability mismatch for %s: %s, flood fill disagrees",
+                DNCP_NODE_REPR(n), reachable ? "reachable" : "unreachable");
+          ok = false;
+        }
+    }
+  list_for_each_entry_safe(n, n2, &visited, in_prune_work)
+    list_del_init(&n->in_prune_work);
+  return ok;
+}
+
 /************************************************* Mocked interface - hncp_io */
 
 static void _timeout(struct uloop_timeout *t)
@@ -643,6 +726,12 @@ static void _timeout(struct uloop_timeout *t)
   net_node node = container_of(t, net_node_s, run_to);
   L_DEBUG("%s: dncp_run", node->name);
   dncp_ext_timeout(node->d);
+  if (node->s->check_reachability)
+    {
+      node->s->num_reachability_checks++;
+      sput_fail_unless(net_sim_dncp_reachability_ok(node->d),
+                       "reachability matches full flood fill");
+    }
 }
 
 static void _schedule_timeout(dncp_ext ext, int msecs)
@@ -834,6 +923,9 @@ _send(dncp_ext ext, dncp_ep ep,
   else
     {
       s->sent_unicast++;
+      s->sent_unicast_bytes += len;
+      if (len > s->max_sent_unicast_len)
+        s->max_sent_unicast_len = len;
       s->last_unicast_sent = hnetd_time();
     }
   int sent = 0;
@@ -889,6 +981,11 @@ void hncp_io_uninit(hncp o)
   /* nop */
 }
 
+void hncp_io_ep_uninit(hncp h, dncp_ep ep)
+{
+  /* nop */
+}
+
 bool hncp_io_set_ifname_enabled(hncp h, const char *ifname, bool enabled)
 {
   /* Yeah, sure.. */
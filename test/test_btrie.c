@@ -22,7 +22,7 @@ static int malloc_fails = 0;
 static int malloc_called = 0;
 void *test_malloc(size_t size)
 {
-	malloc_called = 1;
+	malloc_called++;
 
 	if(malloc_fails)
 		return NULL;
@@ -39,6 +39,7 @@ void *test_malloc(size_t size)
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <time.h>
 
 #if BTRIE_KEY == 8
 #define key_hex_repr "%02x"
@@ -121,6 +122,54 @@ static uint64_t test_count_space(struct btrie *root, const pkey_t *contain_key,
 	return ctr;
 }
 
+static int test_key_equal(const pkey_t *k1, const pkey_t *k2, plen_t len)
+{
+	plen_t i;
+	for(i = 0; i < len; i++)
+		if(!nthbit(ntohk(k1[index(i)]), remain(i)) != !nthbit(ntohk(k2[index(i)]), remain(i)))
+			return 0;
+	return 1;
+}
+
+/* Compares available prefixes counting and picking with iteration. */
+static void test_check_available_summary(struct btrie *root, const pkey_t *contain_key, plen_t contain_len)
+{
+	struct btrie *n;
+	uint32_t count[BTRIE_AVAIL_PLEN + 1], count2[BTRIE_AVAIL_PLEN + 1];
+	pkey_t iter_key[256 / BTRIE_KEY], key[256 / BTRIE_KEY];
+	plen_t iter_len, len, target_len;
+	uint64_t base = 0, i, nth;
+	int checks = 0;
+
+	memset(count2, 0, sizeof(count2));
+	btrie_for_each_available(root, n, iter_key, &iter_len, contain_key, contain_len) {
+		if(iter_len <= BTRIE_AVAIL_PLEN)
+			count2[iter_len]++;
+	}
+	btrie_available_count(root, contain_key, contain_len, count, BTRIE_AVAIL_PLEN);
+	if(memcmp(count, count2, sizeof(count)))
+		sput_fail_if(1, "Invalid available count");
+
+	target_len = (contain_len + 40 > BTRIE_AVAIL_PLEN)?BTRIE_AVAIL_PLEN:contain_len + 40;
+	btrie_for_each_available(root, n, iter_key, &iter_len, contain_key, contain_len) {
+		if(iter_len > target_len)
+			continue;
+		for(i = 0; i < 2 && checks < 50; i++, checks++) {
+			nth = base + (i?((1ull << (target_len - iter_len)) - 1):0);
+			if(btrie_available_nth(root, key, &len, contain_key, contain_len,
+					0, target_len, target_len, &nth) ||
+					len != iter_len || !test_key_equal(key, iter_key, len) ||
+					nth != (i?((1ull << (target_len - iter_len)) - 1):0))
+				sput_fail_if(1, "Invalid nth available");
+		}
+		base += 1ull << (target_len - iter_len);
+	}
+	nth = base;
+	if(!btrie_available_nth(root, key, &len, contain_key, contain_len,
+			0, target_len, target_len, &nth) || nth)
+		sput_fail_if(1, "Nth available out of range");
+}
+
 void test_print_key(const pkey_t *k, uint8_t bitlen)
 {
 	if(!bitlen) {
@@ -277,6 +326,81 @@ void test_btrie()
 	sput_fail_if(t.child[1], "Only root");
 }
 
+static size_t test_slab_count(unsigned int *used)
+{
+	struct btrie_slab *slab;
+	size_t n = 0;
+	*used = 0;
+	list_for_each_entry(slab, &btrie_slabs, le) {
+		n++;
+		*used += slab->used;
+	}
+	return n;
+}
+
+#define SLAB_CHURN_KEYS (8 * BTRIE_SLAB_NODES)
+#define SLAB_CHURN_ROUNDS 4
+
+/* Nodes are taken from and given back to slabs shared by all tries. Churn
+ * enough of them to allocate, release and reuse whole slabs. */
+void test_btrie_slab()
+{
+	struct btrie t;
+	struct btrie_element e[SLAB_CHURN_KEYS];
+	uint32_t keys[SLAB_CHURN_KEYS][4];
+	struct btrie_slab *slab;
+	unsigned int used;
+	int i, j, round;
+
+	//Only the last slab with free nodes is kept once all nodes are freed
+	btrie_init(&t);
+	sput_fail_unless(test_slab_count(&used) <= 1 && !used, "No node in use");
+
+	memset(keys, 0, sizeof(keys));
+	for(i = 0; i < SLAB_CHURN_KEYS; i++)
+		keys[i][0] = htonl(0x20010db8);
+	for(round = 0; round < SLAB_CHURN_ROUNDS; round++) {
+		malloc_called = 0;
+		for(i = 0; i < SLAB_CHURN_KEYS; i++) {
+			keys[i][1] = htonl((round << 16) | (i * 2654435761U >> 16));
+			sput_fail_if(btrie_add(&t, &e[i], (btrie_key_t *)keys[i], 64), "Adding element");
+		}
+		btrie_check(&t);
+		sput_fail_unless(test_count_down(&t, NULL, 0) == SLAB_CHURN_KEYS, "All elements");
+		sput_fail_unless(malloc_called >= SLAB_CHURN_KEYS / BTRIE_SLAB_NODES - 1, "Slabs allocated");
+		list_for_each_entry(slab, &btrie_slabs, le)
+			sput_fail_unless(slab->free && slab->used < BTRIE_SLAB_NODES, "Listed slab has free nodes");
+
+		//Remove in another order than they were added, spreading frees over slabs
+		for(i = 0; i < SLAB_CHURN_KEYS; i++) {
+			j = (i * 7) % SLAB_CHURN_KEYS;
+			btrie_remove(&e[j]);
+			if(!(i % BTRIE_SLAB_NODES)) {
+				btrie_check(&t);
+				list_for_each_entry(slab, &btrie_slabs, le)
+					sput_fail_unless(slab->used || slab->le.next == &btrie_slabs,
+							"Empty slab released unless it is the only one");
+			}
+		}
+		sput_fail_unless(!t.child[0] && !t.child[1], "Only root");
+		sput_fail_unless(test_slab_count(&used) == 1 && !used, "Single empty slab kept");
+	}
+
+	//Kept slab is reused without allocating
+	malloc_called = 0;
+	malloc_fails = 1;
+	sput_fail_if(btrie_add(&t, &e[0], (btrie_key_t *)keys[0], 64), "Adding element from kept slab");
+	sput_fail_if(malloc_called, "No allocation");
+	for(i = 1; i < SLAB_CHURN_KEYS && !btrie_add(&t, &e[i], (btrie_key_t *)keys[i], 64); i++);
+	sput_fail_unless(i < SLAB_CHURN_KEYS && malloc_called, "Allocation failure once slab is full");
+	malloc_fails = 0;
+	btrie_check(&t);
+	while(i--)
+		btrie_remove(&e[i]);
+	sput_fail_unless(!t.child[0] && !t.child[1], "Only root");
+	sput_fail_unless(test_slab_count(&used) == 1 && !used, "Single empty slab kept");
+}
+
 struct btrie_entry {
 	struct btrie_element e;
 	int id;
@@ -330,6 +454,8 @@ void test_btrie_stress_push(struct btrie *root, void *str, void *check, uint8_t
 
 		; //Just execute, looking for faults
 		test_count_available(root, str, 0, key); //Just execute, looking for faults
+		test_check_available_summary(root, str, 0);
+		test_check_available_summary(root, str, bitlen);
 		if(test_count_space(root, str, 0, key, 63) != btrie_available_space(root, str, 0, 63)) {
 			sput_fail_if(1, "Invalid space count");
 		}
@@ -395,6 +521,8 @@ void test_btrie_stress_pull(struct btrie *root, void *str, uint8_t diversity, in
 		if(entry->id == id) {
 			btrie_remove(&entry->e);
 			free(entry);
+			if(!(id % 10))
+				test_check_available_summary(root, str, 0);
 			return;
 		}
 	}
@@ -437,6 +565,84 @@ void test_btrie_stress()
 	sput_fail_if(t.child[1], "Only root");
 }
 
+/* Lookup and update cost with a set of IPv6 /64 and /128 prefixes. */
+#define PERF_KEYS 50000
+#define PERF_LOOKUPS 400000
+
+static int64_t test_perf_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void test_btrie_perf()
+{
+	static uint32_t keys[PERF_KEYS][4];
+	static uint8_t lens[PERF_KEYS];
+	static struct btrie_element e[PERF_KEYS];
+	struct btrie t, *n;
+	struct btrie_element *el;
+	btrie_plen_t match_len;
+	uint8_t *k;
+	int64_t start, add, updown, longest, removal;
+	int i, found = 0, matched = 0;
+
+	srand(1);
+	memset(keys, 0, sizeof(keys));
+	for(i = 0; i < PERF_KEYS; i++) {
+		k = (uint8_t *)keys[i];
+		k[0] = 0x20; k[1] = 0x01; k[2] = 0x0d; k[3] = 0xb8;
+		k[4] = rand() % 4; k[5] = rand(); k[6] = rand(); k[7] = rand();
+		if(i % 3) {
+			lens[i] = 64;
+		} else {
+			int j;
+			for(j = 8; j < 16; j++)
+				k[j] = rand();
+			lens[i] = 128;
+		}
+	}
+
+	btrie_init(&t);
+	start = test_perf_ns();
+	for(i = 0; i < PERF_KEYS; i++)
+		btrie_add(&t, &e[i], (btrie_key_t *)keys[i], lens[i]);
+	add = test_perf_ns() - start;
+
+	start = test_perf_ns();
+	for(i = 0; i < PERF_LOOKUPS; i++) {
+		int j = (unsigned int)i * 7919 % PERF_KEYS;
+		btrie_for_each_updown(el, &t, (btrie_key_t *)keys[j], lens[j])
+			if(el == &e[j])
+				found++;
+	}
+	updown = test_perf_ns() - start;
+	sput_fail_unless(found == PERF_LOOKUPS, "All elements found");
+
+	start = test_perf_ns();
+	for(i = 0; i < PERF_LOOKUPS; i++) {
+		int j = (unsigned int)i * 104729 % PERF_KEYS;
+		n = btrie_longest_match(&t, (btrie_key_t *)keys[j], 128, &match_len);
+		if(n && match_len >= lens[j])
+			matched++;
+	}
+	longest = test_perf_ns() - start;
+	sput_fail_unless(matched == PERF_LOOKUPS, "All keys matched");
+
+	start = test_perf_ns();
+	for(i = 0; i < PERF_KEYS; i++)
+		btrie_remove(&e[(i * 7) % PERF_KEYS]);
+	removal = test_perf_ns() - start;
+	sput_fail_unless(!t.child[0] && !t.child[1], "Only root");
+
+	printf("btrie with %d prefixes: add %lld ns, updown %lld ns, longest match %lld ns, remove %lld ns\n",
+			PERF_KEYS, (long long)(add / PERF_KEYS),
+			(long long)(updown / PERF_LOOKUPS),
+			(long long)(longest / PERF_LOOKUPS),
+			(long long)(removal / PERF_KEYS));
+}
+
 #ifdef BTRIE_KEY_NETWORK_BYTE_ORDER
 
 #include "prefixes_library.h"
@@ -738,6 +944,38 @@ static void test_btrie_available()
 	}
 }
 
+#define BTRIE_SUMMARY_SIZE 200
+
+static void test_btrie_available_summary()
+{
+	struct btrie t;
+	struct btrie_element e[BTRIE_SUMMARY_SIZE];
+	pkey_t key[4];
+	int i, j;
+
+	srand(1);
+	btrie_init(&t);
+	memset(key, 0, sizeof(key));
+	test_check_available_summary(&t, key, 0);
+	for(i = 0; i < BTRIE_SUMMARY_SIZE; i++) {
+		key[0] = rand();
+		key[1] = rand();
+		btrie_add(&t, &e[i], key, 8 + rand() % 40);
+		if(!(i % 10))
+			for(j = 0; j < 12; j += 3)
+				test_check_available_summary(&t, key, j);
+	}
+	for(i = 0; i < BTRIE_SUMMARY_SIZE; i += 2) {
+		btrie_remove(&e[i]);
+		if(!(i % 10))
+			for(j = 0; j < 12; j += 3)
+				test_check_available_summary(&t, key, j);
+	}
+	for(i = 1; i < BTRIE_SUMMARY_SIZE; i += 2)
+		btrie_remove(&e[i]);
+	sput_fail_unless(btrie_available_space(&t, NULL, 0, 4 * BTRIE_KEY) == BTRIE_AVAILABLE_ALL, "Everything is available");
+}
+
 #ifdef BTRIE_KEY_NETWORK_BYTE_ORDER
 void test_btrie_available_list(struct btrie *root)
 {
@@ -770,14 +1008,17 @@ int main( __unused int argc,  __unused char **argv)
   sput_start_testing();
   sput_enter_suite("Test btrie"); /* optional */
   sput_run_test(test_btrie);
+  sput_run_test(test_btrie_slab);
   sput_run_test(test_btrie_stress);
 #ifdef BTRIE_KEY_NETWORK_BYTE_ORDER
   sput_run_test(test_btrie_prefix);
 #endif
   sput_run_test(test_btrie_available);
+  sput_run_test(test_btrie_available_summary);
 #ifdef BTRIE_KEY_NETWORK_BYTE_ORDER
   sput_run_test(test_btrie_available_prefix);
 #endif
+  sput_run_test(test_btrie_perf);
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -13,6 +13,7 @@
 
 #include "hncp_i.h"
 #include "hncp_proto.h"
+#include "dncp_snapshot.h"
 #include "sput.h"
 #include "smock.h"
 #include "platform.h"
@@ -206,6 +207,583 @@ void hncp_int(void)
   hncp_uninit(&s);
 }
 
+/* TLV change notifications; subscribers with tlv_types should see
+ * changes of only those types, and removals before additions. */
+static const uint16_t _sub_types[] = { 124, 0 };
+static int _sub_calls[2][2];
+static uint16_t _sub_last[2];
+
+static void _sub_cb(dncp_subscriber s, dncp_node n,
+                    struct tlv_attr *tlv, bool add)
+{
+  int typed = s->tlv_types != NULL;
+
+  _sub_calls[typed][add]++;
+  if (!add)
+    sput_fail_unless(!_sub_last[typed], "no add before remove");
+  _sub_last[typed] = add ? tlv_id(tlv) : 0;
+}
+
+static void _sub_set(dncp_node n, int type1, int type2)
+{
+  struct tlv_buf tb;
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  tlv_new(&tb, type1, 0);
+  tlv_new(&tb, type2, 0);
+  dncp_node_set(n, n->update_number + 1, hnetd_time(), tlv_memdup(tb.head));
+  tlv_buf_free(&tb);
+}
+
+void hncp_tlv_subscribe(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  dncp_node_id_s ni;
+  dncp_subscriber_s sub_all = { .tlv_change_cb = _sub_cb };
+  dncp_subscriber_s sub_typed = { .tlv_change_cb = _sub_cb,
+                                  .tlv_types = _sub_types };
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  dncp_subscribe(o, &sub_all);
+  dncp_subscribe(o, &sub_typed);
+  memset(&ni, 0, sizeof(ni));
+  n = dncp_find_node_by_node_id(o, &ni, true);
+  n->last_reachable_prune = o->last_prune;
+
+  _sub_set(n, 123, 124);
+  sput_fail_unless(_sub_calls[0][true] == 2, "all: 2 adds");
+  sput_fail_unless(_sub_calls[1][true] == 1, "typed: 1 add");
+  sput_fail_unless(_sub_last[1] == 124, "typed: right type");
+
+  memset(_sub_last, 0, sizeof(_sub_last));
+  _sub_set(n, 124, 125);
+  sput_fail_unless(_sub_calls[0][false] == 1 && _sub_calls[0][true] == 3,
+                   "all: 123 removed, 125 added");
+  sput_fail_unless(_sub_calls[1][false] == 0 && _sub_calls[1][true] == 1,
+                   "typed: no change");
+
+  memset(_sub_last, 0, sizeof(_sub_last));
+  _sub_set(n, 123, 125);
+  sput_fail_unless(_sub_calls[1][false] == 1, "typed: 124 removed");
+
+  memset(_sub_last, 0, sizeof(_sub_last));
+  dncp_unsubscribe(o, &sub_typed);
+  dncp_unsubscribe(o, &sub_all);
+  sput_fail_unless(_sub_calls[0][false] == _sub_calls[0][true],
+                   "all: everything removed");
+  sput_fail_unless(_sub_calls[1][false] == _sub_calls[1][true],
+                   "typed: everything removed");
+  hncp_uninit(&s);
+}
+
+/* Node data used in place within received message buffer; the
+ * buffer is released (to the free list) once no node refers to it. */
+void hncp_rbuf(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  dncp_node_id_s ni;
+  struct tlv_buf tb;
+  dncp_rbuf rb, rb2;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  memset(&ni, 0, sizeof(ni));
+  n = dncp_find_node_by_node_id(o, &ni, true);
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  tlv_new(&tb, 123, 0);
+  rb = dncp_rbuf_copy(o, tb.head);
+  sput_fail_unless(rb && rb->refcount == 1, "dncp_rbuf_copy");
+  rb->refcount++;
+  dncp_node_set_rbuf(n, 1, hnetd_time(), (struct tlv_attr *)rb->buf, rb);
+  sput_fail_unless(n->tlv_container == (struct tlv_attr *)rb->buf,
+                   "node data in place");
+  dncp_rbuf_unref(o, rb);
+  sput_fail_unless(rb->refcount == 1, "node keeps reference");
+
+  /* Same content with new update number => old buffer kept */
+  rb2 = dncp_rbuf_copy(o, tb.head);
+  sput_fail_unless(rb2 && rb2 != rb, "dncp_rbuf_copy 2");
+  dncp_node_set_rbuf(n, 2, hnetd_time(), (struct tlv_attr *)rb2->buf, rb2);
+  sput_fail_unless(n->tlv_container_rbuf == rb, "old buffer kept");
+  sput_fail_unless(o->rbuf_free[rb2->size_class] == rb2, "new one freed");
+
+  dncp_node_set(n, 3, hnetd_time(), NULL);
+  sput_fail_unless(o->rbuf_free[rb->size_class] == rb, "old one freed");
+  rb2 = dncp_rbuf_copy(o, tb.head);
+  sput_fail_unless(rb2 == rb, "buffer reused from free list");
+  dncp_rbuf_unref(o, rb2);
+  tlv_buf_free(&tb);
+  hncp_uninit(&s);
+}
+
+/* Network state messages of one generation share the same body, and
+ * are sent with one send_batch call. */
+static int _sent;
+static void *_sent_body;
+static ep_id_t _sent_ep_ids[2];
+
+static void _send_batch(dncp_ext e, dncp_ext_send msgs, int count)
+{
+  int i;
+
+  for (i = 0 ; i < count ; i++)
+    {
+      struct tlv_attr *a = msgs[i].iov[0].iov_base;
+      dncp_t_ep_id lid = tlv_data(a) + HNCP_NI_LEN;
+
+      sput_fail_unless(msgs[i].iov_len == 2, "prefix + body");
+      sput_fail_unless(tlv_id(a) == DNCP_T_ENDPOINT_ID, "ep id first");
+      if (_sent < 2)
+        _sent_ep_ids[_sent] = lid->ep_id;
+      if (!_sent_body)
+        _sent_body = msgs[i].iov[1].iov_base;
+      sput_fail_unless(_sent_body == msgs[i].iov[1].iov_base, "same body");
+      _sent++;
+    }
+}
+
+void hncp_network_state_body(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_ep_i l1, l2;
+  dncp_node n;
+  dncp_node_id_s ni;
+  uint32_t generation;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  o->ext->cb.send_batch = _send_batch;
+  l1 = container_of(dncp_find_ep_by_name(o, "eth0"), dncp_ep_i_s, conf);
+  l2 = container_of(dncp_find_ep_by_name(o, "eth1"), dncp_ep_i_s, conf);
+  o->now = hnetd_time();
+
+  o->queue_sends = true;
+  dncp_ep_i_send_network_state(l1, NULL, NULL, 0, false);
+  generation = o->network_state_body_generation;
+  dncp_ep_i_send_network_state(l2, NULL, NULL, 0, false);
+  sput_fail_unless(o->network_state_body_generation == generation,
+                   "body reused");
+  sput_fail_unless(o->num_pending_sends == 2, "sends queued");
+  sput_fail_unless(_sent == 0, "nothing sent yet");
+  dncp_flush_sends(o);
+  sput_fail_unless(_sent == 2, "both sent at once");
+  sput_fail_unless(_sent_ep_ids[0] == l1->ep_id
+                   && _sent_ep_ids[1] == l2->ep_id, "endpoint ids");
+
+  /* Node change => new generation */
+  memset(&ni, 0, sizeof(ni));
+  n = dncp_find_node_by_node_id(o, &ni, true);
+  dncp_node_set(n, 1, hnetd_time(), NULL);
+  dncp_ep_i_send_network_state(l1, NULL, NULL, 0, false);
+  sput_fail_unless(o->network_state_body_generation != generation,
+                   "body rebuilt");
+  o->queue_sends = false;
+  dncp_flush_sends(o);
+  sput_fail_unless(_sent == 3, "sent");
+  o->now = 0;
+  hncp_uninit(&s);
+}
+
+/* Node state replies are served from per-node cache, which is
+ * invalidated when the node is set. */
+static struct tlv_buf _req_tb;
+static struct sockaddr_in6 _req_src, _req_dst;
+static bool _req_pending;
+static struct tlv_buf _reply_tb;
+
+static ssize_t _recv_req(dncp_ext e, dncp_ep *ep,
+                         struct sockaddr_in6 **src,
+                         struct sockaddr_in6 **dst,
+                         int *flags,
+                         void *buf, size_t buf_len)
+{
+  dncp o = container_of(e, hncp_s, ext)->dncp;
+
+  if (!_req_pending)
+    return -1;
+  _req_pending = false;
+  *ep = dncp_find_ep_by_name(o, "eth0");
+  *src = &_req_src;
+  *dst = &_req_dst;
+  *flags = DNCP_RECV_FLAG_SRC_LINKLOCAL | DNCP_RECV_FLAG_DST_LINKLOCAL;
+  memcpy(buf, tlv_data(_req_tb.head), tlv_len(_req_tb.head));
+  return tlv_len(_req_tb.head);
+}
+
+static void _send_reply(dncp_ext e, dncp_ep ep,
+                        struct sockaddr_in6 *src,
+                        struct sockaddr_in6 *dst,
+                        void *buf, size_t buf_len)
+{
+  tlv_buf_free(&_reply_tb);
+  tlv_buf_init(&_reply_tb, 0);
+  tlv_put_raw(&_reply_tb, buf, buf_len);
+}
+
+static struct tlv_attr *_request_node_state(dncp o, dncp_node n)
+{
+  struct tlv_attr *a;
+
+  _req_pending = true;
+  dncp_ext_readable(o);
+  tlv_for_each_attr(a, _reply_tb.head)
+    if (tlv_id(a) == DNCP_T_NODE_STATE
+        && !memcmp(tlv_data(a), &n->node_id, DNCP_NI_LEN(o)))
+      return a;
+  return NULL;
+}
+
+void hncp_node_state_cache(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  struct tlv_attr *a, *cache;
+  char buf[32];
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  o->ext->cb.recv = _recv_req;
+  o->ext->cb.recv_batch = NULL;
+  o->ext->cb.send = _send_reply;
+  dncp_ext_ep_ready(dncp_find_ep_by_name(o, "eth0"), true);
+  n = o->own_node;
+  memset(buf, 42, sizeof(buf));
+  sput_fail_unless(dncp_add_tlv(o, 123, buf, sizeof(buf), 0), "add tlv");
+  dncp_self_flush(n);
+
+  memset(&_req_tb, 0, sizeof(_req_tb));
+  memset(&_reply_tb, 0, sizeof(_reply_tb));
+  tlv_buf_init(&_req_tb, 0);
+  a = tlv_new(&_req_tb, DNCP_T_REQ_NODE_STATE, DNCP_NI_LEN(o));
+  memcpy(tlv_data(a), &n->node_id, DNCP_NI_LEN(o));
+  sockaddr_in6_set(&_req_src, NULL, HNCP_PORT);
+  _req_src.sin6_addr.s6_addr[0] = 0xfe;
+  _req_src.sin6_addr.s6_addr[1] = 0x80;
+  _req_dst = _req_src;
+  _req_src.sin6_addr.s6_addr[15] = 2;
+  _req_dst.sin6_addr.s6_addr[15] = 1;
+
+  a = _request_node_state(o, n);
+  sput_fail_unless(a, "node state replied");
+  cache = n->node_state_cache;
+  sput_fail_unless(cache, "reply cached");
+  sput_fail_unless(a && tlv_len(a) > DNCP_NI_LEN(o)
+                   + sizeof(dncp_t_node_state_s) + DNCP_HASH_LEN(o),
+                   "reply includes node data");
+
+  a = _request_node_state(o, n);
+  sput_fail_unless(a, "node state replied again");
+  sput_fail_unless(n->node_state_cache == cache, "cache reused");
+  sput_fail_unless(a && tlv_attr_equal(a, cache), "reply matches cache");
+
+  /* Changing node data invalidates the cache */
+  dncp_remove_tlv_matching(o, 123, buf, sizeof(buf));
+  dncp_self_flush(n);
+  sput_fail_unless(!n->node_state_cache, "cache invalidated");
+  a = _request_node_state(o, n);
+  sput_fail_unless(a && n->node_state_cache, "new reply cached");
+  sput_fail_unless(a && tlv_attr_equal(a, n->node_state_cache),
+                   "new reply matches cache");
+  sput_fail_unless(a && tlv_len(a) == DNCP_NI_LEN(o)
+                   + sizeof(dncp_t_node_state_s) + DNCP_HASH_LEN(o)
+                   + tlv_len(n->tlv_container), "new reply size");
+
+  tlv_buf_free(&_req_tb);
+  tlv_buf_free(&_reply_tb);
+  hncp_uninit(&s);
+}
+
+static bool _reply_has(unsigned int type)
+{
+  struct tlv_attr *a;
+
+  tlv_for_each_attr(a, _reply_tb.head)
+    if (tlv_id(a) == type)
+      return true;
+  return false;
+}
+
+static hnetd_time_t _fake_now;
+
+static hnetd_time_t _fake_get_time(dncp_ext e)
+{
+  return _fake_now;
+}
+
+/* Let delay pass (and timeouts run), then receive _req_tb. */
+static void _request_later(dncp o, hnetd_time_t delay)
+{
+  _fake_now += delay;
+  dncp_ext_timeout(o);
+  _req_pending = true;
+  dncp_ext_readable(o);
+}
+
+/* Bulk state is requested until we have been in sync with a neighbor
+ * (restored nodes do not count), and sent to the same neighbor at
+ * most once per DNCP_BULK_STATE_MIN_INTERVAL. */
+void hncp_bulk_state(void)
+{
+  hnetd_time_t step = HNETD_TIME_PER_SECOND / 10;
+  hncp_s s;
+  dncp o;
+  dncp_ep ep;
+  dncp_node n;
+  dncp_node_id_s ni;
+  dncp_t_ep_id lid;
+  struct tlv_attr *a, *hash;
+  struct tlv_buf tb;
+  char buf[32];
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  _fake_now = hnetd_time();
+  o->ext->cb.get_time = _fake_get_time;
+  o->ext->cb.recv = _recv_req;
+  o->ext->cb.recv_batch = NULL;
+  o->ext->cb.send = _send_reply;
+  o->ext->cb.send_batch = NULL;
+  ep = dncp_find_ep_by_name(o, "eth0");
+  ep->bulk_initial_sync = true;
+  dncp_ext_ep_ready(ep, true);
+
+  /* Known (e.g. from a snapshot), but not reachable peer. */
+  memset(buf, 42, sizeof(buf));
+  memset(&ni, 1, sizeof(ni));
+  n = dncp_find_node_by_node_id(o, &ni, true);
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  tlv_put(&tb, 124, buf, sizeof(buf));
+  dncp_node_set(n, 42, _fake_now, tlv_memdup(tb.head));
+  tlv_buf_free(&tb);
+
+  memset(&_req_tb, 0, sizeof(_req_tb));
+  memset(&_reply_tb, 0, sizeof(_reply_tb));
+  tlv_buf_init(&_req_tb, 0);
+  a = tlv_new(&_req_tb, DNCP_T_ENDPOINT_ID, HNCP_NI_LEN + sizeof(*lid));
+  memcpy(tlv_data(a), &ni, HNCP_NI_LEN);
+  lid = tlv_data(a) + HNCP_NI_LEN;
+  lid->ep_id = 1;
+  hash = tlv_new(&_req_tb, DNCP_T_NET_STATE, HNCP_HASH_LEN);
+  memset(tlv_data(hash), 0, HNCP_HASH_LEN);
+  sockaddr_in6_set(&_req_src, NULL, HNCP_PORT);
+  _req_src.sin6_addr.s6_addr[0] = 0xfe;
+  _req_src.sin6_addr.s6_addr[1] = 0x80;
+  _req_dst = _req_src;
+  _req_src.sin6_addr.s6_addr[15] = 2;
+  _req_dst.sin6_addr.s6_addr[15] = 1;
+
+  _request_later(o, step);
+  sput_fail_unless(_reply_has(DNCP_T_REQ_BULK_STATE),
+                   "bulk requested despite known nodes");
+  sput_fail_unless(dncp_find_neighbor(o, &ni, 1, dncp_ep_get_id(ep)),
+                   "neighbor added");
+
+  tlv_new(&_req_tb, DNCP_T_REQ_NET_STATE, 0);
+  tlv_new(&_req_tb, DNCP_T_REQ_BULK_STATE, 0);
+  _request_later(o, step);
+  sput_fail_unless(o->num_bulk_state_sent == 1, "bulk state sent");
+  sput_fail_unless(_reply_has(DNCP_T_NODE_STATE), "bulk state reply");
+
+  _request_later(o, step);
+  sput_fail_unless(!o->graph_dirty, "reachability known");
+  sput_fail_unless(o->num_bulk_state_sent == 1, "bulk state not sent again");
+  sput_fail_unless(_reply_has(DNCP_T_NET_STATE), "network state reply");
+
+  _request_later(o, DNCP_BULK_STATE_MIN_INTERVAL);
+  sput_fail_unless(o->num_bulk_state_sent == 2, "bulk state sent later");
+
+  sput_fail_unless(!o->network_state_synced, "not in sync");
+  dncp_calculate_network_hash(o);
+  memcpy(tlv_data(hash), &o->network_hash, HNCP_HASH_LEN);
+  _request_later(o, step);
+  sput_fail_unless(o->network_state_synced, "in sync");
+
+  tlv_buf_free(&_req_tb);
+  tlv_buf_free(&_reply_tb);
+  hncp_uninit(&s);
+}
+
+void hncp_ep_ifindex(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_ep ep1, ep2;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  ep1 = dncp_find_ep_by_name(o, "eth0");
+  ep2 = dncp_find_ep_by_name(o, "eth1");
+  sput_fail_unless(!dncp_find_ep_by_ifindex(o, 0), "no ifindex 0");
+  sput_fail_unless(!dncp_find_ep_by_ifindex(o, 3), "unknown ifindex");
+  sput_fail_unless(dncp_ep_set_ifindex(ep1, 3), "set ifindex 3");
+  sput_fail_unless(dncp_ep_set_ifindex(ep2, 1000), "set ifindex 1000");
+  sput_fail_unless(dncp_find_ep_by_ifindex(o, 3) == ep1, "ep1 by ifindex");
+  sput_fail_unless(dncp_find_ep_by_ifindex(o, 1000) == ep2, "ep2 by ifindex");
+  sput_fail_unless(dncp_ep_get_ifindex(ep1) == 3, "ep1 ifindex");
+
+  /* Index moves from one endpoint to another */
+  dncp_ep_set_ifindex(ep2, 3);
+  sput_fail_unless(dncp_find_ep_by_ifindex(o, 3) == ep2, "ep2 took over");
+  sput_fail_unless(!dncp_find_ep_by_ifindex(o, 1000), "old index gone");
+  sput_fail_unless(!dncp_ep_get_ifindex(ep1), "ep1 lost ifindex");
+
+  /* Endpoint removal clears the mapping */
+  vlist_flush_all(&o->eps);
+  sput_fail_unless(!dncp_find_ep_by_ifindex(o, 3), "removed ep gone");
+  hncp_uninit(&s);
+}
+
+/* Network hash maintenance cost per single node update, as function
+ * of the number of (reachable) nodes. */
+#define NETWORK_HASH_PERF_UPDATES 1000
+
+static int64_t _perf_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void _network_hash_perf(dncp o, int num_nodes)
+{
+  dncp_node n;
+  dncp_node_id_s ni;
+  dncp_hash_s h;
+  int i;
+
+  memset(&ni, 0, sizeof(ni));
+  for (i = 1 ; i < num_nodes ; i++)
+    {
+      *((uint32_t *)&ni) = cpu_to_be32(i);
+      n = dncp_find_node_by_node_id(o, &ni, true);
+      if (!n->update_number)
+        dncp_node_set(n, 1, hnetd_time(), NULL);
+    }
+  /* Pretend the prune already found all of them reachable. */
+  o->last_prune++;
+  dncp_for_each_node_including_unreachable(o, n)
+    n->last_reachable_prune = o->last_prune;
+  o->network_hash_layout_dirty = true;
+  o->network_hash_dirty = true;
+  dncp_calculate_network_hash(o);
+  sput_fail_unless(o->network_hash_buf_count == num_nodes, "all nodes hashed");
+
+  int64_t start = _perf_ns();
+  n = dncp_get_first_node(o);
+  for (i = 0 ; i < NETWORK_HASH_PERF_UPDATES ; i++)
+    {
+      dncp_node_set(n, n->update_number + 1, 0, NULL);
+      dncp_calculate_network_hash(o);
+      if (!(n = dncp_node_get_next(n)))
+        n = dncp_get_first_node(o);
+    }
+  int64_t incremental = _perf_ns() - start;
+
+  /* The result has to match what recalculation from scratch yields. */
+  h = o->network_hash;
+  start = _perf_ns();
+  for (i = 0 ; i < NETWORK_HASH_PERF_UPDATES ; i++)
+    {
+      o->network_hash_layout_dirty = true;
+      o->network_hash_dirty = true;
+      dncp_calculate_network_hash(o);
+    }
+  int64_t full = _perf_ns() - start;
+  sput_fail_unless(memcmp(&h, &o->network_hash, DNCP_HASH_LEN(o)) == 0,
+                   "incremental network hash matches full one");
+
+  L_NOTICE("network hash with %d nodes: %lld ns/update (full: %lld ns)",
+           num_nodes,
+           (long long)(incremental / NETWORK_HASH_PERF_UPDATES),
+           (long long)(full / NETWORK_HASH_PERF_UPDATES));
+}
+
+/* Node lookup throughput; hash index (dncp_find_node_by_node_id)
+ * against the ordered AVL tree it used to search. */
+#define NODE_LOOKUP_PERF_NODES 10000
+#define NODE_LOOKUP_PERF_LOOKUPS 1000000
+
+void hncp_node_lookup_perf(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  dncp_node_id_s ni;
+  dncp_node_s fake_node;
+  int i, found;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  memset(&ni, 0, sizeof(ni));
+  for (i = 1 ; i < NODE_LOOKUP_PERF_NODES ; i++)
+    {
+      *((uint32_t *)&ni) = cpu_to_be32(i * 2654435761U);
+      dncp_find_node_by_node_id(o, &ni, true);
+    }
+  sput_fail_unless(o->nodes.avl.count == NODE_LOOKUP_PERF_NODES,
+                   "nodes created");
+
+  found = 0;
+  int64_t start = _perf_ns();
+  for (i = 0 ; i < NODE_LOOKUP_PERF_LOOKUPS ; i++)
+    {
+      *((uint32_t *)&ni) =
+        cpu_to_be32((1 + i % NODE_LOOKUP_PERF_NODES) * 2654435761U);
+      if (dncp_find_node_by_node_id(o, &ni, false))
+        found++;
+    }
+  int64_t hashed = _perf_ns() - start;
+  sput_fail_unless(found == NODE_LOOKUP_PERF_LOOKUPS
+                   - NODE_LOOKUP_PERF_LOOKUPS / NODE_LOOKUP_PERF_NODES,
+                   "all existing nodes found");
+
+  memset(&fake_node, 0, sizeof(fake_node));
+  fake_node.dncp = o;
+  found = 0;
+  start = _perf_ns();
+  for (i = 0 ; i < NODE_LOOKUP_PERF_LOOKUPS ; i++)
+    {
+      *((uint32_t *)&fake_node.node_id) =
+        cpu_to_be32((1 + i % NODE_LOOKUP_PERF_NODES) * 2654435761U);
+      n = vlist_find(&o->nodes, &fake_node, &fake_node, in_nodes);
+      if (n)
+        found++;
+    }
+  int64_t tree = _perf_ns() - start;
+  sput_fail_unless(found == NODE_LOOKUP_PERF_LOOKUPS
+                   - NODE_LOOKUP_PERF_LOOKUPS / NODE_LOOKUP_PERF_NODES,
+                   "all existing nodes found in tree");
+
+  L_NOTICE("node lookup with %d nodes: %.1f Mlookups/s (avl: %.1f)",
+           NODE_LOOKUP_PERF_NODES,
+           NODE_LOOKUP_PERF_LOOKUPS * 1000.0 / hashed,
+           NODE_LOOKUP_PERF_LOOKUPS * 1000.0 / tree);
+  hncp_uninit(&s);
+}
+
+void hncp_network_hash_perf(void)
+{
+  hncp_s s;
+
+  hncp_init(&s);
+  _network_hash_perf(hncp_get_dncp(&s), 100);
+  _network_hash_perf(hncp_get_dncp(&s), 1000);
+  _network_hash_perf(hncp_get_dncp(&s), 10000);
+  hncp_uninit(&s);
+}
+
 void hncp_hash(void)
 {
   /*
@@ -230,6 +808,123 @@ void hncp_hash(void)
   hncp_uninit(&s);
 }
 
+/* Own node data is spliced incrementally; it must still match the
+ * sorted serialization of all local TLVs. */
+void hncp_tlvs_incremental(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_tlv t, tlvs[64];
+  struct tlv_buf tb;
+  int i, j;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  memset(tlvs, 0, sizeof(tlvs));
+  srandom(42);
+  for (i = 0; i < 1000; i++)
+    {
+      j = random() % 64;
+      if (tlvs[j])
+        {
+          dncp_remove_tlv(o, tlvs[j]);
+          tlvs[j] = NULL;
+        }
+      else
+        {
+          unsigned char v[4] = { j, random(), random(), random() };
+
+          tlvs[j] = dncp_add_tlv(o, 100 + j % 3, v, 1 + j % 4, 0);
+        }
+      if (i % 37)
+        continue;
+      dncp_self_flush(o->own_node);
+      memset(&tb, 0, sizeof(tb));
+      tlv_buf_init(&tb, 0);
+      vlist_for_each_element(&o->tlvs, t, in_tlvs)
+        tlv_put_raw(&tb, &t->tlv, tlv_pad_len(&t->tlv));
+      sput_fail_unless(tlv_attr_equal(tb.head, o->own_node->tlv_container),
+                       "own node data consistent");
+      tlv_buf_free(&tb);
+    }
+  hncp_uninit(&s);
+}
+
+/* Saved node database is restored on warm restart: peers' data and
+ * update numbers as-is, and our own update number is continued. */
+void hncp_snapshot(void)
+{
+  const char *filename = "/tmp/test_hncp_snapshot";
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  dncp_node_id_s ni;
+  dncp_hash_s h;
+  struct tlv_buf tb;
+  dncp_snapshot ds;
+  char buf[32];
+
+  unlink(filename);
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  memset(buf, 42, sizeof(buf));
+  dncp_add_tlv(o, 123, buf, sizeof(buf), 0);
+  dncp_self_flush(o->own_node);
+  dncp_self_flush(o->own_node);
+  o->own_node->update_number = 7;
+
+  memset(&ni, 1, sizeof(ni));
+  n = dncp_find_node_by_node_id(o, &ni, true);
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  tlv_put(&tb, 124, buf, sizeof(buf));
+  dncp_node_set(n, 42, hnetd_time(), tlv_memdup(tb.head));
+  dncp_calculate_node_data_hash(n);
+  h = n->node_data_hash;
+  sput_fail_unless(dncp_snapshot_save(o, filename), "save");
+  hncp_uninit(&s);
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  ds = dncp_snapshot_create(o, filename);
+  sput_fail_unless(ds, "dncp_snapshot_create");
+  n = dncp_find_node_by_node_id(o, &ni, false);
+  sput_fail_unless(n, "peer restored");
+  sput_fail_unless(n && n->update_number == 42, "peer update number");
+  sput_fail_unless(n && tlv_attr_equal(n->tlv_container, tb.head),
+                   "peer data");
+  if (n)
+    dncp_calculate_node_data_hash(n);
+  sput_fail_unless(n && !memcmp(&n->node_data_hash, &h, sizeof(h)),
+                   "peer hash");
+  sput_fail_unless(o->own_node->update_number == 7, "own update number");
+  sput_fail_unless(!o->own_node->tlv_container, "own data not restored");
+  /* Prune before any neighbor is heard keeps the restored data. */
+  dncp_ext_timeout(o);
+  sput_fail_unless(o->num_prune_full > 0, "pruned");
+  n = dncp_find_node_by_node_id(o, &ni, false);
+  sput_fail_unless(n && tlv_attr_equal(n->tlv_container, tb.head),
+                   "peer data survives prune");
+  dncp_self_flush(o->own_node);
+  sput_fail_unless(o->own_node->update_number == 8,
+                   "own update number continued");
+  dncp_snapshot_destroy(ds);
+  hncp_uninit(&s);
+
+  /* Garbage is ignored */
+  FILE *f = fopen(filename, "w");
+  fputs("garbage", f);
+  fclose(f);
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  sput_fail_unless(!dncp_snapshot_load(o, filename), "garbage ignored");
+  sput_fail_unless(o->nodes.avl.count == 1, "only own node");
+  hncp_uninit(&s);
+
+  tlv_buf_free(&tb);
+  unlink(filename);
+}
+
 int main(int argc, char **argv)
 {
   setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
@@ -239,6 +934,16 @@ int main(int argc, char **argv)
   sput_run_test(hncp_hash);
   sput_run_test(hncp_ext);
   sput_run_test(hncp_int);
+  sput_run_test(hncp_tlv_subscribe);
+  sput_run_test(hncp_rbuf);
+  sput_run_test(hncp_network_state_body);
+  sput_run_test(hncp_node_state_cache);
+  sput_run_test(hncp_bulk_state);
+  sput_run_test(hncp_ep_ifindex);
+  sput_run_test(hncp_tlvs_incremental);
+  sput_run_test(hncp_snapshot);
+  sput_run_test(hncp_network_hash_perf);
+  sput_run_test(hncp_node_lookup_perf);
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -43,6 +43,56 @@ void dncp_ext_ep_ready(dncp_ep ep, bool ready)
   smock_pull_bool_is("dncp_ready_value", ready);
 }
 
+uint32_t static_ep_ifindex;
+
+dncp_ep dncp_find_ep_by_ifindex(dncp o, uint32_t ifindex)
+{
+  return ifindex && ifindex == static_ep_ifindex ? &static_ep : NULL;
+}
+
+uint32_t dncp_ep_get_ifindex(dncp_ep ep)
+{
+  return static_ep_ifindex;
+}
+
+bool dncp_ep_set_ifindex(dncp_ep ep, uint32_t ifindex)
+{
+  static_ep_ifindex = ifindex;
+  return true;
+}
+
+dncp_ep dncp_get_first_ep(dncp o)
+{
+  return &static_ep;
+}
+
+dncp_ep dncp_ep_get_next(dncp_ep ep)
+{
+  return NULL;
+}
+
+bool dncp_ep_is_enabled(dncp_ep ep)
+{
+  return true;
+}
+
+hncp_ep_s static_hep;
+
+void *dncp_ep_get_ext_data(dncp_ep ep)
+{
+  return &static_hep;
+}
+
+int stream_peers;
+
+void dncp_ext_ep_peer_state(dncp_ep ep,
+                            struct sockaddr_in6 *local,
+                            struct sockaddr_in6 *remote,
+                            bool connected)
+{
+  stream_peers += connected ? 1 : -1;
+}
+
 void dncp_ext_timeout(dncp o)
 {
   smock_pull("dncp_run");
@@ -50,6 +100,9 @@ void dncp_ext_timeout(dncp o)
 
 int pending_packets = 0;
 
+/* If set, readability just ends the loop (and test reads itself). */
+bool readable_ends_loop = false;
+
 void dncp_ext_readable(dncp o)
 {
   char buf[1024];
@@ -59,6 +112,11 @@ void dncp_ext_readable(dncp o)
   dncp_ep ep;
   int flags;
 
+  if (readable_ends_loop)
+    {
+      uloop_end();
+      return;
+    }
   r = o->ext->cb.recv(o->ext, &ep, &src, &dst, &flags, buf, len);
   smock_pull_int_is("dncp_poll_io_recvfrom", r);
   if (r >= 0)
@@ -133,8 +191,465 @@ static void dncp_io_basic_2()
 
   uloop_run();
 
+  /* Interface index got cached by the send (and used by receive) */
+  sput_fail_unless(static_ep_ifindex == if_nametoindex(ifname),
+                   "ifindex cached");
+
+  hncp_io_uninit(&h1);
+  hncp_io_uninit(&h2);
+}
+
+/* The batched I/O callback fills in endpoint, addresses and flags. */
+static void dncp_io_batch(void)
+{
+  hncp_s h1, h2;
+  dncp_s d1, d2;
+  struct in6_addr a;
+  struct sockaddr_in6 dst;
+  char bufs[4][16];
+  dncp_ext_msg_s msgs[4];
+  int i, r;
+
+  memset(&h1, 0, sizeof(h1));
+  memset(&h2, 0, sizeof(h2));
+  memset(&d1, 0, sizeof(d1));
+  memset(&d2, 0, sizeof(d2));
+  h1.udp_port = 62000;
+  h2.udp_port = 62001;
+  h1.dncp = &d1;
+  h2.dncp = &d2;
+  d1.ext = &h1.ext;
+  d2.ext = &h2.ext;
+  sput_fail_unless(hncp_io_init(&h1), "dncp_io_init h1");
+  sput_fail_unless(hncp_io_init(&h2), "dncp_io_init h2");
+
+  (void)inet_pton(AF_INET6, "::1", &a);
+  sockaddr_in6_set(&dst, &a, h2.udp_port);
+  for (i = 0 ; i < 3 ; i++)
+    h1.ext.cb.send(&h1.ext, &static_ep, NULL, &dst, &i, sizeof(i));
+  for (i = 0 ; i < 4 ; i++)
+    {
+      msgs[i].buf = bufs[i];
+      msgs[i].buf_len = sizeof(bufs[i]);
+    }
+  r = h2.ext.cb.recv_batch(&h2.ext, msgs, 4);
+  sput_fail_unless(r == 3, "3 packets received");
+  for (i = 0 ; i < r ; i++)
+    {
+      sput_fail_unless(msgs[i].len == sizeof(i), "len");
+      sput_fail_unless(*((int *)msgs[i].buf) == i, "in order");
+      sput_fail_unless(msgs[i].ep == &static_ep, "ep");
+      sput_fail_unless(msgs[i].dst == &msgs[i].dst_store, "unicast dst");
+      sput_fail_unless(msgs[i].src->sin6_port == htons(h1.udp_port),
+                       "src port");
+    }
+  r = h2.ext.cb.recv_batch(&h2.ext, msgs, 4);
+  sput_fail_unless(r < 0, "no more packets");
+
+  hncp_io_uninit(&h1);
+  hncp_io_uninit(&h2);
+}
+
+static void _stream_test_timeout(struct uloop_timeout *t)
+{
+  uloop_end();
+}
+
+/* Receive (at least) count messages from h, waiting for up to a
+ * second. */
+static int _stream_test_recv(hncp h, dncp_ext_msg msgs, int count)
+{
+  struct uloop_timeout to = { .cb = _stream_test_timeout };
+  int got = 0, r;
+
+  uloop_timeout_set(&to, 1000);
+  while (got < count && to.pending)
+    {
+      uloop_run();
+      while ((r = h->ext.cb.recv_batch(&h->ext, msgs + got,
+                                       count - got)) > 0)
+        got += r;
+    }
+  uloop_timeout_cancel(&to);
+  return got;
+}
+
+/* Unicast on a reliable stream endpoint goes over TCP, in order,
+ * with the message boundaries intact, and replies reuse the same
+ * connection. */
+static void dncp_io_stream(void)
+{
+  hncp_s h1, h2;
+  dncp_s d1, d2;
+  struct in6_addr a;
+  struct sockaddr_in6 dst;
+  static char bufs[4][3000];
+  static char big[2000];
+  dncp_ext_msg_s msgs[4];
+  hncp_stream s;
+  int i, r, n;
+
+  (void)uloop_init();
+  memset(&h1, 0, sizeof(h1));
+  memset(&h2, 0, sizeof(h2));
+  memset(&d1, 0, sizeof(d1));
+  memset(&d2, 0, sizeof(d2));
+  h1.udp_port = 62008;
+  h2.udp_port = 62009;
+  h1.dncp = &d1;
+  h2.dncp = &d2;
+  d1.ext = &h1.ext;
+  d2.ext = &h2.ext;
+  sput_fail_unless(hncp_io_init(&h1), "dncp_io_init h1");
+  sput_fail_unless(hncp_io_init(&h2), "dncp_io_init h2");
+  static_ep.unicast_is_reliable_stream = true;
+  readable_ends_loop = true;
+  stream_peers = 0;
+  sput_fail_unless(_stream_listen(&h2), "_stream_listen");
+
+  (void)inet_pton(AF_INET6, "::1", &a);
+  sockaddr_in6_set(&dst, &a, h2.udp_port);
+  memset(big, 42, sizeof(big));
+  for (i = 0 ; i < 2 ; i++)
+    h1.ext.cb.send(&h1.ext, &static_ep, NULL, &dst, &i, sizeof(i));
+  h1.ext.cb.send(&h1.ext, &static_ep, NULL, &dst, big, sizeof(big));
+  for (i = 0 ; i < 4 ; i++)
+    {
+      msgs[i].buf = bufs[i];
+      msgs[i].buf_len = sizeof(bufs[i]);
+    }
+  r = _stream_test_recv(&h2, msgs, 3);
+  sput_fail_unless(r == 3, "3 messages received");
+  sput_fail_unless(stream_peers == 2, "both ends connected");
+  for (i = 0 ; i < r ; i++)
+    {
+      sput_fail_unless(msgs[i].ep == &static_ep, "ep");
+      sput_fail_unless(msgs[i].dst && msgs[i].dst->sin6_port
+                       == htons(h2.udp_port), "dst port");
+      sput_fail_unless(msgs[i].src->sin6_port != htons(h1.udp_port),
+                       "src is the connection");
+    }
+  sput_fail_unless(msgs[0].len == sizeof(i) && *(int *)msgs[0].buf == 0
+                   && msgs[1].len == sizeof(i) && *(int *)msgs[1].buf == 1,
+                   "small ones in order");
+  sput_fail_unless(msgs[2].len == sizeof(big)
+                   && !memcmp(msgs[2].buf, big, sizeof(big)),
+                   "large one intact");
+
+  /* Reply goes back over the accepted connection. */
+  dst = *msgs[0].src;
+  h2.ext.cb.send(&h2.ext, &static_ep, NULL, &dst, big, sizeof(big));
+  n = 0;
+  list_for_each_entry(s, &h2.streams, lh)
+    n++;
+  sput_fail_unless(n == 1, "no new connection for reply");
+  r = _stream_test_recv(&h1, msgs, 1);
+  sput_fail_unless(r == 1 && msgs[0].len == sizeof(big), "reply received");
+  sput_fail_unless(r == 1 && msgs[0].src->sin6_port == htons(h2.udp_port),
+                   "reply from the listening port");
+
+  /* Closing one end disconnects the other. */
   hncp_io_uninit(&h1);
+  sput_fail_unless(stream_peers == 1, "h1 end disconnected");
+  r = _stream_test_recv(&h2, msgs, 1);
+  sput_fail_unless(stream_peers == 0 && list_empty(&h2.streams),
+                   "h2 end disconnected");
   hncp_io_uninit(&h2);
+  readable_ends_loop = false;
+  static_ep.unicast_is_reliable_stream = false;
+}
+
+#define STREAM_BURST 64
+
+/* A burst of complete frames, more than the receive buffer holds in
+ * total, is received in full without disconnecting. */
+static void dncp_io_stream_burst(void)
+{
+  hncp_s h1, h2;
+  dncp_s d1, d2;
+  struct in6_addr a;
+  struct sockaddr_in6 dst;
+  static char bufs[STREAM_BURST][2000];
+  static char big[2000];
+  dncp_ext_msg_s msgs[STREAM_BURST];
+  int i, r;
+
+  (void)uloop_init();
+  memset(&h1, 0, sizeof(h1));
+  memset(&h2, 0, sizeof(h2));
+  memset(&d1, 0, sizeof(d1));
+  memset(&d2, 0, sizeof(d2));
+  h1.udp_port = 62012;
+  h2.udp_port = 62013;
+  h1.dncp = &d1;
+  h2.dncp = &d2;
+  d1.ext = &h1.ext;
+  d2.ext = &h2.ext;
+  sput_fail_unless(hncp_io_init(&h1), "dncp_io_init h1");
+  sput_fail_unless(hncp_io_init(&h2), "dncp_io_init h2");
+  static_ep.unicast_is_reliable_stream = true;
+  readable_ends_loop = true;
+  stream_peers = 0;
+  sput_fail_unless(_stream_listen(&h2), "_stream_listen");
+
+  (void)inet_pton(AF_INET6, "::1", &a);
+  sockaddr_in6_set(&dst, &a, h2.udp_port);
+  for (i = 0 ; i < STREAM_BURST ; i++)
+    {
+      memset(big, i, sizeof(big));
+      h1.ext.cb.send(&h1.ext, &static_ep, NULL, &dst, big, sizeof(big));
+    }
+  for (i = 0 ; i < STREAM_BURST ; i++)
+    {
+      msgs[i].buf = bufs[i];
+      msgs[i].buf_len = sizeof(bufs[i]);
+    }
+  r = _stream_test_recv(&h2, msgs, STREAM_BURST);
+  sput_fail_unless(r == STREAM_BURST, "whole burst received");
+  for (i = 0 ; i < r ; i++)
+    sput_fail_unless(msgs[i].len == sizeof(big) && bufs[i][0] == i
+                     && bufs[i][sizeof(big) - 1] == i, "frame intact");
+  sput_fail_unless(stream_peers == 2, "still connected");
+
+  hncp_io_uninit(&h1);
+  hncp_io_uninit(&h2);
+  readable_ends_loop = false;
+  static_ep.unicast_is_reliable_stream = false;
+}
+
+/* With per-endpoint sockets, traffic to an enabled endpoint arrives
+ * on its own socket (with the endpoint known), and replies leave
+ * through it too. */
+static void dncp_io_per_ep_sockets(void)
+{
+  hncp_s h1, h2;
+  dncp_s d1, d2;
+  struct in6_addr a;
+  struct sockaddr_in6 dst;
+  char bufs[4][16];
+  dncp_ext_msg_s msgs[4];
+  int i, r;
+
+  (void)uloop_init();
+  memset(&h1, 0, sizeof(h1));
+  memset(&h2, 0, sizeof(h2));
+  memset(&d1, 0, sizeof(d1));
+  memset(&d2, 0, sizeof(d2));
+  memset(&static_hep, 0, sizeof(static_hep));
+  h1.udp_port = 62010;
+  h2.udp_port = 62011;
+  h1.dncp = &d1;
+  h2.dncp = &d2;
+  d1.ext = &h1.ext;
+  d2.ext = &h2.ext;
+  sput_fail_unless(hncp_io_init(&h1), "dncp_io_init h1");
+  sput_fail_unless(hncp_io_init(&h2), "dncp_io_init h2");
+  hncp_set_per_ep_sockets(&h2, true);
+  /* Loopback has no multicast, so open the socket directly. */
+  if (!_ep_socket_open(&h2, &static_ep, &static_hep))
+    {
+      /* No SO_BINDTODEVICE (privileges?); the shared socket is used. */
+      L_INFO("no per-endpoint socket, skipping the rest");
+      goto out;
+    }
+  readable_ends_loop = true;
+
+  (void)inet_pton(AF_INET6, "::1", &a);
+  sockaddr_in6_set(&dst, &a, h2.udp_port);
+  for (i = 0 ; i < 3 ; i++)
+    h1.ext.cb.send(&h1.ext, &static_ep, NULL, &dst, &i, sizeof(i));
+  for (i = 0 ; i < 4 ; i++)
+    {
+      msgs[i].buf = bufs[i];
+      msgs[i].buf_len = sizeof(bufs[i]);
+    }
+  r = _stream_test_recv(&h2, msgs, 3);
+  sput_fail_unless(r == 3, "3 packets received");
+  for (i = 0 ; i < r ; i++)
+    {
+      sput_fail_unless(*((int *)msgs[i].buf) == i, "in order");
+      sput_fail_unless(msgs[i].ep == &static_ep, "ep");
+      sput_fail_unless(msgs[i].dst == &msgs[i].dst_store, "unicast dst");
+    }
+  r = h2.ext.cb.recv_batch(&h2.ext, msgs, 4);
+  sput_fail_unless(r < 0 && list_empty(&h2.readable_eps),
+                   "ep socket drained");
+
+  /* Reply from the per-endpoint socket. */
+  dst = *msgs[0].src;
+  h2.ext.cb.send(&h2.ext, &static_ep, NULL, &dst, &i, sizeof(i));
+  r = _stream_test_recv(&h1, msgs, 1);
+  sput_fail_unless(r == 1 && msgs[0].src->sin6_port == htons(h2.udp_port),
+                   "reply received");
+  readable_ends_loop = false;
+
+ out:
+  hncp_io_ep_uninit(&h2, &static_ep);
+  sput_fail_unless(!static_hep.u46, "ep socket closed");
+  hncp_io_uninit(&h1);
+  hncp_io_uninit(&h2);
+}
+
+/* Batched receive gets all the queued packets, of both address
+ * families, with the correct destination addresses. */
+static void udp46_recv_batch_basic(void)
+{
+  udp46 s1 = udp46_create(62002);
+  udp46 s2 = udp46_create(62003);
+  struct sockaddr_in6 dst6, dst4;
+  struct in6_addr a6, a4;
+  char bufs[8][16];
+  udp46_msg_s msgs[8];
+  int i, r;
+
+  sput_fail_unless(s1 && s2, "udp46_create");
+  (void)inet_pton(AF_INET6, "::1", &a6);
+  (void)inet_pton(AF_INET6, "::ffff:127.0.0.1", &a4);
+  sockaddr_in6_set(&dst6, &a6, 62003);
+  sockaddr_in6_set(&dst4, &a4, 62003);
+  for (i = 0 ; i < 6 ; i++)
+    udp46_send(s1, NULL, i < 4 ? &dst6 : &dst4, &i, sizeof(i));
+  for (i = 0 ; i < 8 ; i++)
+    {
+      msgs[i].buf = bufs[i];
+      msgs[i].buf_size = sizeof(bufs[i]);
+    }
+  r = udp46_recv_batch(s2, msgs, 8);
+  sput_fail_unless(r == 6, "6 packets received");
+  for (i = 0 ; i < r ; i++)
+    {
+      sput_fail_unless(msgs[i].len == sizeof(i), "len");
+      sput_fail_unless(*((int *)msgs[i].buf) == i, "in order");
+      sput_fail_unless(memcmp(&msgs[i].dst.sin6_addr, i < 4 ? &a6 : &a4,
+                              sizeof(a6)) == 0, "dst");
+      sput_fail_unless(msgs[i].src.sin6_port == htons(62002), "src port");
+    }
+  r = udp46_recv_batch(s2, msgs, 8);
+  sput_fail_unless(r == 0, "no more packets");
+  udp46_destroy(s1);
+  udp46_destroy(s2);
+}
+
+/* Batched send delivers to both address families. */
+static void udp46_send_batch_basic(void)
+{
+  udp46 s1 = udp46_create(62006);
+  udp46 s2 = udp46_create(62007);
+  struct sockaddr_in6 dst6, dst4;
+  struct in6_addr a6, a4;
+  int values[4] = { 0, 1, 2, 3 };
+  struct iovec iov[4];
+  udp46_send_msg_s smsgs[4];
+  char bufs[8][16];
+  udp46_msg_s msgs[8];
+  int i, r, seen = 0;
+
+  sput_fail_unless(s1 && s2, "udp46_create");
+  (void)inet_pton(AF_INET6, "::1", &a6);
+  (void)inet_pton(AF_INET6, "::ffff:127.0.0.1", &a4);
+  sockaddr_in6_set(&dst6, &a6, 62007);
+  sockaddr_in6_set(&dst4, &a4, 62007);
+  for (i = 0 ; i < 4 ; i++)
+    {
+      iov[i].iov_base = &values[i];
+      iov[i].iov_len = sizeof(values[i]);
+      smsgs[i].src = NULL;
+      smsgs[i].dst = i % 2 ? &dst4 : &dst6;
+      smsgs[i].iov = &iov[i];
+      smsgs[i].iov_len = 1;
+    }
+  r = udp46_send_batch(s1, smsgs, 4);
+  sput_fail_unless(r == 4, "4 packets sent");
+  for (i = 0 ; i < 8 ; i++)
+    {
+      msgs[i].buf = bufs[i];
+      msgs[i].buf_size = sizeof(bufs[i]);
+    }
+  r = udp46_recv_batch(s2, msgs, 8);
+  sput_fail_unless(r == 4, "4 packets received");
+  for (i = 0 ; i < r ; i++)
+    {
+      int v = *((int *)msgs[i].buf);
+
+      sput_fail_unless(v >= 0 && v < 4, "valid payload");
+      sput_fail_unless(IN6_IS_ADDR_V4MAPPED(&msgs[i].dst.sin6_addr)
+                       == (v % 2), "right address family");
+      seen |= 1 << v;
+    }
+  sput_fail_unless(seen == 0xF, "all packets seen");
+  udp46_destroy(s1);
+  udp46_destroy(s2);
+}
+
+/* Loopback receive throughput, with udp46_recv against
+ * udp46_recv_batch. */
+#define UDP46_PERF_ROUNDS 2000
+#define UDP46_PERF_BATCH 32
+
+static int64_t _perf_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t _recv_perf(udp46 s1, udp46 s2, struct sockaddr_in6 *dst,
+                          bool batch, int *received)
+{
+  char bufs[UDP46_PERF_BATCH][256];
+  udp46_msg_s msgs[UDP46_PERF_BATCH];
+  int64_t total = 0, start;
+  int i, j, r;
+
+  memset(bufs, 0, sizeof(bufs));
+  for (i = 0 ; i < UDP46_PERF_ROUNDS ; i++)
+    {
+      for (j = 0 ; j < UDP46_PERF_BATCH ; j++)
+        udp46_send(s1, NULL, dst, bufs[j], 100);
+      start = _perf_ns();
+      if (batch)
+        {
+          for (j = 0 ; j < UDP46_PERF_BATCH ; j++)
+            {
+              msgs[j].buf = bufs[j];
+              msgs[j].buf_size = sizeof(bufs[j]);
+            }
+          while ((r = udp46_recv_batch(s2, msgs, UDP46_PERF_BATCH)) > 0)
+            *received += r;
+        }
+      else
+        {
+          struct sockaddr_in6 src, dst2;
+
+          while (udp46_recv(s2, &src, &dst2, bufs[0], sizeof(bufs[0])) > 0)
+            (*received)++;
+        }
+      total += _perf_ns() - start;
+    }
+  return total;
+}
+
+static void udp46_recv_perf(void)
+{
+  udp46 s1 = udp46_create(62004);
+  udp46 s2 = udp46_create(62005);
+  struct sockaddr_in6 dst;
+  struct in6_addr a;
+  int single_received = 0, batch_received = 0;
+
+  sput_fail_unless(s1 && s2, "udp46_create");
+  (void)inet_pton(AF_INET6, "::1", &a);
+  sockaddr_in6_set(&dst, &a, 62005);
+  int64_t single = _recv_perf(s1, s2, &dst, false, &single_received);
+  int64_t batch = _recv_perf(s1, s2, &dst, true, &batch_received);
+  sput_fail_unless(single_received > 0 && batch_received > 0,
+                   "packets received");
+  L_NOTICE("udp46 loopback receive: %.0f packets/s (batched: %.0f)",
+           single_received * 1e9 / single,
+           batch_received * 1e9 / batch);
+  udp46_destroy(s1);
+  udp46_destroy(s2);
 }
 
 int main(int argc, char **argv)
@@ -147,6 +662,13 @@ int main(int argc, char **argv)
   argv += 1;
 
   sput_maybe_run_test(dncp_io_basic_2, do {} while(0));
+  sput_maybe_run_test(dncp_io_batch, do {} while(0));
+  sput_maybe_run_test(dncp_io_stream, do {} while(0));
+  sput_maybe_run_test(dncp_io_stream_burst, do {} while(0));
+  sput_maybe_run_test(dncp_io_per_ep_sockets, do {} while(0));
+  sput_maybe_run_test(udp46_recv_batch_basic, do {} while(0));
+  sput_maybe_run_test(udp46_send_batch_basic, do {} while(0));
+  sput_maybe_run_test(udp46_recv_perf, do {} while(0));
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -179,6 +179,53 @@ nodeconnection_s nodeconnections[] = {
   {9, "eth3", 10, "eth2"},
 };
 
+void hncp_stream_disabled(void)
+{
+  /* Endpoints configured for unicast streams (with zero keepalive
+   * interval) use the default keepalive interval once the I/O stops
+   * carrying unicast over streams, without their configuration
+   * changing. */
+  net_sim_s s;
+  dncp n1, n2;
+  dncp_ep l1, l2;
+  dncp_ep_i li1, li2;
+
+  net_sim_init(&s);
+  s.fake_unicast_is_reliable_stream = true;
+  n1 = net_sim_find_dncp(&s, "n1");
+  n2 = net_sim_find_dncp(&s, "n2");
+  l1 = net_sim_dncp_find_ep_by_name(n1, "eth0");
+  l2 = net_sim_dncp_find_ep_by_name(n2, "eth1");
+  l1->keepalive_interval = 0;
+  l2->keepalive_interval = 0;
+  li1 = container_of(l1, dncp_ep_i_s, conf);
+  li2 = container_of(l2, dncp_ep_i_s, conf);
+
+  net_sim_set_connected(l1, l2, true);
+  net_sim_set_connected(l2, l1, true);
+  SIM_WHILE(&s, 1000, !net_sim_is_converged(&s));
+  sput_fail_unless(!li1->published_keepalive_interval, "no l1 keepalives");
+  sput_fail_unless(!li2->published_keepalive_interval, "no l2 keepalives");
+
+  net_sim_node_from_dncp(n1)->h.ext.conf.disable_unicast_streams = true;
+  net_sim_node_from_dncp(n2)->h.ext.conf.disable_unicast_streams = true;
+  dncp_schedule(n1);
+  dncp_schedule(n2);
+  SIM_WHILE(&s, 1000,
+            li1->published_keepalive_interval != HNCP_KEEPALIVE_INTERVAL
+            || li2->published_keepalive_interval != HNCP_KEEPALIVE_INTERVAL
+            || !net_sim_is_converged(&s));
+  sput_fail_unless(l1->unicast_is_reliable_stream && !l1->keepalive_interval,
+                   "l1 conf unchanged");
+
+  /* Keepalives notice one-sided disconnect again. */
+  net_sim_set_connected(l1, l2, false);
+  SIM_WHILE(&s, 10000, link_has_neighbors(l2));
+  net_sim_set_connected(l2, l1, false);
+  SIM_WHILE(&s, 10000, link_has_neighbors(l1));
+  net_sim_uninit(&s);
+}
+
 static void handle_connections(net_sim s,
                                nodeconnection_s *c,
                                int n_conns)
@@ -274,7 +321,10 @@ static void raw_bird14(net_sim s)
 
   s->accept_time_errors = true;
 
+  hnetd_time_t rejoin_time = hnetd_time();
   SIM_WHILE(s, 10000, !net_sim_is_converged(s));
+  L_NOTICE("converged %lld ms after rejoin",
+           (long long)(hnetd_time() - rejoin_time));
 
   net_sim_uninit(s);
 }
@@ -324,6 +374,28 @@ void hncp_bird14_unique()
   raw_bird14(&s);
 }
 
+/* Node data updates (e.g. new neighbors) are sent as deltas. */
+void hncp_bird14_d()
+{
+  net_sim_s s;
+
+  net_sim_init(&s);
+  s.fake_node_data_delta = true;
+  raw_bird14(&s);
+  sput_fail_unless(s.num_node_delta_applied > 0, "deltas applied");
+}
+
+/* Rejoining node gets everything in one go. */
+void hncp_bird14_b()
+{
+  net_sim_s s;
+
+  net_sim_init(&s);
+  s.fake_bulk_initial_sync = true;
+  raw_bird14(&s);
+  sput_fail_unless(s.num_bulk_state_sent > 0, "bulk states sent");
+}
+
 static void raw_hncp_tube(net_sim s, unsigned int num_nodes, bool no_conflicts)
 {
   /* A LOT of routers connected in a tube (R1 R2 R3 .. RN). */
@@ -463,6 +535,49 @@ void hncp_tube_beyond_multicast_unique(void)
   raw_hncp_tube(&s, BIG_TUBE_LENGTH, false);
 }
 
+/* Same as above, except without incremental reachability updates;
+ * compare the visited nodes/prune. */
+void hncp_tube_beyond_multicast_nc_fp(void)
+{
+  net_sim_s s;
+
+  net_sim_init(&s);
+  s.disable_incremental_prune = true;
+  raw_hncp_tube(&s, BIG_TUBE_LENGTH, true);
+}
+
+void hncp_tube_beyond_multicast_nc_h(void)
+{
+  net_sim_s s;
+
+  net_sim_init(&s);
+  s.fake_hierarchical_network_state = true;
+  raw_hncp_tube(&s, BIG_TUBE_LENGTH, true);
+  sput_fail_unless(s.max_sent_unicast_len <= HNCP_MAXIMUM_UNICAST_SIZE,
+                   "not too long unicast");
+}
+
+void hncp_tube_beyond_multicast_nc_b(void)
+{
+  net_sim_s s;
+
+  net_sim_init(&s);
+  s.fake_bulk_initial_sync = true;
+  raw_hncp_tube(&s, BIG_TUBE_LENGTH, true);
+}
+
+void hncp_tube_beyond_multicast_unique_h(void)
+{
+  net_sim_s s;
+
+  net_sim_init(&s);
+  s.use_global_ep_ids = true;
+  s.fake_hierarchical_network_state = true;
+  raw_hncp_tube(&s, BIG_TUBE_LENGTH, false);
+  sput_fail_unless(s.max_sent_unicast_len <= HNCP_MAXIMUM_UNICAST_SIZE,
+                   "not too long unicast");
+}
+
 /* Note: As we play with bitmasks,
    NUM_MONKEY_ROUTERS * NUM_MONKEY_PORTS^2 <= 31
 */
@@ -656,7 +771,7 @@ void monkey_debug_print(net_sim s, int *ma)
 #define monkey_debug_print(s,ma)
 #endif /* L_LEVEL >= L_DEBUG */
 
-void hncp_random_monkey(void)
+static void raw_hncp_random_monkey(bool disable_incremental_prune)
 {
   /* This is a sanity checker for the neighbor graph of HNCP.
    * Notably, it involves bunch of monkeys that do random connections.
@@ -669,6 +784,8 @@ void hncp_random_monkey(void)
 
   memset(ma, 0, sizeof(ma));
   net_sim_init(&s);
+  s.disable_incremental_prune = disable_incremental_prune;
+  s.check_reachability = true;
   s.disable_multicast = true;
   s.disable_sd = true; /* we don't care about sd */
   s.disable_pa = true; /* TBD we SHOULD care about pa but it does not work :p */
@@ -727,6 +844,16 @@ void hncp_random_monkey(void)
 
 }
 
+void hncp_random_monkey(void)
+{
+  raw_hncp_random_monkey(false);
+}
+
+void hncp_random_monkey_fp(void)
+{
+  raw_hncp_random_monkey(true);
+}
+
 struct tlv_attr *
 always_failing_validate_node_data(dncp_node n, struct tlv_attr *a)
 {
@@ -803,6 +930,97 @@ void hncp_expiration(void)
 }
 
 
+static int going_away_removals, other_removals;
+
+static void _count_removals_cb(dncp_subscriber s __unused,
+                               dncp_node n, struct tlv_attr *tlv __unused,
+                               bool add)
+{
+  if (add)
+    return;
+  if (dncp_node_is_going_away(n))
+    going_away_removals++;
+  else
+    other_removals++;
+}
+
+void hncp_pa_node_removal(void)
+{
+  /* AP and RA TLVs of a node are mirrored one by one by hncp_pa while
+   * the node is reachable; once it goes away, they are withdrawn in
+   * bulk and the per-TLV removals are flagged as such. */
+  static const uint16_t types[] = { HNCP_T_ASSIGNED_PREFIX,
+                                    HNCP_T_ROUTER_ADDRESS, 0 };
+  dncp_subscriber_s sub = { .tlv_change_cb = _count_removals_cb,
+                            .tlv_types = types };
+  net_sim_s s;
+  dncp n1, n2;
+  dncp_ep l1, l2;
+  struct avl_tree *aps, *ras;
+  struct __packed {
+    hncp_t_assigned_prefix_header_s h;
+    struct in6_addr addr;
+  } ap;
+  hncp_t_router_address_s ra;
+
+  net_sim_init(&s);
+  /* n1 publishes only what we add by hand. */
+  s.disable_pa = true;
+  n1 = net_sim_find_dncp(&s, "n1");
+  s.disable_pa = false;
+  n2 = net_sim_find_dncp(&s, "n2");
+  /* n2 indexes only the remote ones, i.e. those of n1. */
+  aps = __hpa_get_aps(net_sim_node_from_dncp(n2)->pa);
+  ras = __hpa_get_ras(net_sim_node_from_dncp(n2)->pa);
+  l1 = net_sim_dncp_find_ep_by_name(n1, "eth0");
+  l2 = net_sim_dncp_find_ep_by_name(n2, "eth1");
+  going_away_removals = other_removals = 0;
+  dncp_subscribe(n2, &sub);
+
+  net_sim_set_connected(l1, l2, true);
+  net_sim_set_connected(l2, l1, true);
+  SIM_WHILE(&s, 1000, !net_sim_is_converged(&s));
+  sput_fail_unless(!aps->count, "no aps");
+  sput_fail_unless(!ras->count, "no ras");
+
+  memset(&ap, 0, sizeof(ap));
+  ap.h.ep_id = dncp_ep_get_id(l1);
+  ap.h.prefix_length_bits = 64;
+  inet_pton(AF_INET6, "2001:db8:1::", &ap.addr);
+  memset(&ra, 0, sizeof(ra));
+  ra.ep_id = ap.h.ep_id;
+  inet_pton(AF_INET6, "2001:db8:1::1", &ra.address);
+  dncp_add_tlv(n1, HNCP_T_ASSIGNED_PREFIX, &ap, sizeof(ap.h) + 8, 0);
+  dncp_add_tlv(n1, HNCP_T_ROUTER_ADDRESS, &ra, sizeof(ra), 0);
+  SIM_WHILE(&s, 1000, !net_sim_is_converged(&s)
+            || !aps->count || !ras->count);
+  sput_fail_unless(aps->count == 1, "1 ap");
+  sput_fail_unless(ras->count == 1, "1 ra");
+
+  /* Removal of a single TLV is reflected on its own. */
+  dncp_remove_tlvs_by_type(n1, HNCP_T_ASSIGNED_PREFIX);
+  SIM_WHILE(&s, 1000, !net_sim_is_converged(&s) || aps->count);
+  sput_fail_unless(!aps->count, "ap removed");
+  sput_fail_unless(ras->count == 1, "ra kept");
+  sput_fail_unless(other_removals == 1, "1 plain removal");
+  sput_fail_unless(!going_away_removals, "no going away removals");
+
+  dncp_add_tlv(n1, HNCP_T_ASSIGNED_PREFIX, &ap, sizeof(ap.h) + 8, 0);
+  SIM_WHILE(&s, 1000, !net_sim_is_converged(&s) || !aps->count);
+
+  /* Node removal withdraws both at once. */
+  net_sim_set_connected(l1, l2, false);
+  net_sim_set_connected(l2, l1, false);
+  SIM_WHILE(&s, 10000, aps->count || ras->count);
+  sput_fail_unless(!aps->count, "aps withdrawn");
+  sput_fail_unless(!ras->count, "ras withdrawn");
+  sput_fail_unless(other_removals == 1, "no new plain removals");
+  sput_fail_unless(going_away_removals == 2, "2 going away removals");
+
+  dncp_unsubscribe(n2, &sub);
+  net_sim_uninit(&s);
+}
+
 
 #define test_setup() srandom(seed)
 #define maybe_run_test(fun) sput_maybe_run_test(fun, test_setup())
@@ -837,17 +1055,26 @@ int main(__unused int argc, __unused char **argv)
   maybe_run_test(hncp_version);
   maybe_run_test(hncp_expiration);
   maybe_run_test(hncp_two);
+  maybe_run_test(hncp_pa_node_removal);
   maybe_run_test(hncp_bird14);
   maybe_run_test(hncp_bird14_u);
   maybe_run_test(hncp_bird14_us);
   maybe_run_test(hncp_bird14_u_us);
+  maybe_run_test(hncp_stream_disabled);
   maybe_run_test(hncp_bird14_unique);
+  maybe_run_test(hncp_bird14_d);
+  maybe_run_test(hncp_bird14_b);
   maybe_run_test(hncp_tube_small);
   maybe_run_test(hncp_tube_medium);
   maybe_run_test(hncp_tube_medium_nc);
   maybe_run_test(hncp_tube_beyond_multicast_nc);
   maybe_run_test(hncp_tube_beyond_multicast_unique);
+  maybe_run_test(hncp_tube_beyond_multicast_nc_fp);
+  maybe_run_test(hncp_tube_beyond_multicast_nc_h);
+  maybe_run_test(hncp_tube_beyond_multicast_nc_b);
+  maybe_run_test(hncp_tube_beyond_multicast_unique_h);
   maybe_run_test(hncp_random_monkey);
+  maybe_run_test(hncp_random_monkey_fp);
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -218,6 +218,15 @@ void test_hncp_sd(void)
   sput_fail_unless(!rv, "reconfigure pcp works (2)");
   debug_exec = false;
 
+  /* External connection (delegated prefix) changes elsewhere should
+   * trigger PCP update too. */
+  node2->sd->should_update = 0;
+  dncp_add_tlv(n1, HNCP_T_EXTERNAL_CONNECTION, NULL, 0, 0);
+  SIM_WHILE(&s, 100, !(node2->sd->should_update & UPDATE_FLAG_PCP));
+  node2->sd->should_update = 0;
+  dncp_remove_tlv_matching(n1, HNCP_T_EXTERNAL_CONNECTION, NULL, 0);
+  SIM_WHILE(&s, 100, !(node2->sd->should_update & UPDATE_FLAG_PCP));
+
 
   /* Add third node, with hardcoded .domain (yay). It should result in
    * .home disappearing from n1 eventually. */
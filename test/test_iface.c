@@ -35,6 +35,10 @@ void platform_restart_dhcpv4(__unused struct iface *c) {}
 void platform_set_snat(__unused struct iface *c, __unused const struct prefix *p) {}
 void hncp_sd_dump_link_fqdn(__unused hncp_sd sd, __unused dncp_ep l, __unused const char *ifname, __unused char *buf, __unused size_t buf_len) {}
 dncp_ep dncp_find_ep_by_name(__unused dncp h, __unused const char *ifname) { return NULL; }
+dncp_ep dncp_find_ep_by_ifindex(__unused dncp h, __unused uint32_t ifindex) { return NULL; }
+bool dncp_ep_set_ifindex(__unused dncp_ep ep, __unused uint32_t ifindex) { return false; }
+dncp_ep dncp_get_first_ep(__unused dncp h) { return NULL; }
+dncp_ep dncp_ep_get_next(__unused dncp_ep ep) { return NULL; }
 void hncp_link_register(__unused struct hncp_link *c, __unused struct hncp_link_user *u) {}
 
 void intiface_mock(__unused struct iface_user *u, __unused const char *ifname, bool enabled)
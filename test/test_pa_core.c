@@ -169,6 +169,11 @@ static enum pa_rule_target test_rule_match(struct pa_rule *rule, struct pa_ldp *
 	return t->target;
 }
 
+static pa_rule_priority test_rule_bound(struct pa_rule *rule)
+{
+	return container_of(rule, struct test_rule, rule)->priority;
+}
+
 #define CUSTOM_RULE_INIT {.filter_accept = test_rule_filter_accept, .get_max_priority = test_rule_prio, .match = test_rule_match}
 
 #define cr_check_ctr(cr, filter, prio, match) do{\
@@ -501,13 +506,13 @@ void pa_core_rule() {
 	sput_fail_if(fu_next(), "No scheduled timer.");
 
 	pa_rule_add(&core, &rule1.rule);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY, "Correct delay");
+	sput_fail_unless(pa_ldp_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY, "Correct delay");
 
 	set_time(hnetd_time() + 1);
 	pa_rule_add(&core, &rule2.rule);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY - 1, "Correct delay");
+	sput_fail_unless(pa_ldp_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY - 1, "Correct delay");
 
 	rule1.filter_accept = 0;
 	rule2.filter_accept = 0;
@@ -781,6 +786,16 @@ void pa_core_rule() {
 	check_ldp_prefix(ldp, &advp1_01.prefix, advp1_01.plen);
 	check_ldp_publish(ldp, &rule2.rule, 4, 2);
 
+	//Bounded rules which can't beat the current rule priority are not even filtered
+	pa_rule_del(&core, &rule1.rule);
+	rule1.rule.get_priority_bound = test_rule_bound;
+	pa_rule_add(&core, &rule1.rule);
+	fu_loop(1);
+	cr_check_ctr(&rule1, 0, 0, 0);
+	cr_check_ctr(&rule2, 1, 1, 0);
+	check_ldp_flags(ldp, true, true, true, false);
+	check_ldp_publish(ldp, &rule2.rule, 4, 2);
+
 	//Destroy the rule that published the prefix
 	rule1.target = PA_RULE_NO_MATCH;
 	pa_rule_del(&core, &rule2.rule);
@@ -816,14 +831,14 @@ void pa_core_norule() {
 
 	//Test scheduling
 	sput_fail_unless(ldp, "ldp present");
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY, "Correct delay");
-	sput_fail_unless(fu_next() == &ldp->routine_to, "Correct timeout");
+	sput_fail_unless(pa_ldp_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY, "Correct delay");
+	sput_fail_unless(fu_next() == &core.routine_to, "Correct timeout");
 
 	set_time(hnetd_time() + 1);
 	pa_core_set_node_id(&core, &id1); //Reschedule
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY - 1, "Correct delay");
+	sput_fail_unless(pa_ldp_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY - 1, "Correct delay");
 
 	//Adding user
 	pa_user_register(&core, &tuser.user);
@@ -845,7 +860,7 @@ void pa_core_norule() {
 	advp2_01.priority = 2;
 	pa_advp_add(&core, &advp2_01);
 	pa_advp_update(&core, &advp2_01);
-	sput_fail_if(ldp->routine_to.pending, "Not routine pending");
+	sput_fail_if(core.routine_to.pending, "Not routine pending");
 	sput_fail_if(fu_next(), "No pending timeout");
 
 	//advp added
@@ -863,8 +878,8 @@ void pa_core_norule() {
 	advp1_01.link = NULL;
 	advp1_01.priority = 2;
 	pa_advp_add(&core, &advp1_01);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY, "Correct delay");
+	sput_fail_unless(pa_ldp_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY, "Correct delay");
 	fu_loop(1);
 	check_user(&tuser, NULL, NULL, NULL);
 	check_ldp_flags(ldp, false, false, false, false);
@@ -878,8 +893,8 @@ void pa_core_norule() {
 	//Accept a prefix
 	advp1_01.link = &l1;
 	pa_advp_update(&core, &advp1_01);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY, "Correct delay");
+	sput_fail_unless(pa_ldp_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY, "Correct delay");
 	fu_loop(1);
 	check_user(&tuser, ldp, NULL, NULL);
 	check_ldp_flags(ldp, 1, 0, 0, 0);
@@ -892,18 +907,18 @@ void pa_core_norule() {
 
 	//Remove adv2_01
 	pa_advp_del(&core, &advp2_01);
-	sput_fail_if(ldp->routine_to.pending, "Not routine pending");
+	sput_fail_if(core.routine_to.pending, "Not routine pending");
 
 	//Remove and add adv1_01 again
 	pa_advp_del(&core, &advp1_01);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
+	sput_fail_unless(pa_ldp_routine_pending(ldp), "Routine pending");
 	check_user(&tuser, NULL, NULL, NULL);
 	check_ldp_flags(ldp, 1, 0, 0, 0);
 
 	set_time(hnetd_time() + 1);
 	pa_advp_add(&core, &advp1_01);
-	sput_fail_unless(ldp->routine_to.pending, "Routine pending");
-	sput_fail_unless(uloop_timeout_remaining(&ldp->routine_to) == PA_RUN_DELAY - 1, "Correct delay");
+	sput_fail_unless(pa_ldp_routine_pending(ldp), "Routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY - 1, "Correct delay");
 	fu_loop(1);
 	check_user(&tuser, NULL, NULL, NULL);
 	check_ldp_flags(ldp, 1, 0, 0, 0);
@@ -989,7 +1004,7 @@ void pa_core_norule() {
 
 	//Remove the link from core
 	pa_link_del(&l1);
-	sput_fail_if(ldp->routine_to.pending, "Not routine pending");
+	sput_fail_if(core.routine_to.pending, "Not routine pending");
 	sput_fail_if(fu_next(), "No pending timeout");
 	check_user(&tuser, ldp, NULL, NULL);
 
@@ -1016,8 +1031,65 @@ void pa_core_norule() {
 	sput_fail_if(fu_next(), "No scheduled timer.");
 }
 
+void pa_core_schedule() {
+	struct pa_core core;
+	struct pa_ldp *ldp;
+	struct pa_advp advp = {.plen = 40, .prefix = {{{0x20, 0x01, 0, 0, 0}}}};
+	int pending;
+
+	sput_fail_if(fu_next(), "No pending timeout");
+
+	pa_core_init(&core);
+	pa_link_add(&core, &l1);
+	pa_link_add(&core, &l2);
+	pa_dp_add(&core, &d1);
+	pa_dp_add(&core, &d2);
+
+	//A single timer for all pairs
+	sput_fail_unless(fu_next() == &core.routine_to, "Correct timeout");
+	fu_loop(1);
+	sput_fail_if(fu_next(), "No pending timeout");
+
+	//Advertised prefixes only schedule pairs of overlapping dps
+	advp1_01.link = NULL;
+	advp1_02.link = NULL;
+	pa_advp_add(&core, &advp1_01);
+	pa_advp_add(&core, &advp1_02);
+	pa_for_each_ldp_in_dp(&d1, ldp)
+		sput_fail_unless(pa_ldp_routine_pending(ldp), "Routine pending");
+	pa_for_each_ldp_in_dp(&d2, ldp)
+		sput_fail_if(pa_ldp_routine_pending(ldp), "Not routine pending");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY, "Correct delay");
+
+	//A containing advertised prefix schedules all dps
+	set_time(hnetd_time() + 1);
+	pa_advp_add(&core, &advp);
+	pending = 0;
+	list_for_each_entry(ldp, &core.dirty_ldps, in_dirty)
+		pending++;
+	sput_fail_unless(pending == 4, "All pairs pending once");
+	sput_fail_unless(uloop_timeout_remaining(&core.routine_to) == PA_RUN_DELAY - 1, "Correct delay");
+
+	//Everything is run at once
+	fu_loop(1);
+	sput_fail_if(fu_next(), "No pending timeout");
+	sput_fail_unless(list_empty(&core.dirty_ldps), "No pair pending");
+
+	//Destroying the last pending pair cancels the timer
+	pa_advp_del(&core, &advp);
+	pa_advp_del(&core, &advp1_01);
+	pa_advp_del(&core, &advp1_02);
+	pa_dp_del(&d1);
+	pa_dp_del(&d2);
+	sput_fail_if(fu_next(), "No pending timeout");
+
+	pa_link_del(&l1);
+	pa_link_del(&l2);
+}
+
 void pa_core_data() {
 	struct pa_core core;
+	struct pa_dp *dp;
 	sput_fail_if(fu_next(), "No pending timeout");
 
 	pa_core_init(&core);
@@ -1043,6 +1115,11 @@ void pa_core_data() {
 	pa_dp_del(&d1);
 
 	sput_fail_if(pa_link_add(&core, &l1), "Add L1");
+	btrie_fail = true;
+	sput_fail_unless(pa_dp_add(&core, &d1), "Can't add DP1");
+	btrie_fail = false;
+	pa_for_each_dp(&core, dp)
+		sput_fail_if(dp == &d1, "DP1 not added");
 	sput_fail_if(pa_dp_add(&core, &d1), "Add DP1");
 
 	/* Test adding PPs */
@@ -1066,9 +1143,7 @@ void pa_core_data() {
 	pa_advp_del(&core, &advp2_01);
 
 	/* Adding rules */
-	struct pa_rule r1,r2;
-	r1.name = "Rule 1";
-	r2.name = "Rule 2";
+	struct pa_rule r1 = {.name = "Rule 1"}, r2 = {.name = "Rule 2"};
 	pa_rule_add(&core, &r1);
 	pa_rule_add(&core, &r2);
 	pa_rule_del(&core, &r1);
@@ -1100,6 +1175,7 @@ int main() {
 	sput_start_testing();
 	sput_enter_suite("Prefix assignment tests"); /* optional */
 	sput_run_test(pa_core_data);
+	sput_run_test(pa_core_schedule);
 	sput_run_test(pa_core_norule);
 	sput_run_test(pa_core_rule);
 	sput_run_test(pa_core_hierarchical);
@@ -78,7 +78,7 @@ struct in6_addr
 pa_plen test_desired_plen = 0;
 pa_plen test_desired_plen_cb(__unused struct pa_rule *r,
 		__unused struct pa_ldp *ldp,
-		__unused uint16_t prefix_count[PA_RAND_MAX_PLEN + 1])
+		__unused uint32_t prefix_count[PA_RAND_MAX_PLEN + 1])
 {
 	return test_desired_plen;
 }